@@ -7,6 +7,12 @@
 #include "button_manager.h"
 #include "vcp_controller.h"
 #include "battery_reader.h"
+#include "state_reconciler.h"
+
+#include <stdlib.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
 
 LOG_MODULE_REGISTER(app_controller, LOG_LEVEL_INF);
 
@@ -41,6 +47,7 @@ struct app_event {
 	enum app_event_type type;
 	uint8_t device_id;
 	uint8_t error_code;
+	uint16_t presses; // Button events: presses merged into this event
 	void *data;
 };
 
@@ -60,6 +67,132 @@ static bool device_services_complete[CONFIG_BT_MAX_CONN];
 static uint8_t devices_pending_completion = 0;
 static bool parallel_discovery_active = false;
 
+/* Wake button fast path: a volume wake press is sent as soon as VCP is usable,
+ * BAS and HAS discovery follow in the background */
+static bool wake_fast_path = false;
+static bool wake_cmd_sent[CONFIG_BT_MAX_CONN];
+static bool has_discovery_queued[CONFIG_BT_MAX_CONN];
+static bool wake_snapshot_queued[CONFIG_BT_MAX_CONN];
+
+/* Button presses not taken by the app thread yet. Only the first press of a
+ * burst puts an event into the queue, later ones are added to its count, so a
+ * held or hammered key takes at most one queue entry per button and cannot
+ * crowd out connection and discovery events. */
+enum app_press {
+	PRESS_VOLUME_UP,
+	PRESS_VOLUME_DOWN,
+	PRESS_PRESET,
+	PRESS_COUNT,
+};
+
+static atomic_t pending_presses[PRESS_COUNT];
+
+/* Event queue counters, also updated from button ISRs */
+static atomic_t events_posted;
+static atomic_t presses_merged;
+static atomic_t events_dropped;
+
+/* Press counter of a button event, -1 for other events */
+static int press_index(enum app_event_type type)
+{
+	switch (type) {
+	case EVENT_VOLUME_UP_BUTTON_PRESSED:
+		return PRESS_VOLUME_UP;
+	case EVENT_VOLUME_DOWN_BUTTON_PRESSED:
+		return PRESS_VOLUME_DOWN;
+	case EVENT_PRESET_BUTTON_PRESSED:
+		return PRESS_PRESET;
+	default:
+		return -1;
+	}
+}
+
+/* Queue an event without waiting, callable from ISRs */
+static int8_t app_event_put(const struct app_event *evt)
+{
+	int press = press_index(evt->type);
+
+	if (press >= 0 && atomic_inc(&pending_presses[press]) > 0) {
+		/* The queued event of this button takes the press along */
+		atomic_inc(&presses_merged);
+		return 0;
+	}
+
+	int err = k_msgq_put(&app_event_queue, evt, K_NO_WAIT);
+	if (err) {
+		/* Presses merged meanwhile had no event either, the next press starts over */
+		atomic_add(&events_dropped, press >= 0 ? atomic_set(&pending_presses[press], 0) : 1);
+		LOG_WRN("App event queue full, dropping event %d", evt->type);
+		return err;
+	}
+
+	atomic_inc(&events_posted);
+	return 0;
+}
+
+/* Take the next event, with the presses merged into a button event */
+static int app_event_get(struct app_event *evt, k_timeout_t timeout)
+{
+	int err = k_msgq_get(&app_event_queue, evt, timeout);
+	if (err == 0) {
+		int press = press_index(evt->type);
+
+		if (press >= 0) {
+			evt->presses = atomic_set(&pending_presses[press], 0);
+		}
+	}
+
+	return err;
+}
+
+/* Send the volume command of the button that woke us to one device */
+static void send_wake_command(uint8_t device_id)
+{
+	if (power_manager_wake_button == VOLUME_UP_BTN_ID) {
+		state_reconciler_step_volume(device_id, 1);
+	} else if (power_manager_wake_button == VOLUME_DOWN_BTN_ID) {
+		state_reconciler_step_volume(device_id, -1);
+	}
+
+	wake_cmd_sent[device_id] = true;
+}
+
+/* Shorten the connection interval of the links a button press was sent to */
+static void boost_links(uint8_t count)
+{
+	for (uint8_t i = 0; i < count; i++) {
+		ble_manager_boost_conn(i);
+	}
+}
+
+/* Start the service discovery chain of a device as soon as it is ready */
+static void start_device_services(uint8_t device_id)
+{
+	/* A reused link may still have the idle parameters */
+	ble_manager_set_conn_profile(device_id, BLE_CONN_PROFILE_DISCOVERY);
+
+	if (wake_fast_path) {
+		LOG_DBG("Fast path: discovering VCP first for device %d", device_id);
+		vcp_controller_reset(device_id);
+		ble_cmd_vcp_discover(device_id, false);
+	} else {
+		battery_reader_reset(device_id);
+		ble_cmd_bas_discover(device_id, false);
+	}
+}
+
+/* Queue HAS discovery once per device, VCP_STATE_READ may be reported again */
+static void queue_has_discovery(uint8_t device_id)
+{
+	if (has_discovery_queued[device_id]) {
+		return;
+	}
+
+	has_discovery_queued[device_id] = true;
+	has_controller_reset(device_id);
+	ble_cmd_has_discover(device_id, false);
+}
+
 void app_controller_thread(void)
 {
 	struct app_event evt;
@@ -68,7 +201,7 @@ void app_controller_thread(void)
 
 	state = SM_WAKE;
 
-	while (k_msgq_get(&app_event_queue, &evt, K_FOREVER))
+	while (app_event_get(&evt, K_FOREVER))
 		;
 	if (evt.type != EVENT_SYSTEM_READY) {
 		LOG_ERR("Expected EVENT_SYSTEM_READY, got %d", evt.type);
@@ -88,7 +221,7 @@ void app_controller_thread(void)
 			}
 
 			// Wait for an event to trigger action
-			int ret = k_msgq_get(&app_event_queue, &evt, APP_CONTROLLER_ACTION_TIMEOUT);
+			int ret = app_event_get(&evt, APP_CONTROLLER_ACTION_TIMEOUT);
 			if (ret == -EAGAIN) {
 				// Timeout, loop back to wait for event for now
 				LOG_DBG("SM_IDLE: No event received, entering deep sleep");
@@ -107,57 +240,66 @@ void app_controller_thread(void)
 
 				/**
 				 * Volume up button pressed event
-				 * In single device operation, send volume up to device 0
-				 * In dual device operation, send volume up to both devices
+				 * In single device operation, raise the volume target of device 0
+				 * In dual device operation, raise the volume target of both devices at once
 				 */
 			case EVENT_VOLUME_UP_BUTTON_PRESSED:
-				LOG_DBG("SM_IDLE: Volume up button pressed");
-				if (bonded_devices_count == 1) {
-					ble_cmd_vcp_volume_up(
-						0,
-						false); // Device ID 0 for single device operation
-				} else if (bonded_devices_count == 2) {
-					ble_cmd_vcp_volume_up(
-						0, false); // Device ID 0 for dual device operation
-					ble_cmd_vcp_volume_up(
-						1, false); // Device ID 1 for dual device operation
-				} else {
-					LOG_WRN("No connected device to send volume up command, "
-						"bonded_devices_count=%d",
-						bonded_devices_count);
+				LOG_DBG("SM_IDLE: Volume up button pressed %u time(s)", evt.presses);
+				for (uint16_t i = 0; i < evt.presses; i++) {
+					if (bonded_devices_count == 1) {
+						// Device ID 0 for single device operation
+						state_reconciler_step_volume(0, 1);
+					} else if (bonded_devices_count == 2) {
+						// Both ears change together
+						state_reconciler_step_volume_binaural(1);
+					} else {
+						LOG_WRN("No connected device to send volume up command, "
+							"bonded_devices_count=%d",
+							bonded_devices_count);
+						break;
+					}
 				}
+				boost_links(bonded_devices_count);
 				break;
 
 				/**
 				 * Volume down button pressed event
-				 * In single device operation, send volume down to device 0
-				 * In dual device operation, send volume down to both devices
+				 * In single device operation, lower the volume target of device 0
+				 * In dual device operation, lower the volume target of both devices at once
 				 */
 			case EVENT_VOLUME_DOWN_BUTTON_PRESSED:
-				LOG_DBG("SM_IDLE: Volume down button pressed");
-				if (bonded_devices_count == 1) {
-					ble_cmd_vcp_volume_down(
-						0,
-						false); // Device ID 0 for single device operation
-				} else if (bonded_devices_count == 2) {
-					ble_cmd_vcp_volume_down(
-						0, false); // Device ID 0 for dual device operation
-					ble_cmd_vcp_volume_down(
-						1, false); // Device ID 1 for dual device operation
-				} else {
-					LOG_WRN("No connected device to send volume down command");
+				LOG_DBG("SM_IDLE: Volume down button pressed %u time(s)", evt.presses);
+				for (uint16_t i = 0; i < evt.presses; i++) {
+					if (bonded_devices_count == 1) {
+						// Device ID 0 for single device operation
+						state_reconciler_step_volume(0, -1);
+					} else if (bonded_devices_count == 2) {
+						// Both ears change together
+						state_reconciler_step_volume_binaural(-1);
+					} else {
+						LOG_WRN("No connected device to send volume down command");
+						break;
+					}
 				}
+				boost_links(bonded_devices_count);
 				break;
 
 			case EVENT_PRESET_BUTTON_PRESSED:
-				LOG_DBG("SM_IDLE: Preset button pressed, going to next preset");
+				LOG_DBG("SM_IDLE: Preset button pressed %u time(s), going to next preset",
+					evt.presses);
 				if (bonded_devices_count == 0) {
 					LOG_WRN("No connected device to send preset command");
 					break;
 				}
 
-				ble_cmd_has_next_preset(0, false); // HI uses synced presets, so
-								   // only send to one device
+				// HI uses synced presets, so only send to one device. Without
+				// the preset list the target is unknown, step relatively.
+				for (uint16_t i = 0; i < evt.presses; i++) {
+					if (state_reconciler_next_preset(0) == -ENOENT) {
+						ble_cmd_has_next_preset(0, false);
+					}
+				}
+				boost_links(1);
 				break;
 
 			case EVENT_PAIR_BUTTON_PRESSED:
@@ -166,7 +308,7 @@ void app_controller_thread(void)
 				button_manager_reset_buttons();
 
 				devices_manager_clear_all_bonds();
-				while (k_msgq_get(&app_event_queue, &evt, K_FOREVER))
+				while (app_event_get(&evt, K_FOREVER))
 					;
 				if (evt.type != EVENT_BONDS_CLEARED) {
 					LOG_ERR("Expected EVENT_BONDS_CLEARED after clearing "
@@ -185,9 +327,9 @@ void app_controller_thread(void)
 					app_controller_notify_device_disconnected(1);
 				}
 
-				while (k_msgq_get(&app_event_queue, &evt, K_FOREVER))
+				while (app_event_get(&evt, K_FOREVER))
 					; // Wait for device disconnect
-				while (k_msgq_get(&app_event_queue, &evt, K_FOREVER))
+				while (app_event_get(&evt, K_FOREVER))
 					; // Wait for device disconnect
 
 				devices_manager_reset_device_contexts();
@@ -198,7 +340,7 @@ void app_controller_thread(void)
 			case EVENT_CLEAR_BONDS_BUTTON_PRESSED:
 				LOG_DBG("SM_IDLE: Clear bonds button pressed, clearing all bonds");
 				devices_manager_clear_all_bonds();
-				while (k_msgq_get(&app_event_queue, &evt, K_FOREVER))
+				while (app_event_get(&evt, K_FOREVER))
 					;
 				if (evt.type != EVENT_BONDS_CLEARED) {
 					LOG_ERR("Expected EVENT_BONDS_CLEARED after clearing "
@@ -224,9 +366,9 @@ void app_controller_thread(void)
 		case SM_POWER_OFF:
 			LOG_DBG("SM_POWER_OFF: Powering off device");
 			power_manager_prepare_power_off();
-			while (k_msgq_get(&app_event_queue, &evt, K_FOREVER))
+			while (app_event_get(&evt, K_FOREVER))
 				; // Wait for device disconnect
-			while (k_msgq_get(&app_event_queue, &evt, K_FOREVER))
+			while (app_event_get(&evt, K_FOREVER))
 				; // Wait for device disconnect
 			power_manager_power_off();
 			break;
@@ -237,7 +379,7 @@ void app_controller_thread(void)
 					"starting first time use procedure");
 				button_manager_reset_buttons();
 				devices_manager_clear_all_bonds();
-				while (k_msgq_get(&app_event_queue, &evt, K_FOREVER))
+				while (app_event_get(&evt, K_FOREVER))
 					;
 				if (evt.type != EVENT_BONDS_CLEARED) {
 					LOG_ERR("Expected EVENT_BONDS_CLEARED after clearing "
@@ -259,7 +401,7 @@ void app_controller_thread(void)
 			ble_manager_start_scan_for_HIs();
 
 			/* The ble_manager gets 60 seconds to scan for devices */
-			if (k_msgq_get(&app_event_queue, &evt, K_MSEC(BT_SCAN_TIMEOUT_MS)) == 0) {
+			if (app_event_get(&evt, K_MSEC(BT_SCAN_TIMEOUT_MS)) == 0) {
 				if (evt.type == EVENT_SCAN_COMPLETE) {
 					uint8_t device_count =
 						devices_manager_get_scanned_device_count();
@@ -310,8 +452,7 @@ void app_controller_thread(void)
 				0, 0); // Connects to first scanned device using Device 0
 
 			/* Now wait for the device to be ready */
-			if (k_msgq_get(&app_event_queue, &evt, APP_CONTROLLER_PAIRING_TIMEOUT) ==
-			    0) {
+			if (app_event_get(&evt, APP_CONTROLLER_PAIRING_TIMEOUT) == 0) {
 				if (evt.type == EVENT_DEVICE_READY) {
 					LOG_INF("[DEVICE ID %d] ready, discovering CSIP",
 						evt.device_id);
@@ -330,7 +471,7 @@ void app_controller_thread(void)
 			}
 
 			ble_cmd_csip_discover(evt.device_id, false);
-			while (k_msgq_get(&app_event_queue, &evt, K_FOREVER))
+			while (app_event_get(&evt, K_FOREVER))
 				;
 			if (evt.type != EVENT_CSIP_DISCOVERED) {
 				LOG_ERR("Unexpected event %d in SM_FIRST_TIME_USE", evt.type);
@@ -342,7 +483,7 @@ void app_controller_thread(void)
 			}
 
 			csip_coordinator_rsi_scan_start(evt.device_id);
-			while (k_msgq_get(&app_event_queue, &evt, K_FOREVER))
+			while (app_event_get(&evt, K_FOREVER))
 				;
 			if (evt.type != EVENT_CSIP_MEMBER_MATCH) {
 				LOG_ERR("Unexpected event %d in SM_FIRST_TIME_USE", evt.type);
@@ -365,8 +506,7 @@ void app_controller_thread(void)
 			LOG_INF("Bonding to device");
 
 			ble_manager_connect(1, evt.data);
-			if (k_msgq_get(&app_event_queue, &evt, APP_CONTROLLER_PAIRING_TIMEOUT) ==
-			    0) {
+			if (app_event_get(&evt, APP_CONTROLLER_PAIRING_TIMEOUT) == 0) {
 				if (evt.type == EVENT_DEVICE_READY) {
 					LOG_INF("[DEVICE ID %d] ready, discovering CSIP",
 						evt.device_id);
@@ -383,7 +523,7 @@ void app_controller_thread(void)
 			}
 
 			ble_cmd_csip_discover(evt.device_id, false);
-			while (k_msgq_get(&app_event_queue, &evt, K_FOREVER))
+			while (app_event_get(&evt, K_FOREVER))
 				;
 			if (evt.type != EVENT_CSIP_DISCOVERED) {
 				LOG_ERR("Unexpected event %d in SM_FIRST_TIME_USE", evt.type);
@@ -418,105 +558,97 @@ void app_controller_thread(void)
 			 * SM_FIRST_TIME_USE */
 			devices_manager_update_bonded_devices_collection();
 
-			ble_manager_establish_trusted_bond(0);
+			/**
+			 * Reconnect straight to encryption with the stored keys. In dual-link
+			 * mode both devices are connected concurrently. Otherwise they are
+			 * connected one at a time since only one bt_conn_le_create() may be
+			 * pending, but encryption of the first overlaps the second connection.
+			 */
+			uint8_t devices_ready = 0;
+			bool connect_failed = false;
 
-			/** If we're bonded to both HIs, establish trusted bond with second HI */
-			if (bonded_devices_count == 2) {
-				/** Wait for first HI to be connected, before we can use
-				 * bt_conn_le_create() again */
-				if (k_msgq_get(&app_event_queue, &evt,
-					       APP_CONTROLLER_PAIRING_TIMEOUT) == 0) {
-					if (evt.type != EVENT_DEVICE_CONNECTED) {
-						LOG_ERR("Unexpected event %d in SM_BONDED_DEVICES",
-							evt.type);
-						state = SM_IDLE;
-						break;
-					} else {
-						LOG_INF("[DEVICE ID %d] connected", evt.device_id);
-					}
-				} else {
-					LOG_ERR("Timeout waiting for device to be connected in "
-						"SM_BONDED_DEVICES");
-					state = SM_POWER_OFF;
+			/* Discovery of each device starts as soon as it is ready */
+			devices_pending_completion = bonded_devices_count;
+			parallel_discovery_active = true;
+			wake_fast_path = power_manager_wake_button == VOLUME_UP_BTN_ID ||
+					 power_manager_wake_button == VOLUME_DOWN_BTN_ID;
+			for (uint8_t i = 0; i < bonded_devices_count; i++) {
+				device_services_complete[i] = false;
+				wake_cmd_sent[i] = false;
+				has_discovery_queued[i] = false;
+				wake_snapshot_queued[i] = false;
+			}
+			bool dual_link = APP_CONTROLLER_DUAL_LINK_CONNECT && bonded_devices_count == 2;
+
+			if (dual_link && ble_manager_connect_bonded_devices(bonded_devices_count)) {
+				LOG_ERR("Failed to start dual-link connect");
+				connect_failed = true;
+			}
+
+			for (uint8_t i = 0; i < bonded_devices_count && !dual_link && !connect_failed;
+			     i++) {
+				if (ble_manager_reconnect_bonded_device(i)) {
+					LOG_ERR("Failed to reconnect [DEVICE ID %d]", i);
+					connect_failed = true;
 					break;
 				}
 
-				ble_manager_establish_trusted_bond(1);
-				/** Wait for second HI to be connected, before we can use
-				 * bt_conn_le_create() again */
-				if (k_msgq_get(&app_event_queue, &evt,
-					       APP_CONTROLLER_PAIRING_TIMEOUT) == 0) {
-					if (evt.type != EVENT_DEVICE_CONNECTED) {
-						LOG_ERR("Unexpected event %d in SM_BONDED_DEVICES",
-							evt.type);
-						state = SM_IDLE;
+				while (true) {
+					if (app_event_get(&evt,
+							  APP_CONTROLLER_PAIRING_TIMEOUT) != 0) {
+						LOG_ERR("Timeout waiting for device to be connected in "
+							"SM_BONDED_DEVICES");
+						connect_failed = true;
 						break;
-					} else {
-						LOG_INF("[DEVICE ID %d] connected", evt.device_id);
 					}
-				} else {
-					LOG_ERR("Timeout waiting for device to be connected in "
-						"SM_BONDED_DEVICES");
-					state = SM_POWER_OFF;
-					break;
-				}
 
-				/** Waiting for either device to be ready */
-				if (k_msgq_get(&app_event_queue, &evt,
-					       APP_CONTROLLER_PAIRING_TIMEOUT) == 0) {
-					if (evt.type != EVENT_DEVICE_READY) {
-						LOG_ERR("Unexpected event %d in SM_BONDED_DEVICES",
-							evt.type);
-						state = SM_IDLE;
+					if (evt.type == EVENT_DEVICE_READY) {
+						LOG_INF("[DEVICE ID %d] ready", evt.device_id);
+						devices_ready++;
+						start_device_services(evt.device_id);
+					} else if (evt.type == EVENT_DEVICE_CONNECTED &&
+						   evt.device_id == i) {
+						LOG_INF("[DEVICE ID %d] connected", evt.device_id);
 						break;
 					} else {
-						LOG_INF("[DEVICE ID %d] ready after trusted bond",
-							evt.device_id);
+						LOG_WRN("Ignoring event %d while connecting in "
+							"SM_BONDED_DEVICES",
+							evt.type);
 					}
-				} else {
+				}
+			}
+
+			/** Wait for the remaining devices to be encrypted */
+			while (!connect_failed && devices_ready < bonded_devices_count) {
+				if (app_event_get(&evt, APP_CONTROLLER_PAIRING_TIMEOUT) != 0) {
 					LOG_ERR("Timeout waiting for device to be ready in "
 						"SM_BONDED_DEVICES");
-					state = SM_POWER_OFF;
+					connect_failed = true;
 					break;
 				}
-			}
 
-			/** Waiting for either device to be ready */
-			if (k_msgq_get(&app_event_queue, &evt, APP_CONTROLLER_PAIRING_TIMEOUT) ==
-			    0) {
-				if (evt.type != EVENT_DEVICE_READY) {
-					LOG_ERR("Unexpected event %d in SM_BONDED_DEVICES",
+				if (evt.type == EVENT_DEVICE_READY) {
+					LOG_INF("[DEVICE ID %d] ready", evt.device_id);
+					devices_ready++;
+					start_device_services(evt.device_id);
+				} else if (evt.type != EVENT_DEVICE_CONNECTED) {
+					/* A fallback reconnect reports CONNECTED again */
+					LOG_WRN("Ignoring event %d while waiting for ready in "
+						"SM_BONDED_DEVICES",
 						evt.type);
-					state = SM_IDLE;
-					break;
-				} else {
-					LOG_INF("[DEVICE ID %d] ready after trusted bond",
-						evt.device_id);
 				}
-			} else {
-				LOG_ERR("Timeout waiting for device to be ready in "
-					"SM_BONDED_DEVICES");
-				state = SM_POWER_OFF;
-				break;
 			}
 
-			/* Initialize parallel service discovery */
-			devices_pending_completion = bonded_devices_count;
-			parallel_discovery_active = true;
-			for (uint8_t i = 0; i < bonded_devices_count; i++) {
-				device_services_complete[i] = false;
-			}
-
-			/* Start BAS discovery for ALL devices in parallel */
-			for (uint8_t i = 0; i < bonded_devices_count; i++) {
-				battery_reader_reset(i);
-				ble_cmd_bas_discover(i, false);
+			if (connect_failed) {
+				parallel_discovery_active = false;
+				state = SM_POWER_OFF;
+				break;
 			}
 
 			/* Event-driven service discovery loop */
 			while (devices_pending_completion > 0) {
-				if (k_msgq_get(&app_event_queue, &evt,
-					       APP_CONTROLLER_ACTION_TIMEOUT) == -EAGAIN) {
+				if (app_event_get(&evt,
+						  APP_CONTROLLER_ACTION_TIMEOUT) == -EAGAIN) {
 					LOG_ERR("Timeout waiting for service discovery events");
 					state = SM_POWER_OFF;
 					break;
@@ -528,11 +660,19 @@ void app_controller_thread(void)
 						LOG_ERR("BAS discovery failed for device %d (err "
 							"%d)",
 							evt.device_id, evt.error_code);
-					} else {
+					} else if (wake_snapshot_queued[evt.device_id]) {
+						/* Fast path: the snapshot went out without it */
 						LOG_INF("BAS discovered for device %d, reading "
 							"level",
 							evt.device_id);
 						ble_cmd_bas_read_level(evt.device_id, false);
+					} else {
+						LOG_INF("BAS discovered for device %d",
+							evt.device_id);
+					}
+					if (wake_fast_path) {
+						/* VCP was already set up by the fast path */
+						break;
 					}
 					/* Chain: Start VCP discovery for this device */
 					vcp_controller_reset(evt.device_id);
@@ -546,8 +686,23 @@ void app_controller_thread(void)
 					} else {
 						LOG_INF("VCP discovered for device %d",
 							evt.device_id);
+						if (wake_fast_path) {
+							/* Goes out right after the state read */
+							LOG_INF("Fast path: sending wake command to "
+								"device %d",
+								evt.device_id);
+							ble_cmd_vcp_read_state(evt.device_id, true);
+							send_wake_command(evt.device_id);
+						} else {
+							/* Chain: volume comes with the wake snapshot */
+							queue_has_discovery(evt.device_id);
+						}
+					}
+					if (wake_fast_path) {
+						/* Chain: Battery in the background */
+						battery_reader_reset(evt.device_id);
+						ble_cmd_bas_discover(evt.device_id, false);
 					}
-					/* VCP state read is auto-queued by vcp_controller */
 					break;
 
 				case EVENT_VCP_STATE_READ:
@@ -559,24 +714,23 @@ void app_controller_thread(void)
 							evt.device_id);
 					}
 					/* Chain: Start HAS discovery for this device */
-					has_controller_reset(evt.device_id);
-					ble_cmd_has_discover(evt.device_id, false);
+					queue_has_discovery(evt.device_id);
 					break;
 
 				case EVENT_HAS_DISCOVERED:
 					if (evt.error_code != 0) {
+						/* Retried by the HAS_DISCOVER retry policy */
 						LOG_WRN("HAS discovery failed for device %d (err "
 							"%d)",
 							evt.device_id, evt.error_code);
-						if (evt.error_code == 15) {
-							LOG_DBG("Attempting to discover HAS again "
-								"for device %d",
-								evt.device_id);
-							ble_cmd_has_discover(evt.device_id, false);
-						}
 					} else {
 						LOG_INF("HAS discovered for device %d",
 							evt.device_id);
+						/* Battery, volume and preset in one read */
+						if (!wake_snapshot_queued[evt.device_id]) {
+							wake_snapshot_queued[evt.device_id] = true;
+							ble_cmd_wake_snapshot(evt.device_id, false);
+						}
 						/* Mark this device as complete */
 						if (!device_services_complete[evt.device_id]) {
 							device_services_complete[evt.device_id] =
@@ -590,6 +744,13 @@ void app_controller_thread(void)
 					}
 					break;
 
+				case EVENT_DEVICE_READY:
+					/* Ready again after a fallback reconnect */
+					has_discovery_queued[evt.device_id] = false;
+					wake_snapshot_queued[evt.device_id] = false;
+					start_device_services(evt.device_id);
+					break;
+
 				default:
 					LOG_DBG("Received event %d during parallel discovery",
 						evt.type);
@@ -601,15 +762,24 @@ void app_controller_thread(void)
 			LOG_INF("All bonded devices managed, entering idle state");
 			state = SM_IDLE;
 
+			/* Trade interval for radio energy while waiting for input */
+			for (uint8_t i = 0; i < bonded_devices_count; i++) {
+				ble_manager_report_discovery_time(i);
+				ble_manager_set_conn_profile(i, BLE_CONN_PROFILE_IDLE);
+			}
+
 			switch (power_manager_wake_button) {
 			case VOLUME_UP_BTN_ID:
-				LOG_DBG("SM_IDLE: Wake button is volume up");
-				app_controller_notify_volume_up_button_pressed();
-				app_controller_notify_has_read_presets();
-				break;
 			case VOLUME_DOWN_BTN_ID:
-				LOG_DBG("SM_IDLE: Wake button is volume down");
-				app_controller_notify_volume_down_button_pressed();
+				/* Already sent by the fast path, unless VCP was not usable then */
+				for (uint8_t i = 0; i < bonded_devices_count; i++) {
+					if (!wake_cmd_sent[i] && device_ctx[i].info.vcp_discovered) {
+						LOG_DBG("SM_IDLE: Sending late wake command to device %d",
+							i);
+						send_wake_command(i);
+						ble_manager_boost_conn(i);
+					}
+				}
 				app_controller_notify_has_read_presets();
 				break;
 			case NEXT_PRESET_BTN_ID:
@@ -667,21 +837,21 @@ int8_t app_controller_notify_system_ready()
 {
 	LOG_DBG("Notifying system ready");
 	struct app_event evt = {.type = EVENT_SYSTEM_READY, .device_id = 0};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_device_connected(uint8_t device_id)
 {
 	LOG_DBG("Notifying device connected: device_id=%d", device_id);
 	struct app_event evt = {.type = EVENT_DEVICE_CONNECTED, .device_id = device_id};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_device_disconnected(uint8_t device_id)
 {
 	LOG_DBG("Notifying device disconnected: device_id=%d", device_id);
 	struct app_event evt = {.type = EVENT_DEVICE_DISCONNECTED, .device_id = device_id};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_device_ready(uint8_t device_id)
@@ -690,7 +860,7 @@ int8_t app_controller_notify_device_ready(uint8_t device_id)
 	devices_manager_set_device_state(ctx, CONN_STATE_READY);
 	LOG_DBG("Notifying device ready: device_id=%d", device_id);
 	struct app_event evt = {.type = EVENT_DEVICE_READY, .device_id = device_id};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_scan_complete()
@@ -700,7 +870,7 @@ int8_t app_controller_notify_scan_complete()
 		.type = EVENT_SCAN_COMPLETE,
 		.device_id = 0,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_csip_discovered(uint8_t device_id, int8_t err)
@@ -711,7 +881,7 @@ int8_t app_controller_notify_csip_discovered(uint8_t device_id, int8_t err)
 		.device_id = device_id,
 		.error_code = err,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_csip_member_match(uint8_t device_id, int8_t err,
@@ -723,7 +893,7 @@ int8_t app_controller_notify_csip_member_match(uint8_t device_id, int8_t err,
 				.error_code = err,
 				.data = (void *)addr};
 
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_bas_discovered(uint8_t device_id, int err)
@@ -734,7 +904,7 @@ int8_t app_controller_notify_bas_discovered(uint8_t device_id, int err)
 		.device_id = device_id,
 		.error_code = err,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_vcp_discovered(uint8_t device_id, int err)
@@ -745,7 +915,7 @@ int8_t app_controller_notify_vcp_discovered(uint8_t device_id, int err)
 		.device_id = device_id,
 		.error_code = err,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_vcp_state_read(uint8_t device_id, int err)
@@ -756,7 +926,7 @@ int8_t app_controller_notify_vcp_state_read(uint8_t device_id, int err)
 		.device_id = device_id,
 		.error_code = err,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_volume_up_button_pressed()
@@ -766,7 +936,7 @@ int8_t app_controller_notify_volume_up_button_pressed()
 		.type = EVENT_VOLUME_UP_BUTTON_PRESSED,
 		.device_id = 0,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_volume_down_button_pressed()
@@ -776,7 +946,7 @@ int8_t app_controller_notify_volume_down_button_pressed()
 		.type = EVENT_VOLUME_DOWN_BUTTON_PRESSED,
 		.device_id = 0,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_pair_button_pressed()
@@ -786,7 +956,7 @@ int8_t app_controller_notify_pair_button_pressed()
 		.type = EVENT_PAIR_BUTTON_PRESSED,
 		.device_id = 0,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_preset_button_pressed()
@@ -796,7 +966,7 @@ int8_t app_controller_notify_preset_button_pressed()
 		.type = EVENT_PRESET_BUTTON_PRESSED,
 		.device_id = 0,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_clear_bonds_button_pressed()
@@ -806,7 +976,7 @@ int8_t app_controller_notify_clear_bonds_button_pressed()
 		.type = EVENT_CLEAR_BONDS_BUTTON_PRESSED,
 		.device_id = 0,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_bonds_cleared()
@@ -816,7 +986,7 @@ int8_t app_controller_notify_bonds_cleared()
 		.type = EVENT_BONDS_CLEARED,
 		.device_id = 0,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_has_discovered(uint8_t device_id, int err)
@@ -827,7 +997,7 @@ int8_t app_controller_notify_has_discovered(uint8_t device_id, int err)
 		.device_id = device_id,
 		.error_code = err,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_has_presets_read(uint8_t device_id, int err)
@@ -838,7 +1008,7 @@ int8_t app_controller_notify_has_presets_read(uint8_t device_id, int err)
 		.device_id = device_id,
 		.error_code = err,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_has_read_presets()
@@ -849,7 +1019,7 @@ int8_t app_controller_notify_has_read_presets()
 		.device_id = 0,
 		.error_code = 0,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
 }
 
 int8_t app_controller_notify_power_off()
@@ -859,5 +1029,129 @@ int8_t app_controller_notify_power_off()
 		.type = EVENT_POWER_OFF,
 		.device_id = 0,
 	};
-	return k_msgq_put(&app_event_queue, &evt, K_NO_WAIT);
+	return app_event_put(&evt);
+}
+
+void app_controller_get_event_stats(struct app_event_stats *stats)
+{
+	stats->posted = atomic_get(&events_posted);
+	stats->merged = atomic_get(&presses_merged);
+	stats->dropped = atomic_get(&events_dropped);
+}
+
+void app_controller_log_event_stats(void)
+{
+	struct app_event_stats s;
+
+	app_controller_get_event_stats(&s);
+	LOG_INF("App events: %u posted, %u press(es) merged, %u dropped", s.posted, s.merged,
+		s.dropped);
 }
+
+void app_controller_reset_event_stats(void)
+{
+	atomic_clear(&events_posted);
+	atomic_clear(&presses_merged);
+	atomic_clear(&events_dropped);
+}
+
+#if defined(CONFIG_SHELL)
+/* Drive synthetic button presses through the notify functions, the way a held
+ * or hammered key would, and report what the event and command queues made of
+ * them once both have drained */
+static int cmd_app_stress(const struct shell *sh, size_t argc, char **argv)
+{
+	uint32_t presses = argc > 1 ? strtoul(argv[1], NULL, 0) : APP_CONTROLLER_STRESS_PRESSES;
+	uint32_t burst = argc > 2 ? strtoul(argv[2], NULL, 0) : APP_CONTROLLER_STRESS_BURST;
+	uint32_t gap_us = argc > 3 ? strtoul(argv[3], NULL, 0) : APP_CONTROLLER_STRESS_GAP_US;
+	uint32_t seed = 0x2545F491; /* Fixed, so runs are repeatable */
+	uint32_t refused = 0;
+
+	if (state != SM_IDLE) {
+		shell_error(sh, "Presses are only handled when idle (state %d)", state);
+		return -EBUSY;
+	}
+
+	if (burst == 0) {
+		burst = 1;
+	}
+
+	app_controller_reset_event_stats();
+	ble_cmd_reset_overload_stats();
+
+	int64_t start = k_uptime_get();
+
+	for (uint32_t sent = 0; sent < presses;) {
+		/* The app thread only runs between bursts, like after a run of ISRs */
+		k_sched_lock();
+		for (uint32_t i = 0; i < burst && sent < presses; i++, sent++) {
+			int8_t err;
+
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+
+			/* Mostly volume, as with a held key, with a preset press now and then */
+			switch (seed % 8) {
+			case 0:
+				err = app_controller_notify_preset_button_pressed();
+				break;
+			case 1:
+			case 2:
+			case 3:
+				err = app_controller_notify_volume_down_button_pressed();
+				break;
+			default:
+				err = app_controller_notify_volume_up_button_pressed();
+				break;
+			}
+
+			if (err) {
+				refused++;
+			}
+		}
+		k_sched_unlock();
+
+		if (gap_us) {
+			k_usleep(gap_us);
+		}
+	}
+
+	int64_t sent_at = k_uptime_get();
+	struct ble_cmd_overload_stats q;
+
+	/* Wait for the events to be taken and the commands to finish */
+	do {
+		k_msleep(10);
+		ble_cmd_get_overload_stats(&q);
+	} while ((k_msgq_num_used_get(&app_event_queue) || q.held[0] || q.held[1]) &&
+		 k_uptime_get() - sent_at < APP_CONTROLLER_STRESS_DRAIN_MS);
+
+	int64_t drained_at = k_uptime_get();
+	struct app_event_stats e;
+
+	app_controller_get_event_stats(&e);
+
+	shell_print(sh, "%u presses in %lld ms, drained after %lld ms%s", presses,
+		    sent_at - start, drained_at - sent_at,
+		    k_msgq_num_used_get(&app_event_queue) || q.held[0] || q.held[1]
+			    ? " (not empty)"
+			    : "");
+	shell_print(sh, "events: %u posted, %u press(es) merged, %u dropped, %u refused", e.posted,
+		    e.merged, e.dropped, refused);
+	for (int cls = 0; cls < BLE_CMD_CLASS_COUNT; cls++) {
+		shell_print(sh, "class %d: %u merged, %u evicted, %u rejected", cls, q.merged[cls],
+			    q.evicted[cls], q.rejected[cls]);
+	}
+	for (uint8_t dev = 0; dev < CONFIG_BT_MAX_CONN; dev++) {
+		shell_print(sh, "[DEVICE ID %d] queue high water %u of %u", dev, q.high_water[dev],
+			    BLE_CMD_QUEUE_SIZE);
+	}
+
+	return 0;
+}
+
+SHELL_CMD_ARG_REGISTER(app_stress, NULL,
+		       "Send synthetic button presses: [presses] [burst] [gap us]",
+		       cmd_app_stress, 1, 3);
+#endif /* CONFIG_SHELL */
@@ -20,6 +20,25 @@ enum sm_state {
 #define APP_CONTROLLER_PAIRING_TIMEOUT K_SECONDS(30)
 #define APP_CONTROLLER_ACTION_TIMEOUT K_SECONDS(10)
 
+/* Bring both bonded devices up concurrently via accept-list auto-connect
+ * (set to 0 to connect them one after the other) */
+#define APP_CONTROLLER_DUAL_LINK_CONNECT 1
+
+/* Defaults of the app_stress shell benchmark: synthetic presses, presses sent
+ * back to back with the scheduler locked (as button ISRs firing while the app
+ * thread is busy), pause between bursts, and how long queues may take to drain */
+#define APP_CONTROLLER_STRESS_PRESSES 2000
+#define APP_CONTROLLER_STRESS_BURST 8
+#define APP_CONTROLLER_STRESS_GAP_US 5000
+#define APP_CONTROLLER_STRESS_DRAIN_MS 10000
+
+/* App event queue counters */
+struct app_event_stats {
+    uint32_t posted;  /* Events put into the queue */
+    uint32_t merged;  /* Button presses added to an event of the same button still queued */
+    uint32_t dropped; /* Events and button presses lost to a full queue */
+};
+
 int8_t app_controller_notify_system_ready();
 int8_t app_controller_notify_device_connected(uint8_t device_id);
 int8_t app_controller_notify_device_disconnected(uint8_t device_id);
@@ -41,4 +60,8 @@ int8_t app_controller_notify_has_presets_read(uint8_t device_id, int err);
 int8_t app_controller_notify_has_read_presets();
 int8_t app_controller_notify_power_off();
 
+void app_controller_get_event_stats(struct app_event_stats *stats);
+void app_controller_log_event_stats(void);
+void app_controller_reset_event_stats(void);
+
 #endif /* CONNECTION_MANAGER_H */
\ No newline at end of file
@@ -1,8 +1,11 @@
 #include "battery_reader.h"
 #include "bas_settings.h"
+#include "handle_cache.h"
 #include "devices_manager.h"
 #include "app_controller.h"
 #include "display_manager.h"
+#include "wake_trace.h"
+#include "session_snapshot.h"
 
 LOG_MODULE_REGISTER(battery_reader, LOG_LEVEL_INF);
 
@@ -13,6 +16,29 @@ uint8_t battery_level = 0;
 /* Track whether handles were loaded from cache (per device) - skip re-storing if true */
 static bool handles_from_cache[CONFIG_BT_MAX_CONN];
 
+/* Commands waiting for the discovery and read callbacks (per device), 0 if none */
+static ble_cmd_handle_t discover_cmd[CONFIG_BT_MAX_CONN];
+static ble_cmd_handle_t read_cmd[CONFIG_BT_MAX_CONN];
+
+/* Store a battery level read from the device and show it */
+void battery_reader_apply_level(uint8_t device_id, uint8_t level)
+{
+	struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
+
+	if (!ctx)
+	{
+		LOG_ERR("No device context for battery level [DEVICE ID %d]", device_id);
+		return;
+	}
+
+	ctx->bas_ctlr.battery_level = level;
+	session_snapshot_set_battery(&ctx->info.addr, ctx->bas_ctlr.battery_level);
+	LOG_INF("Battery level read: %u%% [DEVICE ID %d]", ctx->bas_ctlr.battery_level, ctx->device_id);
+
+	/* Update display with battery level */
+	display_manager_update_battery(ctx->device_id, ctx->bas_ctlr.battery_level);
+}
+
 /* Read callback for battery level characteristic */
 static uint8_t battery_read_cb(struct bt_conn *conn, uint8_t err,
 							   struct bt_gatt_read_params *params,
@@ -23,40 +49,33 @@ static uint8_t battery_read_cb(struct bt_conn *conn, uint8_t err,
 	if (err)
 	{
 		LOG_ERR("Battery level read failed (err %u) [DEVICE ID %d]", err, ctx->device_id);
-		ble_cmd_complete(ctx->device_id, err);
+		ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&read_cmd[ctx->device_id]), err);
 		return 0;
 	}
 
 	if (!data)
 	{
 		LOG_DBG("Battery level read complete [DEVICE ID %d]", ctx->device_id);
-		ble_cmd_complete(ctx->device_id, -1);
+		ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&read_cmd[ctx->device_id]), -1);
 		return 0;
 	}
 
 	if (length != 1)
 	{
 		LOG_WRN("Unexpected battery level length: %u [DEVICE ID %d]", length, ctx->device_id);
-		ble_cmd_complete(ctx->device_id, -2);
+		ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&read_cmd[ctx->device_id]), -2);
 		return 0;
 	}
 
-	ctx->bas_ctlr.battery_level = *(uint8_t *)data;
-	LOG_INF("Battery level read: %u%% [DEVICE ID %d]", ctx->bas_ctlr.battery_level, ctx->device_id);
+	battery_reader_apply_level(ctx->device_id, *(uint8_t *)data);
 
-	/* Update display with battery level */
-	display_manager_update_battery(ctx->device_id, ctx->bas_ctlr.battery_level);
-
-	ble_cmd_complete(ctx->device_id, 0);
+	ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&read_cmd[ctx->device_id]), 0);
 
 	return 0;
 }
 
-/* Read parameters for battery level */
-static struct bt_gatt_read_params battery_read_params = {
-	.func = battery_read_cb,
-	.handle_count = 1,
-};
+/* Read parameters for battery level, per device as both links may read at once */
+static struct bt_gatt_read_params battery_read_params[CONFIG_BT_MAX_CONN];
 
 /* Discovery callback for Battery Service characteristics */
 static uint8_t discover_char_cb(struct bt_conn *conn,
@@ -72,6 +91,7 @@ static uint8_t discover_char_cb(struct bt_conn *conn,
 		/* If we have the characteristic handle, mark discovery as complete */
 		if (ctx->bas_ctlr.battery_level_handle != 0) {
 			ctx->info.bas_discovered = true;
+			wake_trace_record(WAKE_TRACE_BAS_DISCOVERED, ctx->device_id);
 
 			/* Only extract and cache handles if they weren't loaded from cache.
 			 * This avoids unnecessary stack usage from settings operations when
@@ -84,52 +104,8 @@ static uint8_t discover_char_cb(struct bt_conn *conn,
 					.battery_level_handle = ctx->bas_ctlr.battery_level_handle,
 				};
 
-				/* Store handles for the current device */
-				bas_settings_store_handles(&ctx->info.addr, &handles);
-
-				/* If this is a new device (initial pairing) and part of a CSIP set, also store handles
-				 * for all other set members. Since all hearing aids in the set have identical firmware
-				 * and GATT layout, we can reuse the same handles for all set members.
-				 * Skip this on reconnection to avoid unnecessary work and potential stack issues. */
-				// if (ctx->info.is_new_device) {
-					struct bond_collection collection;
-					if (devices_manager_get_bonded_devices_collection(&collection) == 0) {
-						struct bonded_device_entry current_entry;
-						if (devices_manager_find_bonded_entry_by_addr(&ctx->info.addr, &current_entry) && current_entry.is_set_member) {
-						LOG_DBG("Current device is CSIP set member, caching BAS handles for all set members");
-						LOG_DBG("Bonded devices count: %d", collection.count);
-						LOG_HEXDUMP_DBG(current_entry.sirk, CSIP_SIRK_SIZE, "Current device SIRK:");
-
-						for (uint8_t i = 0; i < collection.count; i++) {
-							char debug_addr[BT_ADDR_LE_STR_LEN];
-							bt_addr_le_to_str(&collection.devices[i].addr, debug_addr, sizeof(debug_addr));
-							LOG_DBG("  Device %d: %s, is_set_member=%d, set_rank=%d",
-								i, debug_addr, collection.devices[i].is_set_member, collection.devices[i].set_rank);
-							if (collection.devices[i].is_set_member) {
-								LOG_HEXDUMP_DBG(collection.devices[i].sirk, CSIP_SIRK_SIZE, "  Device SIRK:");
-							}
-							/* Skip the current device (already stored) */
-							if (bt_addr_le_cmp(&collection.devices[i].addr, &ctx->info.addr) == 0) {
-								continue;
-							}
-
-							/* Only store for devices in the same CSIP set */
-							if (collection.devices[i].is_set_member &&
-								memcmp(collection.devices[i].sirk, current_entry.sirk, CSIP_SIRK_SIZE) == 0) {
-
-								int err = bas_settings_store_handles(&collection.devices[i].addr, &handles);
-								if (err == 0) {
-									char addr_str[BT_ADDR_LE_STR_LEN];
-									bt_addr_le_to_str(&collection.devices[i].addr, addr_str, sizeof(addr_str));
-									LOG_INF("BAS handles also cached for set member: %s", addr_str);
-								} else {
-									LOG_WRN("Failed to cache BAS handles for set member (err %d)", err);
-								}
-							}
-						}
-					}
-					}
-				// }
+				/* Queued for this device and its set members, written outside the RX context */
+				handle_cache_store(HANDLE_CACHE_BAS, &ctx->info.addr, &handles);
 			} else {
 				LOG_DBG("Handles were loaded from cache, skipping re-storage");
 			}
@@ -139,11 +115,12 @@ static uint8_t discover_char_cb(struct bt_conn *conn,
 			        ctx->bas_ctlr.battery_level_handle, ctx->bas_ctlr.battery_level_ccc_handle, ctx->device_id);
 
 			app_controller_notify_bas_discovered(ctx->device_id, 0);
-			ble_cmd_complete(ctx->device_id, 0);
+			ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&discover_cmd[ctx->device_id]), 0);
 		} else {
 			LOG_ERR("Battery Service discovery completed but no characteristic found [DEVICE ID %d]", ctx->device_id);
 			app_controller_notify_bas_discovered(ctx->device_id, -EINVAL);
-			ble_cmd_complete(ctx->device_id, -EINVAL);
+			ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&discover_cmd[ctx->device_id]),
+					 -EINVAL);
 		}
 
 		return BT_GATT_ITER_STOP;
@@ -203,7 +180,7 @@ static uint8_t discover_service_cb(struct bt_conn *conn,
 }
 
 /* Discover Battery Service on connected device */
-int battery_discover(uint8_t device_id)
+int battery_discover(uint8_t device_id, ble_cmd_handle_t cmd_id)
 {
 	struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
 
@@ -228,7 +205,7 @@ int battery_discover(uint8_t device_id)
 
 		/* Try to load cached handles first */
 		struct bt_bas_handles cached_handles;
-		int load_err = bas_settings_load_handles(&ctx->info.addr, &cached_handles);
+		int load_err = handle_cache_load(HANDLE_CACHE_BAS, &ctx->info.addr, &cached_handles);
 		if (load_err == 0) {
 			LOG_INF("Loaded cached BAS handles - skipping discovery [DEVICE ID %d]", device_id);
 			ctx->bas_ctlr.battery_service_handle = cached_handles.service_handle;
@@ -236,9 +213,10 @@ int battery_discover(uint8_t device_id)
 			ctx->bas_ctlr.battery_level_handle = cached_handles.battery_level_handle;
 			ctx->info.bas_discovered = true;
 			handles_from_cache[device_id] = true;
+			wake_trace_record(WAKE_TRACE_BAS_DISCOVERED, ctx->device_id);
 
 			app_controller_notify_bas_discovered(ctx->device_id, 0);
-			ble_cmd_complete(ctx->device_id, 0);
+			ble_cmd_complete(ctx->device_id, cmd_id, 0);
 			return 0;
 		}
 
@@ -251,10 +229,12 @@ int battery_discover(uint8_t device_id)
 		discover_params.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
 		discover_params.func = discover_service_cb;
 
+		discover_cmd[device_id] = cmd_id;
 		int err = bt_gatt_discover(ctx->conn, &discover_params);
 		if (err)
 		{
 			LOG_ERR("Battery Service discovery failed (err %d) [DEVICE ID %d]", err, ctx->device_id);
+			discover_cmd[device_id] = 0;
 			return err;
 		}
 	} else {
@@ -265,7 +245,7 @@ int battery_discover(uint8_t device_id)
 }
 
 /* Read battery level */
-int battery_read_level(uint8_t device_id)
+int battery_read_level(uint8_t device_id, ble_cmd_handle_t cmd_id)
 {
 	struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
 	
@@ -283,13 +263,18 @@ int battery_read_level(uint8_t device_id)
 
 	LOG_DBG("Reading battery level from handle 0x%04X [DEVICE ID %d]", ctx->bas_ctlr.battery_level_handle, ctx->device_id);
 
-	battery_read_params.single.handle = ctx->bas_ctlr.battery_level_handle;
-	battery_read_params.single.offset = 0;
+	struct bt_gatt_read_params *params = &battery_read_params[device_id];
+	params->func = battery_read_cb;
+	params->handle_count = 1;
+	params->single.handle = ctx->bas_ctlr.battery_level_handle;
+	params->single.offset = 0;
 
-	int err = bt_gatt_read(ctx->conn, &battery_read_params);
+	read_cmd[device_id] = cmd_id;
+	int err = bt_gatt_read(ctx->conn, params);
 	if (err)
 	{
 		LOG_ERR("Battery level read failed (err %d) [DEVICE ID %d]", err, ctx->device_id);
+		read_cmd[device_id] = 0;
 		return err;
 	}
 
@@ -309,8 +294,31 @@ void battery_reader_reset(uint8_t device_id)
 	LOG_DBG("Battery reader state reset [DEVICE ID %d]", ctx->device_id);
 }
 
+static int bas_cache_load(const bt_addr_le_t *addr, void *data)
+{
+	return bas_settings_load_handles(addr, data);
+}
+
+static int bas_cache_store(const bt_addr_le_t *addr, const void *data)
+{
+	return bas_settings_store_handles(addr, data);
+}
+
+static const struct handle_cache_ops bas_cache_ops = {
+	.name = "BAS",
+	.size = sizeof(struct bt_bas_handles),
+	.load = bas_cache_load,
+	.store = bas_cache_store,
+	.clear = bas_settings_clear_handles,
+};
+
 int battery_reader_init(void) {
-	// This does nothing but I wanted consistency lol, feel free to remove if you want :)
+	int err = handle_cache_register(HANDLE_CACHE_BAS, &bas_cache_ops);
+	if (err) {
+		LOG_ERR("Failed to register BAS handle cache (err %d)", err);
+		return err;
+	}
+
 	LOG_INF("Battery reader initialized");
 
 	return 0;
@@ -19,17 +19,29 @@
 /**
  * @brief Discover Battery Service on a connected device
  * 
+ * @param cmd_id Command completed when the discovery is done
  * @return 0 on success, negative error code on failure
  */
-int battery_discover(uint8_t device_id);
+int battery_discover(uint8_t device_id, ble_cmd_handle_t cmd_id);
 
 /**
  * @brief Read battery level from discovered battery service
  * 
  * @param conn Pointer to the BLE connection
+ * @param cmd_id Command completed by the read callback
  * @return 0 on success, negative error code on failure
  */
-int battery_read_level(uint8_t device_id);
+int battery_read_level(uint8_t device_id, ble_cmd_handle_t cmd_id);
+
+/**
+ * @brief Store a battery level read from the device and update the display
+ *
+ * Shared by the single read and the wake snapshot.
+ *
+ * @param device_id Device ID
+ * @param level Battery level in percent
+ */
+void battery_reader_apply_level(uint8_t device_id, uint8_t level);
 
 /**
  * @brief Subscribe to battery level notifications
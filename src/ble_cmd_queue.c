@@ -0,0 +1,1987 @@
+/**
+ * @file ble_cmd_queue.c
+ * @brief BLE command pool, per-link queues and the dispatcher that runs them
+ *
+ * Commands are taken from a pool shared by both links, kept in class order
+ * in a queue per link and started by one dispatcher work item, a window of
+ * them in flight per link. Timeouts adapt to observed response times, failed
+ * commands are retried as their descriptor says, and a full queue is handled
+ * by the overload policy of the command class.
+ */
+
+#include "ble_cmd_queue.h"
+#include "ble_manager.h"
+#include "devices_manager.h"
+#include "vcp_controller.h"
+#include "battery_reader.h"
+#include "csip_coordinator.h"
+#include "has_controller.h"
+#include "display_manager.h"
+#include "gatt_db_hash.h"
+#include "wake_snapshot.h"
+#include "cmd_latency.h"
+
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/audio/vcp.h>
+#include <string.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+LOG_MODULE_REGISTER(ble_cmd_queue, LOG_LEVEL_DBG);
+
+/* BLE Command queue: one queue per link, all served by a single dispatcher
+ * work item on its own work queue. Queues, windows and the pool counters are
+ * protected by ble_queue_mutex. */
+static sys_slist_t ble_cmd_queue[CONFIG_BT_MAX_CONN];
+static K_MUTEX_DEFINE(ble_queue_mutex);
+static struct k_work_q ble_cmd_wq;
+static K_THREAD_STACK_DEFINE(ble_cmd_wq_stack, BLE_CMD_WQ_STACK_SIZE);
+static struct k_work ble_cmd_dispatch_work;
+static uint8_t ble_cmd_dispatch_first; // Link served first on the next run
+static struct k_work_delayable ble_cmd_timeout_work[CONFIG_BT_MAX_CONN];
+static struct k_work_delayable ble_cmd_retry_work; // Dispatches once a back-off ends
+
+/* Started commands waiting for ble_cmd_complete() */
+static struct ble_cmd *ble_cmd_inflight[CONFIG_BT_MAX_CONN][BLE_CMD_WINDOW_SIZE];
+static uint8_t ble_cmd_allocated[CONFIG_BT_MAX_CONN]; // Pool blocks held per link
+
+/* Binaural write whose halves are still completing. Only the latest one is
+ * tracked; a new one counts the previous as incomplete if it is not done. */
+static K_MUTEX_DEFINE(binaural_mutex);
+static struct
+{
+	uint16_t pair;
+	uint8_t finished; // Bit per device
+	bool failed;
+	int64_t finished_at[2]; // Uptime in ticks
+} binaural;
+static uint16_t binaural_last_pair;
+static struct ble_binaural_stats binaural_stats;
+
+/* What an in-flight command occupies. Commands on the same resource start in
+ * queue order, one at a time, since the profile clients only run one
+ * procedure each. An exclusive command only starts on an empty window and
+ * nothing queued behind it overtakes it. */
+enum ble_cmd_resource
+{
+	BLE_CMD_RES_EXCLUSIVE,
+	BLE_CMD_RES_VCP,
+	BLE_CMD_RES_BAS,
+	BLE_CMD_RES_CSIP,
+	BLE_CMD_RES_HAS,
+	BLE_CMD_RES_SNAPSHOT,
+};
+
+/* Memory pool for BLE commands, shared by both links. A handle names a slot
+ * and the generation it was issued for; protected by ble_queue_mutex. */
+BUILD_ASSERT(BLE_CMD_POOL_SIZE <= 32 && BLE_CMD_POOL_SIZE <= BIT(BLE_CMD_HANDLE_SLOT_BITS));
+static struct ble_cmd ble_cmd_pool[BLE_CMD_POOL_SIZE];
+static uint32_t ble_cmd_pool_used; // Bit per slot
+static uint32_t ble_cmd_generation[BLE_CMD_POOL_SIZE];
+
+/* Forward declarations */
+static void ble_process_next_command(uint8_t queue_id);
+static void ble_cmd_dispatch(void);
+static void ble_cmd_free(struct ble_cmd *cmd);
+static void ble_cmd_finished(uint8_t device_id, uint16_t pair, ble_cmd_done_cb done, int err);
+static void ble_cmd_timeout_handler(struct k_work *work);
+static void ble_cmd_retry_handler(struct k_work *work);
+
+/* Start queued commands of both links, alternating which one goes first */
+static void ble_cmd_dispatch_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	// Don't process if device_ctx isn't initialized yet
+	if (!device_ctx)
+	{
+		LOG_WRN("BLE command dispatcher run before device_ctx was initialized");
+		return;
+	}
+
+	uint8_t first = ble_cmd_dispatch_first;
+	ble_cmd_dispatch_first = (first + 1) % CONFIG_BT_MAX_CONN;
+
+	for (uint8_t n = 0; n < CONFIG_BT_MAX_CONN; n++)
+	{
+		// Start whatever fits into the window, completions start the rest
+		ble_process_next_command((first + n) % CONFIG_BT_MAX_CONN);
+	}
+}
+
+/* Have the dispatcher look at the queues. Safe from any context; runs that
+ * are requested while one is pending are merged into it. */
+static void ble_cmd_dispatch(void)
+{
+	k_work_submit_to_queue(&ble_cmd_wq, &ble_cmd_dispatch_work);
+}
+
+static void ble_cmd_retry_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	ble_cmd_dispatch();
+}
+
+/* Run the dispatcher when a back-off ends, unless it runs earlier anyway.
+ * Mutex must be held. */
+static void ble_cmd_arm_retry(int64_t not_before)
+{
+	int64_t delay = MAX(not_before - k_uptime_get(), 0);
+
+	if (k_work_delayable_is_pending(&ble_cmd_retry_work) &&
+		k_ticks_to_ms_ceil64(k_work_delayable_remaining_get(&ble_cmd_retry_work)) <= delay)
+	{
+		return;
+	}
+
+	k_work_reschedule_for_queue(&ble_cmd_wq, &ble_cmd_retry_work, K_MSEC(delay));
+}
+
+/* Command queue initialization */
+int ble_cmd_queue_init(void)
+{
+	for (ssize_t i = 0; i < CONFIG_BT_MAX_CONN; i++)
+	{
+		sys_slist_init(&ble_cmd_queue[i]);
+		k_work_init_delayable(&ble_cmd_timeout_work[i], ble_cmd_timeout_handler);
+	}
+
+	k_work_init(&ble_cmd_dispatch_work, ble_cmd_dispatch_handler);
+	k_work_init_delayable(&ble_cmd_retry_work, ble_cmd_retry_handler);
+	k_work_queue_start(&ble_cmd_wq, ble_cmd_wq_stack, K_THREAD_STACK_SIZEOF(ble_cmd_wq_stack),
+					   BLE_CMD_WQ_PRIORITY, NULL);
+	k_thread_name_set(&ble_cmd_wq.thread, "ble_cmd");
+
+	return 0;
+}
+
+/* Executors start a command and hand its ID to whatever completes it. They
+ * all take the same arguments so the descriptor table can point at them. */
+typedef int (*ble_cmd_exec_fn)(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0);
+
+static int ble_cmd_exec_request_security(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return ble_manager_start_security(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_vcp_discover(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return vcp_cmd_discover(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_vcp_volume_up(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return vcp_cmd_volume_up(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_vcp_volume_down(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return vcp_cmd_volume_down(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_vcp_set_volume(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return vcp_cmd_set_volume(device_id, cmd_id, d0);
+}
+
+static int ble_cmd_exec_vcp_mute(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return vcp_cmd_mute(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_vcp_unmute(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return vcp_cmd_unmute(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_vcp_read_state(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return vcp_cmd_read_state(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_vcp_read_flags(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return vcp_cmd_read_flags(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_bas_discover(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return battery_discover(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_bas_read_level(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return battery_read_level(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_csip_discover(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return csip_cmd_discover(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_has_discover(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return has_cmd_discover(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_has_read_presets(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return has_cmd_read_presets(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_has_set_preset(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return has_cmd_set_active_preset(device_id, cmd_id, d0);
+}
+
+static int ble_cmd_exec_has_next_preset(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return has_cmd_next_preset(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_has_prev_preset(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return has_cmd_prev_preset(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_gatt_db_hash_read(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return gatt_db_hash_cmd_read(device_id, cmd_id);
+}
+
+static int ble_cmd_exec_wake_snapshot(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t d0)
+{
+	return wake_snapshot_cmd_read(device_id, cmd_id);
+}
+
+/* How the timeout of a command is chosen, see BLE_CMD_TIMEOUT_* in ble_manager.h */
+enum ble_cmd_timeout_class
+{
+	BLE_CMD_TIMEOUT_EXCHANGE,
+	BLE_CMD_TIMEOUT_PROCEDURE,
+	BLE_CMD_TIMEOUT_FIXED,
+};
+
+#define BLE_CMD_FLAG_NONE 0
+#define BLE_CMD_FLAG_DEDUPE BIT(0) // Reads whose second queued copy would return the same value
+#define BLE_CMD_FLAG_ABSOLUTE BIT(1) // Writes of a full value, the newest one is all that matters
+
+/* What a failed command leads to */
+enum ble_cmd_err_action
+{
+	BLE_CMD_ERR_GIVE_UP,		// Report the error to the owner
+	BLE_CMD_ERR_RETRY,			// Queue the command again after the back-off
+	BLE_CMD_ERR_RECONNECT,		// Fall back to a fresh bond through a reconnect
+	BLE_CMD_ERR_READ_VCP_STATE, // Read the Volume State, the change counter is stale
+};
+
+/* Matches every error in a rule */
+#define BLE_CMD_ERR_ANY 0
+
+struct ble_cmd_err_rule
+{
+	int err;
+	enum ble_cmd_err_action action;
+};
+
+/* Rules are checked in order, errors without a rule are given up. Commands
+ * with a done callback are never retried here, their owner retries them. */
+struct ble_cmd_retry_policy
+{
+	const struct ble_cmd_err_rule *rules;
+	uint8_t rule_count;
+	uint8_t max_attempts; // Including the first
+	uint16_t backoff_ms;  // Before the first retry, doubled for each further one
+};
+
+static const struct ble_cmd_err_rule ble_cmd_security_rules[] = {
+	// Retrying with the same keys cannot help, security_changed_cb() falls back
+	// to a fresh bond for bonded devices
+	{BT_SECURITY_ERR_AUTH_FAIL, BLE_CMD_ERR_GIVE_UP},
+	{BT_SECURITY_ERR_PIN_OR_KEY_MISSING, BLE_CMD_ERR_GIVE_UP},
+	{BLE_CMD_ERR_ANY, BLE_CMD_ERR_RETRY},
+};
+
+static const struct ble_cmd_err_rule ble_cmd_vcp_write_rules[] = {
+	{BT_ATT_ERR_INSUFFICIENT_ENCRYPTION, BLE_CMD_ERR_RECONNECT},
+	{BT_VCP_ERR_INVALID_COUNTER, BLE_CMD_ERR_READ_VCP_STATE},
+};
+
+static const struct ble_cmd_err_rule ble_cmd_vcp_read_rules[] = {
+	{BT_ATT_ERR_INSUFFICIENT_ENCRYPTION, BLE_CMD_ERR_RECONNECT},
+	{-EBUSY, BLE_CMD_ERR_RETRY},
+	{-ETIMEDOUT, BLE_CMD_ERR_RETRY},
+};
+
+static const struct ble_cmd_err_rule ble_cmd_read_rules[] = {
+	{-EBUSY, BLE_CMD_ERR_RETRY},
+	{-ETIMEDOUT, BLE_CMD_ERR_RETRY},
+};
+
+static const struct ble_cmd_err_rule ble_cmd_has_discover_rules[] = {
+	// Discovery can race the encryption of a fresh link, which is done by the retry
+	{BT_ATT_ERR_INSUFFICIENT_ENCRYPTION, BLE_CMD_ERR_RETRY},
+};
+
+static const struct ble_cmd_retry_policy ble_cmd_retry_NONE = {
+	.max_attempts = 1,
+};
+
+static const struct ble_cmd_retry_policy ble_cmd_retry_SECURITY = {
+	.rules = ble_cmd_security_rules,
+	.rule_count = ARRAY_SIZE(ble_cmd_security_rules),
+	.max_attempts = 3,
+	.backoff_ms = 500,
+};
+
+static const struct ble_cmd_retry_policy ble_cmd_retry_VCP_WRITE = {
+	.rules = ble_cmd_vcp_write_rules,
+	.rule_count = ARRAY_SIZE(ble_cmd_vcp_write_rules),
+	.max_attempts = 1,
+};
+
+static const struct ble_cmd_retry_policy ble_cmd_retry_VCP_READ = {
+	.rules = ble_cmd_vcp_read_rules,
+	.rule_count = ARRAY_SIZE(ble_cmd_vcp_read_rules),
+	.max_attempts = 3,
+	.backoff_ms = 100,
+};
+
+static const struct ble_cmd_retry_policy ble_cmd_retry_READ = {
+	.rules = ble_cmd_read_rules,
+	.rule_count = ARRAY_SIZE(ble_cmd_read_rules),
+	.max_attempts = 3,
+	.backoff_ms = 200,
+};
+
+static const struct ble_cmd_retry_policy ble_cmd_retry_HAS_DISCOVER = {
+	.rules = ble_cmd_has_discover_rules,
+	.rule_count = ARRAY_SIZE(ble_cmd_has_discover_rules),
+	.max_attempts = 3,
+	.backoff_ms = 500,
+};
+
+struct ble_cmd_desc
+{
+	const char *name;
+	ble_cmd_exec_fn exec;
+	enum ble_cmd_class cls;
+	enum ble_cmd_resource res;
+	enum ble_cmd_timeout_class timeout;
+	const struct ble_cmd_retry_policy *retry;
+	uint8_t flags;
+};
+
+/* Everything the queue knows about a command type, generated from BLE_CMD_LIST */
+static const struct ble_cmd_desc ble_cmd_desc[BLE_CMD_TYPE_COUNT] = {
+#define BLE_CMD_DESC(name_, exec_, cls_, res_, timeout_, retry_, flags_)                           \
+	[BLE_CMD_##name_] = {                                                                          \
+		.name = "BLE_CMD_" #name_,                                                                 \
+		.exec = ble_cmd_exec_##exec_,                                                              \
+		.cls = BLE_CMD_CLASS_##cls_,                                                               \
+		.res = BLE_CMD_RES_##res_,                                                                 \
+		.timeout = BLE_CMD_TIMEOUT_##timeout_,                                                     \
+		.retry = &ble_cmd_retry_##retry_,                                                          \
+		.flags = BLE_CMD_FLAG_##flags_,                                                            \
+	},
+	BLE_CMD_LIST(BLE_CMD_DESC)
+#undef BLE_CMD_DESC
+};
+
+static enum ble_cmd_class ble_cmd_class(enum ble_cmd_type type)
+{
+	return ble_cmd_desc[type].cls;
+}
+
+/* Response time estimate per command type, protected by ble_queue_mutex */
+struct ble_cmd_rto
+{
+	uint32_t srtt_ms;	// Smoothed response time
+	uint32_t rttvar_ms; // Smoothed mean deviation
+	uint8_t backoff;	// Timeouts since the last completion
+	bool measured;
+};
+
+static struct ble_cmd_rto ble_cmd_rto[CONFIG_BT_MAX_CONN][BLE_CMD_TYPE_COUNT];
+
+/* Time from one connection event the peripheral listens to the next */
+static uint32_t ble_link_event_ms(uint8_t device_id)
+{
+	const struct device_link_info *link = &device_ctx[device_id].link;
+
+	return (uint32_t)link->interval * 5 / 4 * (link->latency + 1);
+}
+
+/* Timeout for a command starting now. Mutex must be held. */
+static uint32_t ble_cmd_timeout_ms(uint8_t device_id, enum ble_cmd_type type)
+{
+	const struct ble_cmd_rto *rto = &ble_cmd_rto[device_id][type];
+	uint32_t event_ms = ble_link_event_ms(device_id);
+
+	if (ble_cmd_desc[type].timeout == BLE_CMD_TIMEOUT_FIXED)
+	{
+		return BLE_CMD_TIMEOUT_INITIAL_MS;
+	}
+
+	uint32_t floor_ms = MAX(BLE_CMD_TIMEOUT_MIN_MS, BLE_CMD_TIMEOUT_MIN_EVENTS * event_ms);
+	uint32_t timeout_ms;
+
+	if (rto->measured)
+	{
+		// Peripheral latency can add up to two listening events to any response
+		timeout_ms = rto->srtt_ms + MAX(4 * rto->rttvar_ms, 2 * event_ms);
+	}
+	else if (ble_cmd_desc[type].timeout == BLE_CMD_TIMEOUT_EXCHANGE && event_ms)
+	{
+		timeout_ms = BLE_CMD_TIMEOUT_EXCHANGE_EVENTS * event_ms;
+	}
+	else
+	{
+		timeout_ms = BLE_CMD_TIMEOUT_INITIAL_MS;
+	}
+
+	timeout_ms = MIN(timeout_ms << rto->backoff, BLE_CMD_TIMEOUT_MAX_MS);
+	return MAX(timeout_ms, floor_ms);
+}
+
+/* Fold a response time into the estimate of its type. Mutex must be held. */
+static void ble_cmd_rto_sample(uint8_t device_id, enum ble_cmd_type type, uint32_t sample_ms)
+{
+	struct ble_cmd_rto *rto = &ble_cmd_rto[device_id][type];
+
+	if (ble_cmd_desc[type].timeout == BLE_CMD_TIMEOUT_FIXED)
+	{
+		return;
+	}
+
+	if (!rto->measured)
+	{
+		rto->srtt_ms = sample_ms;
+		rto->rttvar_ms = sample_ms / 2;
+		rto->measured = true;
+	}
+	else
+	{
+		uint32_t delta = rto->srtt_ms > sample_ms ? rto->srtt_ms - sample_ms
+												  : sample_ms - rto->srtt_ms;
+
+		rto->rttvar_ms = (3 * rto->rttvar_ms + delta) / 4;
+		rto->srtt_ms = (7 * rto->srtt_ms + sample_ms) / 8;
+	}
+
+	rto->backoff = 0;
+}
+
+/* Longest a command may wait in the queue, 0 for no limit */
+static const uint32_t ble_cmd_max_wait_ms[BLE_CMD_CLASS_COUNT] = {
+	[BLE_CMD_CLASS_LINK] = 0,
+	[BLE_CMD_CLASS_USER] = BLE_CMD_MAX_WAIT_USER_MS,
+	[BLE_CMD_CLASS_REFRESH] = BLE_CMD_MAX_WAIT_REFRESH_MS,
+	[BLE_CMD_CLASS_BACKGROUND] = BLE_CMD_MAX_WAIT_BACKGROUND_MS,
+};
+
+/* What each class does when its link has no room left. A held volume key
+ * only moves the reconciler target, so absolute user writes that still
+ * overflow replace a queued one, while a relative step that would be lost
+ * is rejected with a notice; reads make room for link work and for newer
+ * reads, background work simply waits for its next turn. */
+static const enum ble_cmd_overload ble_cmd_overload_policy[BLE_CMD_CLASS_COUNT] = {
+	[BLE_CMD_CLASS_LINK] = BLE_CMD_OVERLOAD_REPLACE_OLDEST,
+	[BLE_CMD_CLASS_USER] = BLE_CMD_OVERLOAD_MERGE,
+	[BLE_CMD_CLASS_REFRESH] = BLE_CMD_OVERLOAD_REPLACE_OLDEST,
+	[BLE_CMD_CLASS_BACKGROUND] = BLE_CMD_OVERLOAD_REJECT,
+};
+
+/* Overload counters and the last "Busy" notice, protected by ble_queue_mutex */
+static struct ble_cmd_overload_stats ble_cmd_overload;
+static int64_t ble_cmd_busy_shown_at;
+
+/* Whether a link may take another pool block for a class, with promised
+ * blocks already spoken for by another link. One link may not take the blocks
+ * the other needs, and refresh or background work may not take the blocks
+ * kept for link and user commands. Mutex must be held. */
+static bool ble_cmd_has_room(uint8_t device_id, enum ble_cmd_class cls, int promised)
+{
+	bool reserved = cls <= BLE_CMD_CLASS_USER;
+	uint8_t link_limit = reserved ? BLE_CMD_QUEUE_SIZE : BLE_CMD_QUEUE_SIZE - BLE_CMD_USER_RESERVE;
+	int free_slots = BLE_CMD_POOL_SIZE - __builtin_popcount(ble_cmd_pool_used) - promised;
+
+	return ble_cmd_allocated[device_id] < link_limit && free_slots > 0 &&
+		   (reserved || free_slots > CONFIG_BT_MAX_CONN * BLE_CMD_USER_RESERVE);
+}
+
+/* Queued command of the same type a newer request could take over, NULL if
+ * there is none nobody waits for. Relative commands never merge: the step of
+ * the newer press would be lost. Mutex must be held. */
+static struct ble_cmd *ble_cmd_find_merge_target(uint8_t device_id, enum ble_cmd_type type,
+												  sys_snode_t **prev_out)
+{
+	sys_snode_t *prev = NULL;
+	sys_snode_t *node;
+
+	if (!(ble_cmd_desc[type].flags & (BLE_CMD_FLAG_DEDUPE | BLE_CMD_FLAG_ABSOLUTE)))
+	{
+		return NULL;
+	}
+
+	SYS_SLIST_FOR_EACH_NODE(&ble_cmd_queue[device_id], node)
+	{
+		struct ble_cmd *cmd = CONTAINER_OF(node, struct ble_cmd, node);
+
+		if (cmd->type == type && !cmd->done && !cmd->pair)
+		{
+			*prev_out = prev;
+			return cmd;
+		}
+
+		prev = node;
+	}
+
+	return NULL;
+}
+
+/* Take the merge target out of its queue so the newer request can take it
+ * over. Mutex must be held. */
+static struct ble_cmd *ble_cmd_take_merge_target(uint8_t device_id, enum ble_cmd_type type)
+{
+	sys_snode_t *prev;
+	struct ble_cmd *cmd = ble_cmd_find_merge_target(device_id, type, &prev);
+
+	if (cmd)
+	{
+		sys_slist_remove(&ble_cmd_queue[device_id], prev, &cmd->node);
+
+		// Keeps its handle and queue time, the rest is the new request's
+		cmd->d0 = 0;
+		cmd->retry_count = 0;
+		cmd->not_before = 0;
+		cmd->expires = 0;
+	}
+
+	return cmd;
+}
+
+/* Oldest queued read of the least urgent class at or below cls, NULL if there
+ * is none. Mutex must be held. */
+static struct ble_cmd *ble_cmd_find_victim(uint8_t device_id, enum ble_cmd_class cls,
+											sys_snode_t **prev_out)
+{
+	struct ble_cmd *victim = NULL;
+	sys_snode_t *prev = NULL;
+	sys_snode_t *node;
+
+	SYS_SLIST_FOR_EACH_NODE(&ble_cmd_queue[device_id], node)
+	{
+		struct ble_cmd *cmd = CONTAINER_OF(node, struct ble_cmd, node);
+		enum ble_cmd_class cmd_cls = ble_cmd_class(cmd->type);
+
+		if (cmd_cls >= cls && (ble_cmd_desc[cmd->type].flags & BLE_CMD_FLAG_DEDUPE) &&
+			!cmd->done && !cmd->pair &&
+			(!victim || cmd_cls > ble_cmd_class(victim->type) ||
+			 (cmd_cls == ble_cmd_class(victim->type) &&
+			  (int32_t)(cmd->queued_at - victim->queued_at) < 0)))
+		{
+			victim = cmd;
+			*prev_out = prev;
+		}
+
+		prev = node;
+	}
+
+	return victim;
+}
+
+/* Drop the oldest queued read of the least urgent class at or below cls to
+ * make room. Returns false if there is none. Mutex must be held. */
+static bool ble_cmd_evict_oldest(uint8_t device_id, enum ble_cmd_class cls)
+{
+	sys_snode_t *victim_prev;
+	struct ble_cmd *victim = ble_cmd_find_victim(device_id, cls, &victim_prev);
+
+	if (!victim)
+	{
+		return false;
+	}
+
+	LOG_WRN("Queue full, dropping %s (id %u) [DEVICE ID %d]",
+			command_type_to_string(victim->type), victim->id, device_id);
+	sys_slist_remove(&ble_cmd_queue[device_id], victim_prev, &victim->node);
+	ble_cmd_overload.evicted[ble_cmd_class(victim->type)]++;
+	cmd_latency_count_result(device_id, victim->type, -ENOBUFS);
+	ble_cmd_free(victim);
+	return true;
+}
+
+/* Whether ble_cmd_alloc() would succeed with promised pool blocks already
+ * spoken for by another link. Sets fresh if it would take a new pool block
+ * rather than a queued command or the block of an evicted one. Mutex must be
+ * held. */
+static bool ble_cmd_can_alloc(uint8_t device_id, enum ble_cmd_type type, int promised,
+							  bool *fresh)
+{
+	enum ble_cmd_class cls = ble_cmd_class(type);
+	sys_snode_t *prev;
+
+	*fresh = ble_cmd_has_room(device_id, cls, promised);
+	if (*fresh)
+	{
+		return true;
+	}
+
+	switch (ble_cmd_overload_policy[cls])
+	{
+	case BLE_CMD_OVERLOAD_MERGE:
+		return ble_cmd_find_merge_target(device_id, type, &prev) != NULL;
+
+	case BLE_CMD_OVERLOAD_REPLACE_OLDEST:
+	{
+		if (!ble_cmd_find_victim(device_id, cls, &prev))
+		{
+			return false;
+		}
+
+		// Room as if the block of the victim were back already
+		ble_cmd_allocated[device_id]--;
+		bool room = ble_cmd_has_room(device_id, cls, promised - 1);
+		ble_cmd_allocated[device_id]++;
+		return room;
+	}
+
+	default:
+		return false;
+	}
+}
+
+/* Count and report a command the overload policy could not place */
+static void ble_cmd_reject(uint8_t device_id, enum ble_cmd_type type)
+{
+	enum ble_cmd_class cls = ble_cmd_class(type);
+	bool busy_notice = false;
+	int64_t now = k_uptime_get();
+
+	k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+	ble_cmd_overload.rejected[cls]++;
+	if (cls == BLE_CMD_CLASS_USER &&
+		(ble_cmd_busy_shown_at == 0 || now - ble_cmd_busy_shown_at >= BLE_CMD_BUSY_NOTICE_MS))
+	{
+		ble_cmd_busy_shown_at = now;
+		busy_notice = true;
+	}
+	k_mutex_unlock(&ble_queue_mutex);
+
+	LOG_ERR("Failed to allocate BLE command %s - queue full [DEVICE ID %d]",
+			command_type_to_string(type), device_id);
+	if (busy_notice)
+	{
+		// The press is lost, say so instead of doing nothing
+		display_manager_show_status("Busy");
+	}
+}
+
+/* Allocate a command from the shared pool. If the link has no room, the
+ * overload policy of the command's class applies; a merged request gets the
+ * queued command it took over, already out of its queue, to fill in and
+ * enqueue like a new one. */
+static struct ble_cmd *ble_cmd_alloc(uint8_t device_id, enum ble_cmd_type type)
+{
+	struct ble_cmd *cmd;
+	enum ble_cmd_class cls = ble_cmd_class(type);
+
+	k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+
+	if (!ble_cmd_has_room(device_id, cls, 0))
+	{
+		switch (ble_cmd_overload_policy[cls])
+		{
+		case BLE_CMD_OVERLOAD_MERGE:
+			cmd = ble_cmd_take_merge_target(device_id, type);
+			if (cmd)
+			{
+				ble_cmd_overload.merged[cls]++;
+				k_mutex_unlock(&ble_queue_mutex);
+				LOG_DBG("Queue full, %s merged into command %u [DEVICE ID %d]",
+						command_type_to_string(type), cmd->id, device_id);
+				return cmd;
+			}
+			break;
+
+		case BLE_CMD_OVERLOAD_REPLACE_OLDEST:
+			ble_cmd_evict_oldest(device_id, cls);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if (!ble_cmd_has_room(device_id, cls, 0))
+	{
+		k_mutex_unlock(&ble_queue_mutex);
+		ble_cmd_reject(device_id, type);
+		return NULL;
+	}
+
+	int slot = find_lsb_set(~ble_cmd_pool_used) - 1;
+
+	ble_cmd_pool_used |= BIT(slot);
+	if (++ble_cmd_allocated[device_id] > ble_cmd_overload.high_water[device_id])
+	{
+		ble_cmd_overload.high_water[device_id] = ble_cmd_allocated[device_id];
+	}
+	cmd = &ble_cmd_pool[slot];
+	memset(cmd, 0, sizeof(struct ble_cmd));
+	k_mutex_unlock(&ble_queue_mutex);
+
+	cmd->device_id = device_id;
+	cmd->type = type;
+	return cmd;
+}
+
+/* Free a command back to the shared pool */
+static void ble_cmd_free(struct ble_cmd *cmd)
+{
+	if (cmd)
+	{
+		uint8_t slot = cmd - ble_cmd_pool;
+
+		k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+		if (!(ble_cmd_pool_used & BIT(slot)))
+		{
+			k_mutex_unlock(&ble_queue_mutex);
+			LOG_ERR("BLE command freed twice (slot %u)", slot);
+			return;
+		}
+
+		ble_cmd_pool_used &= ~BIT(slot);
+		ble_cmd_allocated[cmd->device_id]--;
+		// Whatever still holds the handle no longer matches
+		cmd->id = 0;
+		k_mutex_unlock(&ble_queue_mutex);
+	}
+}
+
+/* Issue a new handle for a command, retiring the one it had. Mutex must be held. */
+static ble_cmd_handle_t ble_cmd_new_handle(struct ble_cmd *cmd)
+{
+	uint8_t slot = cmd - ble_cmd_pool;
+	uint32_t generation = ++ble_cmd_generation[slot] & (UINT32_MAX >> BLE_CMD_HANDLE_SLOT_BITS);
+
+	// Generation 0 is skipped so no handle is ever 0
+	if (generation == 0)
+	{
+		generation = ble_cmd_generation[slot] = 1;
+	}
+
+	return (generation << BLE_CMD_HANDLE_SLOT_BITS) | slot;
+}
+
+/* Command a handle was issued for, NULL if it was freed or handed a newer
+ * handle since. Mutex must be held. */
+static struct ble_cmd *ble_cmd_from_handle(ble_cmd_handle_t handle)
+{
+	uint32_t slot = handle & BIT_MASK(BLE_CMD_HANDLE_SLOT_BITS);
+
+	if (handle == 0 || slot >= BLE_CMD_POOL_SIZE || !(ble_cmd_pool_used & BIT(slot)) ||
+		ble_cmd_pool[slot].id != handle)
+	{
+		return NULL;
+	}
+
+	return &ble_cmd_pool[slot];
+}
+
+/* Queued copy of an idempotent read, NULL if there is none. Mutex must be held. */
+static struct ble_cmd *ble_cmd_find_queued_read(const struct ble_cmd *cmd, sys_snode_t **prev_out)
+{
+	sys_snode_t *prev = NULL;
+	sys_snode_t *node;
+
+	SYS_SLIST_FOR_EACH_NODE(&ble_cmd_queue[cmd->device_id], node)
+	{
+		struct ble_cmd *queued = CONTAINER_OF(node, struct ble_cmd, node);
+
+		if (queued->type == cmd->type && queued->d0 == cmd->d0 && !queued->done)
+		{
+			*prev_out = prev;
+			return queued;
+		}
+
+		prev = node;
+	}
+
+	return NULL;
+}
+
+/* Put a command into its queue without waking the dispatcher: behind every
+ * command of a more urgent class and, unless high_priority, behind those of
+ * its own class. A read that is already queued is not queued twice, the new
+ * copy is freed and the queued one moves up if high_priority asks for it.
+ * Returns the ID of the queued command. */
+static ble_cmd_handle_t ble_cmd_insert(struct ble_cmd *cmd, bool high_priority)
+{
+	uint8_t device_id = cmd->device_id;
+	enum ble_cmd_class cls = ble_cmd_class(cmd->type);
+	sys_slist_t *queue = &ble_cmd_queue[device_id];
+
+	k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+
+	if ((ble_cmd_desc[cmd->type].flags & BLE_CMD_FLAG_DEDUPE) && !cmd->done)
+	{
+		sys_snode_t *dup_prev;
+		struct ble_cmd *dup = ble_cmd_find_queued_read(cmd, &dup_prev);
+
+		if (dup)
+		{
+			LOG_DBG("%s already queued as command %u [DEVICE ID %d]",
+					command_type_to_string(cmd->type), dup->id, device_id);
+			ble_cmd_free(cmd);
+
+			if (!high_priority)
+			{
+				k_mutex_unlock(&ble_queue_mutex);
+				return dup->id;
+			}
+
+			sys_slist_remove(queue, dup_prev, &dup->node);
+			cmd = dup;
+		}
+	}
+
+	if (cmd->id == 0)
+	{
+		cmd->id = ble_cmd_new_handle(cmd);
+		cmd->queued_at = k_cycle_get_32();
+	}
+
+	if (cmd->expires == 0 && ble_cmd_max_wait_ms[cls] != 0)
+	{
+		cmd->expires = k_uptime_get() + ble_cmd_max_wait_ms[cls];
+	}
+
+	sys_snode_t *prev = NULL;
+	sys_snode_t *node;
+
+	SYS_SLIST_FOR_EACH_NODE(queue, node)
+	{
+		enum ble_cmd_class queued_cls =
+			ble_cmd_class(CONTAINER_OF(node, struct ble_cmd, node)->type);
+
+		if (queued_cls > cls || (queued_cls == cls && high_priority))
+		{
+			break;
+		}
+
+		prev = node;
+	}
+
+	sys_slist_insert(queue, prev, &cmd->node);
+	ble_cmd_handle_t cmd_id = cmd->id;
+	k_mutex_unlock(&ble_queue_mutex);
+
+	return cmd_id;
+}
+
+/* Enqueue a command */
+static int ble_cmd_enqueue(struct ble_cmd *cmd, bool high_priority)
+{
+	if (!cmd)
+	{
+		return -EINVAL;
+	}
+
+	if (!device_ctx)
+	{
+		LOG_ERR("Cannot enqueue command - device_ctx not initialized");
+		ble_cmd_free(cmd);
+		return -EINVAL;
+	}
+
+	// The command may be started and freed as soon as it is queued
+	uint8_t device_id = cmd->device_id;
+	enum ble_cmd_type type = cmd->type;
+	ble_cmd_handle_t cmd_id = ble_cmd_insert(cmd, high_priority);
+
+	LOG_DBG("%sBLE command enqueued, type: %s, id: %u [DEVICE ID %d]",
+			high_priority ? "High priority " : "", command_type_to_string(type), cmd_id,
+			device_id);
+
+	// Signal the dispatcher
+	ble_cmd_dispatch();
+	return 0;
+}
+
+/* Drop queued commands that waited past their class limit. Their owners are
+ * told with -ETIME, the state reconciler replans from the current target. */
+static void ble_cmd_drop_expired(uint8_t device_id)
+{
+	sys_slist_t *queue = &ble_cmd_queue[device_id];
+	sys_slist_t expired;
+	int64_t now = k_uptime_get();
+
+	sys_slist_init(&expired);
+
+	k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+
+	sys_snode_t *prev = NULL;
+	sys_snode_t *node = sys_slist_peek_head(queue);
+
+	while (node)
+	{
+		sys_snode_t *next = sys_slist_peek_next(node);
+		struct ble_cmd *cmd = CONTAINER_OF(node, struct ble_cmd, node);
+
+		if (cmd->expires != 0 && cmd->expires <= now)
+		{
+			sys_slist_remove(queue, prev, node);
+			sys_slist_append(&expired, node);
+		}
+		else
+		{
+			prev = node;
+		}
+
+		node = next;
+	}
+
+	k_mutex_unlock(&ble_queue_mutex);
+
+	while ((node = sys_slist_get(&expired)) != NULL)
+	{
+		struct ble_cmd *cmd = CONTAINER_OF(node, struct ble_cmd, node);
+		ble_cmd_done_cb done = cmd->done;
+		uint16_t pair = cmd->pair;
+
+		LOG_WRN("Dropping stale command: type=%s, id=%u [DEVICE ID %d]",
+				command_type_to_string(cmd->type), cmd->id, device_id);
+		cmd_latency_count_result(device_id, cmd->type, -ETIME);
+		ble_cmd_free(cmd);
+		ble_cmd_finished(device_id, pair, done, -ETIME);
+	}
+}
+
+static enum ble_cmd_resource ble_cmd_resource(enum ble_cmd_type type)
+{
+	return ble_cmd_desc[type].res;
+}
+
+/* Move the first command that may start now from the queue into a free
+ * window slot. Mutex must be held. */
+static struct ble_cmd *ble_cmd_take_ready(uint8_t device_id)
+{
+	struct ble_cmd **window = ble_cmd_inflight[device_id];
+	uint32_t busy = 0;    /* Resources of the commands in flight */
+	uint32_t skipped = 0; /* Resources of queued commands that have to wait */
+	uint8_t in_flight = 0;
+	int free_slot = -1;
+
+	for (int i = 0; i < BLE_CMD_WINDOW_SIZE; i++)
+	{
+		if (window[i])
+		{
+			busy |= BIT(ble_cmd_resource(window[i]->type));
+			in_flight++;
+		}
+		else if (free_slot < 0)
+		{
+			free_slot = i;
+		}
+	}
+
+	if (free_slot < 0 || (busy & BIT(BLE_CMD_RES_EXCLUSIVE)))
+	{
+		return NULL;
+	}
+
+	sys_snode_t *prev = NULL;
+	sys_snode_t *node;
+	int64_t now = k_uptime_get();
+
+	SYS_SLIST_FOR_EACH_NODE(&ble_cmd_queue[device_id], node)
+	{
+		struct ble_cmd *cmd = CONTAINER_OF(node, struct ble_cmd, node);
+		enum ble_cmd_resource res = ble_cmd_resource(cmd->type);
+
+		// A retry still backing off lets everything else pass
+		if (cmd->not_before > now)
+		{
+			ble_cmd_arm_retry(cmd->not_before);
+			prev = node;
+			continue;
+		}
+
+		if (res == BLE_CMD_RES_EXCLUSIVE && in_flight > 0)
+		{
+			return NULL;
+		}
+
+		if ((busy | skipped) & BIT(res))
+		{
+			skipped |= BIT(res);
+			prev = node;
+			continue;
+		}
+
+		sys_slist_remove(&ble_cmd_queue[device_id], prev, node);
+		cmd->deadline = now + ble_cmd_timeout_ms(device_id, cmd->type);
+		window[free_slot] = cmd;
+		return cmd;
+	}
+
+	return NULL;
+}
+
+/* Take an in-flight command out of the window by handle. Mutex must be held. */
+static struct ble_cmd *ble_cmd_take_inflight(uint8_t device_id, ble_cmd_handle_t cmd_id)
+{
+	struct ble_cmd *cmd = ble_cmd_from_handle(cmd_id);
+
+	if (!cmd || cmd->device_id != device_id)
+	{
+		return NULL;
+	}
+
+	for (int i = 0; i < BLE_CMD_WINDOW_SIZE; i++)
+	{
+		if (ble_cmd_inflight[device_id][i] == cmd)
+		{
+			ble_cmd_inflight[device_id][i] = NULL;
+			return cmd;
+		}
+	}
+
+	return NULL;
+}
+
+/* Run the timeout work at the earliest deadline in the window. Mutex must be held. */
+static void ble_cmd_arm_timeout(uint8_t device_id)
+{
+	int64_t earliest = INT64_MAX;
+
+	for (int i = 0; i < BLE_CMD_WINDOW_SIZE; i++)
+	{
+		struct ble_cmd *cmd = ble_cmd_inflight[device_id][i];
+
+		if (cmd && cmd->deadline < earliest)
+		{
+			earliest = cmd->deadline;
+		}
+	}
+
+	if (earliest == INT64_MAX)
+	{
+		k_work_cancel_delayable(&ble_cmd_timeout_work[device_id]);
+		return;
+	}
+
+	int64_t delay = MAX(earliest - k_uptime_get(), 0);
+	k_work_reschedule_for_queue(&ble_cmd_wq, &ble_cmd_timeout_work[device_id], K_MSEC(delay));
+}
+
+/* Execute a single BLE command */
+static int ble_cmd_execute(struct ble_cmd *cmd)
+{
+	/* Save command fields to local variables before execution.
+	 * The command may be freed by synchronous callbacks during execution
+	 * (e.g., has_discover_cb can call ble_cmd_complete synchronously). */
+	uint8_t device_id = cmd->device_id;
+	enum ble_cmd_type type = cmd->type;
+	uint8_t d0 = cmd->d0;
+	ble_cmd_handle_t cmd_id = cmd->id;
+
+	LOG_DBG("Executing BLE command type %s [DEVICE ID %d]", command_type_to_string(type),
+			device_id);
+
+	if (device_id != 0 && device_id != 1)
+	{
+		LOG_ERR("Invalid device ID in BLE command: %d", device_id);
+		return -EINVAL;
+	}
+
+	if ((unsigned int)type >= BLE_CMD_TYPE_COUNT)
+	{
+		LOG_ERR("Unknown BLE command type: %d", type);
+		return -EINVAL;
+	}
+
+	int err = ble_cmd_desc[type].exec(device_id, cmd_id, d0);
+
+	/* Only the saved fields are used from here on, the command may be gone */
+	if (err)
+	{
+		LOG_ERR("BLE command execution failed: type %s, id %u (err %d) [DEVICE ID %d]",
+				command_type_to_string(type), cmd_id, err, device_id);
+	} else {
+		LOG_DBG("BLE command execution succeeded: type=%s, id=%u [DEVICE ID %d]",
+				command_type_to_string(type), cmd_id, device_id);
+	}
+
+	return err;
+}
+
+/* Record one finished half of a binaural write */
+static void ble_binaural_record(uint8_t device_id, uint16_t pair, int err)
+{
+	k_mutex_lock(&binaural_mutex, K_FOREVER);
+
+	if (pair != binaural.pair)
+	{
+		// Half of an older write, already counted as incomplete
+		k_mutex_unlock(&binaural_mutex);
+		return;
+	}
+
+	binaural.finished |= BIT(device_id);
+	binaural.finished_at[device_id] = k_uptime_ticks();
+	binaural.failed |= (err != 0);
+
+	if (binaural.finished != (BIT(0) | BIT(1)))
+	{
+		k_mutex_unlock(&binaural_mutex);
+		return;
+	}
+
+	binaural.pair = 0;
+
+	if (binaural.failed)
+	{
+		binaural_stats.incomplete++;
+		k_mutex_unlock(&binaural_mutex);
+		return;
+	}
+
+	int64_t ticks = binaural.finished_at[0] - binaural.finished_at[1];
+	uint32_t skew_us = (uint32_t)k_ticks_to_us_floor64(ticks < 0 ? -ticks : ticks);
+
+	binaural_stats.completed++;
+	binaural_stats.skew_last_us = skew_us;
+	binaural_stats.skew_max_us = MAX(binaural_stats.skew_max_us, skew_us);
+	binaural_stats.skew_total_us += skew_us;
+	if (skew_us <= BLE_BINAURAL_SKEW_TARGET_US)
+	{
+		binaural_stats.within_target++;
+	}
+	k_mutex_unlock(&binaural_mutex);
+
+	if (skew_us > BLE_BINAURAL_SKEW_TARGET_US)
+	{
+		LOG_WRN("Binaural write %u completed %u us apart", pair, skew_us);
+	}
+	else
+	{
+		LOG_DBG("Binaural write %u completed %u us apart", pair, skew_us);
+	}
+}
+
+/* Report a finished command to its owner. Call without the queue mutex held. */
+static void ble_cmd_finished(uint8_t device_id, uint16_t pair, ble_cmd_done_cb done, int err)
+{
+	if (pair)
+	{
+		ble_binaural_record(device_id, pair, err);
+	}
+
+	if (done)
+	{
+		done(device_id, err);
+	}
+}
+
+/* Look up what the retry policy of a command says about an error */
+static enum ble_cmd_err_action ble_cmd_err_action(enum ble_cmd_type type, int err)
+{
+	const struct ble_cmd_retry_policy *policy = ble_cmd_desc[type].retry;
+
+	for (uint8_t i = 0; i < policy->rule_count; i++)
+	{
+		if (policy->rules[i].err == err || policy->rules[i].err == BLE_CMD_ERR_ANY)
+		{
+			return policy->rules[i].action;
+		}
+	}
+
+	return BLE_CMD_ERR_GIVE_UP;
+}
+
+/* Apply the retry policy to a failed command that has left the window.
+ * Returns true if it was queued again; otherwise the caller frees it and
+ * reports the error. Call without the queue mutex held. */
+static bool ble_cmd_retry(struct ble_cmd *cmd, int err)
+{
+	const struct ble_cmd_retry_policy *policy = ble_cmd_desc[cmd->type].retry;
+	uint8_t device_id = cmd->device_id;
+
+	switch (ble_cmd_err_action(cmd->type, err))
+	{
+	case BLE_CMD_ERR_RECONNECT:
+		LOG_ERR("%s failed due to insufficient encryption - reconnecting [DEVICE ID %d]",
+				command_type_to_string(cmd->type), device_id);
+		ble_manager_trusted_bond_fallback(device_id);
+		return false;
+
+	case BLE_CMD_ERR_READ_VCP_STATE:
+		LOG_ERR("%s failed due to incorrect change_counter - reading state [DEVICE ID %d]",
+				command_type_to_string(cmd->type), device_id);
+		ble_cmd_vcp_read_state(device_id, true);
+		return false;
+
+	case BLE_CMD_ERR_RETRY:
+		break;
+
+	case BLE_CMD_ERR_GIVE_UP:
+	default:
+		return false;
+	}
+
+	// Owners that are told about the result retry with what they want by then
+	if (cmd->done)
+	{
+		return false;
+	}
+
+	if (cmd->retry_count + 1 >= policy->max_attempts)
+	{
+		LOG_WRN("Giving up %s after %u attempts (err %d) [DEVICE ID %d]",
+				command_type_to_string(cmd->type), cmd->retry_count + 1, err, device_id);
+		return false;
+	}
+
+	uint32_t backoff_ms = (uint32_t)policy->backoff_ms << cmd->retry_count;
+	enum ble_cmd_type type = cmd->type;
+
+	cmd->retry_count++;
+	LOG_WRN("Retrying %s in %u ms, attempt %u of %u (err %d) [DEVICE ID %d]",
+			command_type_to_string(type), backoff_ms, cmd->retry_count + 1,
+			policy->max_attempts, err, device_id);
+
+	k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+	// A new ID, so a late completion of this attempt cannot finish the next
+	cmd->id = 0;
+	cmd->not_before = k_uptime_get() + backoff_ms;
+	ble_cmd_arm_retry(cmd->not_before);
+	ble_cmd_insert(cmd, true);
+	k_mutex_unlock(&ble_queue_mutex);
+
+	return true;
+}
+
+/* Handle command timeout */
+static void ble_cmd_timeout_handler(struct k_work *work)
+{
+	uint8_t device_id = (work == &ble_cmd_timeout_work[0].work) ? 0 : 1;
+	int64_t now = k_uptime_get();
+	uint8_t expired = 0;
+	struct ble_cmd *timed_out[BLE_CMD_WINDOW_SIZE];
+
+	k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+
+	for (int i = 0; i < BLE_CMD_WINDOW_SIZE; i++)
+	{
+		struct ble_cmd *cmd = ble_cmd_inflight[device_id][i];
+
+		if (cmd && cmd->deadline <= now)
+		{
+			LOG_ERR("BLE command timeout (safety net): type=%s, id=%u [DEVICE ID %d]",
+					command_type_to_string(cmd->type), cmd->id, device_id);
+			cmd_latency_count_result(device_id, cmd->type, -ETIMEDOUT);
+
+			// Back off until the type completes again
+			struct ble_cmd_rto *rto = &ble_cmd_rto[device_id][cmd->type];
+			rto->backoff = MIN(rto->backoff + 1, BLE_CMD_TIMEOUT_MAX_BACKOFF);
+
+			// Out of the window, a late completion is ignored
+			timed_out[expired++] = cmd;
+			ble_cmd_inflight[device_id][i] = NULL;
+		}
+	}
+
+	ble_cmd_arm_timeout(device_id);
+	k_mutex_unlock(&ble_queue_mutex);
+
+	if (!expired)
+	{
+		LOG_WRN("Timeout but no command expired [DEVICE ID %d]", device_id);
+	}
+
+	for (uint8_t i = 0; i < expired; i++)
+	{
+		struct ble_cmd *cmd = timed_out[i];
+
+		if (ble_cmd_retry(cmd, -ETIMEDOUT))
+		{
+			continue;
+		}
+
+		ble_cmd_done_cb done = cmd->done;
+		uint16_t pair = cmd->pair;
+		ble_cmd_free(cmd);
+
+		ble_cmd_finished(device_id, pair, done, -ETIMEDOUT);
+	}
+
+	// Process next command
+	ble_cmd_dispatch();
+}
+
+/* Mark command as complete (called when subsystem command completes) */
+void ble_cmd_complete(uint8_t device_id, ble_cmd_handle_t cmd_id, int err)
+{
+	uint32_t now = k_cycle_get_32();
+
+	k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+	struct ble_cmd *cmd = ble_cmd_take_inflight(device_id, cmd_id);
+	if (cmd && !err)
+	{
+		ble_cmd_rto_sample(device_id, cmd->type, k_cyc_to_ms_floor32(now - cmd->started_at));
+	}
+	ble_cmd_arm_timeout(device_id);
+	k_mutex_unlock(&ble_queue_mutex);
+
+	if (!cmd)
+	{
+		LOG_WRN("Command %u complete but not in flight (err %d) [DEVICE ID %d]", cmd_id, err,
+				device_id);
+		return;
+	}
+
+	cmd_latency_record(device_id, cmd->type, CMD_LATENCY_RESPONSE, now - cmd->started_at);
+	cmd_latency_count_result(device_id, cmd->type, err);
+
+	if (err)
+	{
+		LOG_ERR("BLE command failed: type=%s, id=%u, err=%d [DEVICE ID %d]",
+				command_type_to_string(cmd->type), cmd->id, err, device_id);
+
+		if (ble_cmd_retry(cmd, err))
+		{
+			ble_cmd_dispatch();
+			return;
+		}
+	}
+	else
+	{
+		LOG_DBG("BLE command completed successfully: type=%s, id=%u [DEVICE ID %d]",
+				command_type_to_string(cmd->type), cmd->id, device_id);
+	}
+
+	// Free the command
+	ble_cmd_done_cb done = cmd->done;
+	uint16_t pair = cmd->pair;
+	ble_cmd_free(cmd);
+
+	ble_cmd_finished(device_id, pair, done, err);
+
+	// Process next command, also after a failure so the rest of the queue does not stall
+	ble_cmd_dispatch();
+}
+
+/* Start queued commands until the window is full or the next one has to wait */
+static void ble_process_next_command(uint8_t device_id)
+{
+	ble_cmd_drop_expired(device_id);
+
+	while (1)
+	{
+		k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+		struct ble_cmd *cmd = ble_cmd_take_ready(device_id);
+		if (cmd)
+		{
+			ble_cmd_arm_timeout(device_id);
+		}
+		k_mutex_unlock(&ble_queue_mutex);
+
+		if (!cmd)
+		{
+			LOG_DBG("No BLE command ready to start [DEVICE ID %d]", device_id);
+			return;
+		}
+
+		ble_cmd_handle_t cmd_id = cmd->id;
+		enum ble_cmd_type type = cmd->type;
+		uint32_t started_at = k_cycle_get_32();
+
+		cmd->started_at = started_at;
+		cmd_latency_record(device_id, type, CMD_LATENCY_QUEUED, started_at - cmd->queued_at);
+		cmd_latency_count_start(device_id, type);
+
+		// Execute the command
+		int err = ble_cmd_execute(cmd);
+		cmd_latency_record(device_id, type, CMD_LATENCY_EXECUTE, k_cycle_get_32() - started_at);
+		if (!err)
+		{
+			// Wait for completion callback with timeout
+			LOG_DBG("Command waiting for completion: type=%s, id=%u [DEVICE ID %d]",
+					command_type_to_string(type), cmd_id, device_id);
+			continue;
+		}
+
+		// Command failed to initiate, so it will never complete
+		LOG_ERR("Failed to initiate BLE command (err %d) [DEVICE ID %d]", err, device_id);
+
+		k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+		cmd = ble_cmd_take_inflight(device_id, cmd_id);
+		ble_cmd_arm_timeout(device_id);
+		k_mutex_unlock(&ble_queue_mutex);
+
+		if (!cmd)
+		{
+			// Already completed from within the executor
+			continue;
+		}
+
+		cmd_latency_count_result(device_id, type, err);
+		if (ble_cmd_retry(cmd, err))
+		{
+			continue;
+		}
+
+		// State writes are retried by their owner, which knows the current target
+		LOG_WRN("Skipping command: type=%s [DEVICE ID %d]", command_type_to_string(type),
+				device_id);
+		ble_cmd_done_cb done = cmd->done;
+		uint16_t pair = cmd->pair;
+		ble_cmd_free(cmd);
+
+		ble_cmd_finished(device_id, pair, done, err);
+	}
+}
+
+int ble_cmd_request_security(uint8_t device_id)
+{
+	struct ble_cmd *cmd = ble_cmd_alloc(device_id, BLE_CMD_REQUEST_SECURITY);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = device_id;
+	cmd->type = BLE_CMD_REQUEST_SECURITY;
+	return ble_cmd_enqueue(cmd, true); // Security requests should always be high priority
+}
+
+int ble_cmd_vcp_discover(uint8_t device_id, bool high_priority)
+{
+	struct device_context *ctx = &device_ctx[device_id];
+
+	struct ble_cmd *cmd = ble_cmd_alloc(device_id, BLE_CMD_VCP_DISCOVER);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_VCP_DISCOVER;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_vcp_set_volume(uint8_t device_id, uint8_t volume, bool high_priority)
+{
+	struct device_context *ctx = &device_ctx[device_id];
+	ble_cmd_vcp_read_state(ctx->device_id, false);
+
+	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id, BLE_CMD_VCP_SET_VOLUME);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_VCP_SET_VOLUME;
+	cmd->d0 = volume;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_vcp_mute(uint8_t device_id, bool high_priority)
+{
+	struct device_context *ctx = &device_ctx[device_id];
+	ble_cmd_vcp_read_state(ctx->device_id, false);
+
+	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id, BLE_CMD_VCP_MUTE);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_VCP_MUTE;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_vcp_unmute(uint8_t device_id, bool high_priority)
+{
+	struct device_context *ctx = &device_ctx[device_id];
+	ble_cmd_vcp_read_state(ctx->device_id, false);
+
+	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id, BLE_CMD_VCP_UNMUTE);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_VCP_UNMUTE;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_vcp_read_state(uint8_t device_id, bool high_priority)
+{
+	struct device_context *ctx = &device_ctx[device_id];
+	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id, BLE_CMD_VCP_READ_STATE);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_VCP_READ_STATE;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_gatt_db_hash_read(uint8_t device_id, bool high_priority)
+{
+	struct ble_cmd *cmd = ble_cmd_alloc(device_id, BLE_CMD_GATT_DB_HASH_READ);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = device_id;
+	cmd->type = BLE_CMD_GATT_DB_HASH_READ;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_wake_snapshot(uint8_t device_id, bool high_priority)
+{
+	struct ble_cmd *cmd = ble_cmd_alloc(device_id, BLE_CMD_WAKE_SNAPSHOT);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = device_id;
+	cmd->type = BLE_CMD_WAKE_SNAPSHOT;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_state_write(uint8_t device_id, enum ble_cmd_type type, uint8_t d0, ble_cmd_done_cb done)
+{
+	struct ble_cmd *cmd = ble_cmd_alloc(device_id, type);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = device_id;
+	cmd->type = type;
+	cmd->d0 = d0;
+	cmd->done = done;
+	return ble_cmd_enqueue(cmd, false);
+}
+
+int ble_cmd_binaural_write(const enum ble_cmd_type type[2], const uint8_t d0[2], ble_cmd_done_cb done)
+{
+	struct ble_cmd *cmd[2];
+	uint16_t pair;
+
+	if (!device_ctx)
+	{
+		return -EINVAL;
+	}
+
+	// Both halves are placed before either is allocated: a half may take over
+	// a queued command, which could not be handed back if the other failed
+	k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+
+	uint8_t promised = 0;
+
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		bool fresh;
+
+		if (!ble_cmd_can_alloc(i, type[i], promised, &fresh))
+		{
+			k_mutex_unlock(&ble_queue_mutex);
+			ble_cmd_reject(i, type[i]);
+			return -ENOMEM;
+		}
+
+		promised += fresh;
+	}
+
+	// Cannot fail while the mutex is held
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		cmd[i] = ble_cmd_alloc(i, type[i]);
+	}
+	k_mutex_unlock(&ble_queue_mutex);
+
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		cmd[i]->device_id = i;
+		cmd[i]->type = type[i];
+		cmd[i]->d0 = d0[i];
+		cmd[i]->done = done;
+	}
+
+	k_mutex_lock(&binaural_mutex, K_FOREVER);
+	if (binaural.pair)
+	{
+		binaural_stats.incomplete++;
+	}
+	if (++binaural_last_pair == 0)
+	{
+		binaural_last_pair = 1;
+	}
+	pair = binaural_last_pair;
+	binaural.pair = pair;
+	binaural.finished = 0;
+	binaural.failed = false;
+	binaural_stats.dispatched++;
+	k_mutex_unlock(&binaural_mutex);
+
+	// Both halves go in front of queued work before the dispatcher runs
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		cmd[i]->pair = pair;
+		ble_cmd_insert(cmd[i], true);
+	}
+
+	ble_cmd_dispatch();
+
+	LOG_DBG("Binaural write %u released: %s / %s", pair, command_type_to_string(type[0]),
+			command_type_to_string(type[1]));
+	return 0;
+}
+
+void ble_cmd_get_binaural_stats(struct ble_binaural_stats *stats)
+{
+	k_mutex_lock(&binaural_mutex, K_FOREVER);
+	*stats = binaural_stats;
+	k_mutex_unlock(&binaural_mutex);
+}
+
+void ble_cmd_log_binaural_stats(void)
+{
+	struct ble_binaural_stats s;
+
+	ble_cmd_get_binaural_stats(&s);
+	LOG_INF("Binaural writes: %u released, %u completed, %u incomplete", s.dispatched,
+			s.completed, s.incomplete);
+	if (s.completed)
+	{
+		LOG_INF("Binaural skew: last %u us, mean %u us, max %u us, %u of %u within %u us",
+				s.skew_last_us, (uint32_t)(s.skew_total_us / s.completed), s.skew_max_us,
+				s.within_target, s.completed, BLE_BINAURAL_SKEW_TARGET_US);
+	}
+}
+
+void ble_cmd_get_overload_stats(struct ble_cmd_overload_stats *stats)
+{
+	k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+	*stats = ble_cmd_overload;
+	memcpy(stats->held, ble_cmd_allocated, sizeof(stats->held));
+	k_mutex_unlock(&ble_queue_mutex);
+}
+
+void ble_cmd_log_overload_stats(void)
+{
+	struct ble_cmd_overload_stats s;
+
+	ble_cmd_get_overload_stats(&s);
+	for (int cls = 0; cls < BLE_CMD_CLASS_COUNT; cls++)
+	{
+		if (s.merged[cls] || s.evicted[cls] || s.rejected[cls])
+		{
+			LOG_INF("Queue overload, class %d: %u merged, %u evicted, %u rejected", cls,
+					s.merged[cls], s.evicted[cls], s.rejected[cls]);
+		}
+	}
+	for (uint8_t dev = 0; dev < CONFIG_BT_MAX_CONN; dev++)
+	{
+		LOG_INF("Queue high water %u of %u [DEVICE ID %d]", s.high_water[dev],
+				BLE_CMD_QUEUE_SIZE, dev);
+	}
+}
+
+void ble_cmd_reset_overload_stats(void)
+{
+	k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+	memset(&ble_cmd_overload, 0, sizeof(ble_cmd_overload));
+	memcpy(ble_cmd_overload.high_water, ble_cmd_allocated, sizeof(ble_cmd_overload.high_water));
+	k_mutex_unlock(&ble_queue_mutex);
+}
+
+int ble_cmd_vcp_read_flags(uint8_t device_id, bool high_priority)
+{
+	struct device_context *ctx = &device_ctx[device_id];
+	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id, BLE_CMD_VCP_READ_FLAGS);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_VCP_READ_FLAGS;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_bas_discover(uint8_t device_id, bool high_priority)
+{
+	struct device_context *ctx = &device_ctx[device_id];
+	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id, BLE_CMD_BAS_DISCOVER);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_BAS_DISCOVER;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_bas_read_level(uint8_t device_id, bool high_priority)
+{
+	struct device_context *ctx = &device_ctx[device_id];
+	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id, BLE_CMD_BAS_READ_LEVEL);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_BAS_READ_LEVEL;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_csip_discover(uint8_t device_id, bool high_priority)
+{
+	struct device_context *ctx = &device_ctx[device_id];
+	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id, BLE_CMD_CSIP_DISCOVER);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_CSIP_DISCOVER;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_has_discover(uint8_t device_id, bool high_priority)
+{
+	struct device_context *ctx = &device_ctx[device_id];
+	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id, BLE_CMD_HAS_DISCOVER);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_HAS_DISCOVER;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_has_read_presets(uint8_t device_id, bool high_priority)
+{
+	struct device_context *ctx = &device_ctx[device_id];
+	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id, BLE_CMD_HAS_READ_PRESETS);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_HAS_READ_PRESETS;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_has_set_preset(uint8_t device_id, uint8_t preset_index, bool high_priority)
+{
+	if (!presets_loaded) {
+		ble_cmd_has_read_presets(device_id, true);
+	}
+
+	struct device_context *ctx = &device_ctx[device_id];
+	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id, BLE_CMD_HAS_SET_PRESET);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_HAS_SET_PRESET;
+	cmd->d0 = preset_index;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_has_next_preset(uint8_t device_id, bool high_priority)
+{
+	if (!device_ctx[0].has_ctlr.presets_read) {
+		ble_cmd_has_read_presets(0, true);
+	}
+	if (!device_ctx[1].has_ctlr.presets_read) {
+		ble_cmd_has_read_presets(1, true);
+	}
+
+	struct device_context *ctx = &device_ctx[device_id];
+	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id, BLE_CMD_HAS_NEXT_PRESET);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_HAS_NEXT_PRESET;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+int ble_cmd_has_prev_preset(uint8_t device_id, bool high_priority)
+{
+	if (!presets_loaded) {
+		ble_cmd_has_read_presets(device_id, true);
+	}
+
+	struct device_context *ctx = &device_ctx[device_id];
+	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id, BLE_CMD_HAS_PREV_PRESET);
+	if (!cmd)
+	{
+		return -ENOMEM;
+	}
+
+	cmd->device_id = ctx->device_id;
+	cmd->type = BLE_CMD_HAS_PREV_PRESET;
+	return ble_cmd_enqueue(cmd, high_priority);
+}
+
+/* Reset BLE command queue */
+void ble_cmd_queue_reset(uint8_t device_id)
+{
+	struct device_context *ctx = &device_ctx[device_id];
+
+	// Clear command queues
+	k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+
+	sys_snode_t *node;
+	while ((node = sys_slist_get(&ble_cmd_queue[ctx->device_id])) != NULL)
+	{
+		ble_cmd_free(CONTAINER_OF(node, struct ble_cmd, node));
+	}
+
+	// Cancel the commands in flight, their completions are ignored
+	for (int i = 0; i < BLE_CMD_WINDOW_SIZE; i++)
+	{
+		ble_cmd_free(ble_cmd_inflight[ctx->device_id][i]);
+		ble_cmd_inflight[ctx->device_id][i] = NULL;
+	}
+
+	k_work_cancel_delayable(&ble_cmd_timeout_work[ctx->device_id]);
+	k_mutex_unlock(&ble_queue_mutex);
+
+	LOG_DBG("BLE command queue reset");
+}
+
+const char *command_type_to_string(enum ble_cmd_type type)
+{
+	if ((unsigned int)type >= BLE_CMD_TYPE_COUNT)
+	{
+		return "UNKNOWN_COMMAND";
+	}
+
+	return ble_cmd_desc[type].name;
+}
+
+#if defined(CONFIG_SHELL)
+static int cmd_binaural(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	struct ble_binaural_stats s;
+	ble_cmd_get_binaural_stats(&s);
+
+	shell_print(sh, "%u released, %u completed, %u incomplete", s.dispatched, s.completed,
+				s.incomplete);
+	if (s.completed)
+	{
+		shell_print(sh, "skew: last %u us, mean %u us, max %u us, %u within %u us",
+					s.skew_last_us, (uint32_t)(s.skew_total_us / s.completed), s.skew_max_us,
+					s.within_target, BLE_BINAURAL_SKEW_TARGET_US);
+	}
+
+	return 0;
+}
+
+SHELL_CMD_REGISTER(binaural, NULL, "Print binaural write skew statistics", cmd_binaural);
+
+static int cmd_cmd_timeouts(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	if (!device_ctx)
+	{
+		return -ENODEV;
+	}
+
+	for (uint8_t dev = 0; dev < CONFIG_BT_MAX_CONN; dev++)
+	{
+		shell_print(sh, "[DEVICE ID %d] connection event %u ms", dev, ble_link_event_ms(dev));
+
+		k_mutex_lock(&ble_queue_mutex, K_FOREVER);
+		for (int t = 0; t < BLE_CMD_TYPE_COUNT; t++)
+		{
+			const struct ble_cmd_rto *rto = &ble_cmd_rto[dev][t];
+
+			if (!rto->measured && !rto->backoff)
+			{
+				continue;
+			}
+
+			shell_print(sh, "  %s: srtt %u ms, rttvar %u ms, backoff %u, timeout %u ms",
+						command_type_to_string(t), rto->srtt_ms, rto->rttvar_ms, rto->backoff,
+						ble_cmd_timeout_ms(dev, t));
+		}
+		k_mutex_unlock(&ble_queue_mutex);
+	}
+
+	return 0;
+}
+
+SHELL_CMD_REGISTER(cmd_timeouts, NULL, "Print the adaptive command timeouts", cmd_cmd_timeouts);
+
+static int cmd_cmd_overload(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *const class_names[BLE_CMD_CLASS_COUNT] = {
+		[BLE_CMD_CLASS_LINK] = "link",
+		[BLE_CMD_CLASS_USER] = "user",
+		[BLE_CMD_CLASS_REFRESH] = "refresh",
+		[BLE_CMD_CLASS_BACKGROUND] = "background",
+	};
+
+	if (argc > 1 && strcmp(argv[1], "reset") == 0)
+	{
+		ble_cmd_reset_overload_stats();
+		return 0;
+	}
+
+	struct ble_cmd_overload_stats s;
+	ble_cmd_get_overload_stats(&s);
+
+	for (int cls = 0; cls < BLE_CMD_CLASS_COUNT; cls++)
+	{
+		shell_print(sh, "%s: %u merged, %u evicted, %u rejected", class_names[cls],
+					s.merged[cls], s.evicted[cls], s.rejected[cls]);
+	}
+	for (uint8_t dev = 0; dev < CONFIG_BT_MAX_CONN; dev++)
+	{
+		shell_print(sh, "[DEVICE ID %d] %u held, high water %u of %u", dev, s.held[dev],
+					s.high_water[dev], BLE_CMD_QUEUE_SIZE);
+	}
+
+	return 0;
+}
+
+SHELL_CMD_REGISTER(cmd_overload, NULL, "Print command queue overload counters, 'reset' clears them",
+				   cmd_cmd_overload);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,273 @@
+/**
+ * @file ble_cmd_queue.h
+ * @brief BLE command pool, per-link queues and the dispatcher that runs them
+ *
+ * Every GATT procedure the remote starts goes through here: a command is
+ * allocated from a shared pool, queued in class order on its link and started
+ * by the dispatcher once the in-flight window and its resource allow. The
+ * profile modules start the procedure in their executor and report the result
+ * with ble_cmd_complete().
+ */
+
+#ifndef BLE_CMD_QUEUE_H
+#define BLE_CMD_QUEUE_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/slist.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* BLE command list, one descriptor per command type:
+ * X(name, executor, class, resource, timeout, retry policy, flags)
+ *
+ * name      BLE_CMD_<name>, also the display name
+ * executor  ble_cmd_exec_<executor>() in ble_cmd_queue.c
+ * class     enum ble_cmd_class, BLE_CMD_CLASS_<class>
+ * resource  What the command occupies while in flight, see ble_cmd_queue.c
+ * timeout   EXCHANGE: one ATT request, PROCEDURE: several, both adapt to
+ *           observed response times. FIXED: always the initial timeout.
+ * retry     Retry policy: which errors are retried, how often and how far
+ *           apart, and which trigger a recovery action instead
+ * flags     DEDUPE: a second queued copy is dropped, ABSOLUTE: writes a full
+ *           value, so a newer request may take over a queued copy, NONE
+ *           otherwise
+ */
+#define BLE_CMD_LIST(X) \
+    X(REQUEST_SECURITY,  request_security,  LINK,       EXCLUSIVE, FIXED,     SECURITY,     NONE) \
+    /* VCP commands */ \
+    X(VCP_DISCOVER,      vcp_discover,      LINK,       VCP,       FIXED,     NONE,         NONE) \
+    X(VCP_VOLUME_UP,     vcp_volume_up,     USER,       VCP,       EXCHANGE,  VCP_WRITE,    NONE) \
+    X(VCP_VOLUME_DOWN,   vcp_volume_down,   USER,       VCP,       EXCHANGE,  VCP_WRITE,    NONE) \
+    X(VCP_SET_VOLUME,    vcp_set_volume,    USER,       VCP,       EXCHANGE,  VCP_WRITE,    ABSOLUTE) \
+    X(VCP_MUTE,          vcp_mute,          USER,       VCP,       EXCHANGE,  VCP_WRITE,    ABSOLUTE) \
+    X(VCP_UNMUTE,        vcp_unmute,        USER,       VCP,       EXCHANGE,  VCP_WRITE,    ABSOLUTE) \
+    X(VCP_READ_STATE,    vcp_read_state,    REFRESH,    VCP,       EXCHANGE,  VCP_READ,     DEDUPE) \
+    X(VCP_READ_FLAGS,    vcp_read_flags,    REFRESH,    VCP,       EXCHANGE,  VCP_READ,     DEDUPE) \
+    /* Battery Service commands */ \
+    X(BAS_DISCOVER,      bas_discover,      BACKGROUND, BAS,       FIXED,     NONE,         NONE) \
+    X(BAS_READ_LEVEL,    bas_read_level,    BACKGROUND, BAS,       EXCHANGE,  READ,         DEDUPE) \
+    /* CSIP commands */ \
+    X(CSIP_DISCOVER,     csip_discover,     BACKGROUND, CSIP,      FIXED,     NONE,         NONE) \
+    /* Hearing Access Service commands */ \
+    X(HAS_DISCOVER,      has_discover,      LINK,       HAS,       FIXED,     HAS_DISCOVER, NONE) \
+    X(HAS_READ_PRESETS,  has_read_presets,  REFRESH,    HAS,       PROCEDURE, READ,         DEDUPE) \
+    X(HAS_SET_PRESET,    has_set_preset,    USER,       HAS,       EXCHANGE,  NONE,         ABSOLUTE) \
+    X(HAS_NEXT_PRESET,   has_next_preset,   USER,       HAS,       EXCHANGE,  NONE,         NONE) \
+    X(HAS_PREV_PRESET,   has_prev_preset,   USER,       HAS,       EXCHANGE,  NONE,         NONE) \
+    /* GATT caching */ \
+    X(GATT_DB_HASH_READ, gatt_db_hash_read, LINK,       EXCLUSIVE, EXCHANGE,  NONE,         NONE) \
+    /* Battery, volume and active preset in one read */ \
+    X(WAKE_SNAPSHOT,     wake_snapshot,     REFRESH,    SNAPSHOT,  PROCEDURE, NONE,         DEDUPE)
+
+/* BLE command types */
+enum ble_cmd_type {
+#define BLE_CMD_ENUM(name, ...) BLE_CMD_##name,
+    BLE_CMD_LIST(BLE_CMD_ENUM)
+#undef BLE_CMD_ENUM
+    BLE_CMD_TYPE_COUNT,
+};
+
+/* Scheduling classes, most urgent first. The queue of a device is kept in
+ * class order; high priority only moves a command to the front of its class. */
+enum ble_cmd_class {
+    BLE_CMD_CLASS_LINK,        /* Security, Database Hash and the discoveries the link needs */
+    BLE_CMD_CLASS_USER,        /* Volume, mute and preset changes from the buttons */
+    BLE_CMD_CLASS_REFRESH,     /* Reads that bring the shown state up to date */
+    BLE_CMD_CLASS_BACKGROUND,  /* Battery and set discovery, nobody waits for them */
+    BLE_CMD_CLASS_COUNT,
+};
+
+/* Generation-tagged command handle: the pool slot of the command in the low
+ * byte, the generation of that slot above it. Every queued attempt of a
+ * command gets a new generation, so a completion for a command that was
+ * freed, timed out or retried no longer matches, even if its slot is in use
+ * again. Never 0. */
+typedef uint32_t ble_cmd_handle_t;
+
+#define BLE_CMD_HANDLE_SLOT_BITS 8
+
+/* Called once a command has finished: completed, failed to start or timed out.
+ * Not called for commands dropped by ble_cmd_queue_reset(). */
+typedef void (*ble_cmd_done_cb)(uint8_t device_id, int err);
+
+/* BLE command structure */
+struct ble_cmd {
+    uint8_t device_id;
+    enum ble_cmd_type type;
+    uint8_t d0;  // Data parameter (e.g., volume level)
+    ble_cmd_done_cb done;  // Optional, see ble_cmd_done_cb
+    uint16_t pair;  // Binaural write both halves belong to, 0 if none
+    uint8_t retry_count;  // Attempts that failed and were queued again
+    ble_cmd_handle_t id;  // Assigned when queued, 0 before
+    int64_t deadline;  // Uptime (ms) at which an in-flight command times out
+    int64_t expires;  // Uptime (ms) after which it is dropped unstarted, 0 for never
+    uint32_t queued_at;  // k_cycle_get_32() when first enqueued
+    uint32_t started_at;  // k_cycle_get_32() when handed to ble_cmd_execute()
+    int64_t not_before;  // Uptime (ms) before which a retried command does not start
+    sys_snode_t node;  // For linked list
+};
+
+/* Left/right completion skew up to which a binaural change counts as simultaneous */
+#define BLE_BINAURAL_SKEW_TARGET_US 20000
+
+/* Binaural write counters, skews in microseconds */
+struct ble_binaural_stats {
+    uint32_t dispatched;   // Writes released to both queues
+    uint32_t completed;    // Both halves succeeded, skew recorded
+    uint32_t incomplete;   // A half failed, timed out or was dropped
+    uint32_t within_target; // Completed within BLE_BINAURAL_SKEW_TARGET_US
+    uint32_t skew_last_us;
+    uint32_t skew_max_us;
+    uint64_t skew_total_us; // Sum over completed writes, for the mean
+};
+
+/* Command queue configuration */
+#define BLE_CMD_QUEUE_SIZE 10  // Commands one link may hold
+#define BLE_CMD_POOL_SIZE 16   // Commands shared by both links
+
+/* Command timeouts adapt per command type and device, like a TCP
+ * retransmission timer: smoothed response time plus four times its mean
+ * deviation, doubled for each timeout in a row and kept between a floor of a
+ * few connection events and a ceiling. Until a type has completed once, a
+ * single ATT exchange gets a budget in connection events and anything that
+ * takes several exchanges the initial timeout. Security and discovery always
+ * get the initial timeout. */
+#define BLE_CMD_TIMEOUT_INITIAL_MS 10000
+#define BLE_CMD_TIMEOUT_MIN_MS 300
+#define BLE_CMD_TIMEOUT_MAX_MS 20000
+#define BLE_CMD_TIMEOUT_MIN_EVENTS 4       // Floor in connection events, latency included
+#define BLE_CMD_TIMEOUT_EXCHANGE_EVENTS 12 // Budget of an unmeasured single exchange
+#define BLE_CMD_TIMEOUT_MAX_BACKOFF 3      // Doublings after consecutive timeouts
+
+/* Longest a queued command of each class may wait to start. A volume press
+ * that could not be sent within seconds is no longer what the user wants, the
+ * reconciler sends the current target instead. Link commands never expire. */
+#define BLE_CMD_MAX_WAIT_USER_MS 3000
+#define BLE_CMD_MAX_WAIT_REFRESH_MS 5000
+#define BLE_CMD_MAX_WAIT_BACKGROUND_MS 30000
+
+/* Queue slots per link only link and user commands may take, so a queue full
+ * of reads never turns a button press away */
+#define BLE_CMD_USER_RESERVE 3
+
+/* What a command does when its link has no queue slot left for its class.
+ * Commands somebody waits for (a done callback or a binaural pair) are never
+ * merged into or evicted, and a request that finds nothing to merge into or
+ * evict is rejected with -ENOMEM. */
+enum ble_cmd_overload {
+    BLE_CMD_OVERLOAD_REJECT,         /* Refused */
+    BLE_CMD_OVERLOAD_MERGE,          /* Takes over the queued command of the same type,
+                                      * the newer parameters win. Only reads and absolute
+                                      * writes merge, relative steps are rejected. */
+    BLE_CMD_OVERLOAD_REPLACE_OLDEST, /* Evicts the oldest queued read of the least urgent
+                                      * class not more urgent than its own; reads are
+                                      * idempotent and refreshed again later */
+};
+
+/* Shortest time between two "Busy" notices for rejected user commands */
+#define BLE_CMD_BUSY_NOTICE_MS 1000
+
+/* Overload counters, per class of the command they happened to */
+struct ble_cmd_overload_stats {
+    uint32_t merged[BLE_CMD_CLASS_COUNT];   // Requests that took over a queued command
+    uint32_t evicted[BLE_CMD_CLASS_COUNT];  // Queued commands dropped to make room
+    uint32_t rejected[BLE_CMD_CLASS_COUNT]; // Requests refused with -ENOMEM
+    uint8_t held[CONFIG_BT_MAX_CONN];       // Pool blocks each link holds now
+    uint8_t high_water[CONFIG_BT_MAX_CONN]; // Most pool blocks each link held
+};
+
+/* Work queue the command dispatcher and the executors run on */
+#define BLE_CMD_WQ_STACK_SIZE 1024
+#define BLE_CMD_WQ_PRIORITY 7
+
+/* Commands in flight per device. Commands of the same profile still run one
+ * after the other, security and Database Hash reads run alone. */
+#define BLE_CMD_WINDOW_SIZE 3
+
+/* Start the work queue the dispatcher runs on, called from ble_manager_init() */
+int ble_cmd_queue_init(void);
+
+/* BLE command queue API */
+int ble_cmd_request_security(uint8_t device_id);
+int ble_cmd_vcp_discover(uint8_t device_id, bool high_priority);
+int ble_cmd_vcp_set_volume(uint8_t device_id, uint8_t volume, bool high_priority);
+int ble_cmd_vcp_mute(uint8_t device_id, bool high_priority);
+int ble_cmd_vcp_unmute(uint8_t device_id, bool high_priority);
+int ble_cmd_vcp_read_state(uint8_t device_id, bool high_priority);
+int ble_cmd_vcp_read_flags(uint8_t device_id, bool high_priority);
+
+int ble_cmd_bas_discover(uint8_t device_id, bool high_priority);
+int ble_cmd_bas_read_level(uint8_t device_id, bool high_priority);
+
+int ble_cmd_csip_discover(uint8_t device_id, bool high_priority);
+
+int ble_cmd_gatt_db_hash_read(uint8_t device_id, bool high_priority);
+int ble_cmd_wake_snapshot(uint8_t device_id, bool high_priority);
+
+/* Enqueue a VCP or HAS write for the state reconciler, done reports the outcome */
+int ble_cmd_state_write(uint8_t device_id, enum ble_cmd_type type, uint8_t d0, ble_cmd_done_cb done);
+
+/**
+ * @brief Release a write to both devices at once
+ *
+ * Both halves are put in front of their device's queue before the dispatcher
+ * work item is submitted, so its next run starts both and neither waits
+ * behind lower-priority work of its own queue. The time between the two
+ * completions is recorded as the skew.
+ *
+ * @param type Command type for device 0 and device 1
+ * @param d0 Data parameter for device 0 and device 1
+ * @param done Called once per half, with the device ID of that half
+ * @return 0 on success, -ENOMEM if either half could not be allocated
+ */
+int ble_cmd_binaural_write(const enum ble_cmd_type type[2], const uint8_t d0[2], ble_cmd_done_cb done);
+
+void ble_cmd_get_binaural_stats(struct ble_binaural_stats *stats);
+void ble_cmd_log_binaural_stats(void);
+
+void ble_cmd_get_overload_stats(struct ble_cmd_overload_stats *stats);
+void ble_cmd_log_overload_stats(void);
+void ble_cmd_reset_overload_stats(void);
+
+void ble_cmd_queue_reset(uint8_t queue_id);
+
+/**
+ * @brief Complete an in-flight command
+ *
+ * Completions for commands that are no longer in flight (timed out, retried,
+ * or the queue was reset) are ignored, also once their pool slot holds
+ * another command.
+ *
+ * @param device_id Device ID
+ * @param cmd_id Handle of the command, as handed to its executor
+ * @param err 0 on success, error code otherwise
+ */
+void ble_cmd_complete(uint8_t device_id, ble_cmd_handle_t cmd_id, int err);
+
+/**
+ * @brief Name of a command type, for logs and statistics
+ *
+ * @param type Command type
+ * @return Constant string, "UNKNOWN_COMMAND" for unknown types
+ */
+const char *command_type_to_string(enum ble_cmd_type type);
+
+/* Take the command handle out of a pending slot, 0 if no command was waiting.
+ * Executors store the handle they were started with in a slot per kind of
+ * callback, so notifications never complete a command by accident. */
+static inline ble_cmd_handle_t ble_cmd_take_id(ble_cmd_handle_t *slot)
+{
+    ble_cmd_handle_t cmd_id = *slot;
+
+    *slot = 0;
+    return cmd_id;
+}
+
+/* HAS command queue API */
+int ble_cmd_has_discover(uint8_t device_id, bool high_priority);
+int ble_cmd_has_read_presets(uint8_t device_id, bool high_priority);
+int ble_cmd_has_set_preset(uint8_t device_id, uint8_t preset_index, bool high_priority);
+int ble_cmd_has_next_preset(uint8_t device_id, bool high_priority);
+int ble_cmd_has_prev_preset(uint8_t device_id, bool high_priority);
+
+#endif /* BLE_CMD_QUEUE_H */
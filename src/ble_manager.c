@@ -7,133 +7,80 @@
 #include "has_controller.h"
 #include "display_manager.h"
 #include "power_manager.h"
+#include "wake_trace.h"
+#include "session_snapshot.h"
+#include "persist_worker.h"
+#include "handle_cache.h"
+#include "state_reconciler.h"
+#include "cmd_latency.h"
+
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/audio/vcp.h>
+#include <string.h>
 
 LOG_MODULE_REGISTER(ble_manager, LOG_LEVEL_DBG);
 
 static struct bond_collection *bonded_devices;
 static struct k_work_delayable security_request_work[2];
 static struct k_work_delayable connect_work[2];
+static bool security_request_in_progress[2] = {false, false};
+static ble_cmd_handle_t security_cmd_id[CONFIG_BT_MAX_CONN];
+
+/* Set once the disconnect/reconnect fallback has been tried, so a device whose
+ * keys are really gone cannot loop through it */
+static bool trusted_bond_fallback_used[2];
+
+/* Devices still waiting for a link in dual-link auto-connect mode */
+static bool auto_connect_pending[2];
+static struct k_work auto_connect_work;
+
+/* Connection parameters per profile, in units of 1.25 ms / 10 ms.
+ * IDLE keeps the worst-case press-to-effect delay at (latency + 1) * interval,
+ * about 240 ms, until the boost has been negotiated. */
+static const struct bt_le_conn_param conn_profiles[BLE_CONN_PROFILE_COUNT] = {
+	[BLE_CONN_PROFILE_DISCOVERY] = BT_LE_CONN_PARAM_INIT(6, 12, 0, 400),
+	[BLE_CONN_PROFILE_IDLE] = BT_LE_CONN_PARAM_INIT(40, 48, 4, 600),
+	[BLE_CONN_PROFILE_BOOST] = BT_LE_CONN_PARAM_INIT(12, 24, 0, 400),
+};
 
-/* BLE Command queue */
-static sys_slist_t ble_cmd_queue[2];
-static struct k_mutex ble_queue_mutex[2];
-K_SEM_DEFINE(ble_cmd_sem_0, 0, 1);
-K_SEM_DEFINE(ble_cmd_sem_1, 0, 1);
-static struct k_sem *ble_cmd_sem[2] = {&ble_cmd_sem_0, &ble_cmd_sem_1};
-static struct k_work_delayable ble_cmd_timeout_work[2];
-static bool ble_cmd_in_progress[2] = {false, false};
-static bool security_request_in_progress = false;
+static const char *const conn_profile_names[BLE_CONN_PROFILE_COUNT] = {
+	[BLE_CONN_PROFILE_DISCOVERY] = "discovery",
+	[BLE_CONN_PROFILE_IDLE] = "idle",
+	[BLE_CONN_PROFILE_BOOST] = "boost",
+};
 
-/* Memory pool for BLE commands */
-K_MEM_SLAB_DEFINE(ble_cmd_slab_0, sizeof(struct ble_cmd), BLE_CMD_QUEUE_SIZE, 4);
-K_MEM_SLAB_DEFINE(ble_cmd_slab_1, sizeof(struct ble_cmd), BLE_CMD_QUEUE_SIZE, 4);
+/* Requested profile, boost expiry and the profile last sent to the link.
+ * Only touched from conn_param_work so updates never overlap. */
+static enum ble_conn_profile conn_profile_base[2];
+static enum ble_conn_profile conn_profile_applied[2];
+static int64_t conn_boost_until[2];
+static struct k_work_delayable conn_param_work[2];
 
 /* Forward declarations */
-static void ble_process_next_command(uint8_t queue_id);
-static void ble_cmd_timeout_handler(struct k_work *work);
 static void connect_work_handler(struct k_work *work);
+static void auto_connect_work_handler(struct k_work *work);
+static void conn_param_work_handler(struct k_work *work);
+static void ble_manager_negotiate_link(struct device_context *ctx);
 // static bool is_bonded_device(const bt_addr_le_t *addr);
-static char *command_type_to_string(enum ble_cmd_type type);
-
-/* Command queue initialization */
-static int ble_queues_init(void)
-{
-	for (ssize_t i = 0; i < 2; i++)
-	{
-		sys_slist_init(&ble_cmd_queue[i]);
-		k_mutex_init(&ble_queue_mutex[i]);
-		/* Semaphores are now statically initialized with K_SEM_DEFINE */
-		k_work_init_delayable(&ble_cmd_timeout_work[i], ble_cmd_timeout_handler);
-		device_ctx[i].current_ble_cmd = NULL;
-	}
-
-	return 0;
-}
-
-/* Allocate a command from memory pool */
-static struct ble_cmd *ble_cmd_alloc(uint8_t device_id)
-{
-	struct ble_cmd *cmd;
-	struct k_mem_slab *slab = (device_id == 0) ? &ble_cmd_slab_0 : &ble_cmd_slab_1;
-
-	if (k_mem_slab_alloc(slab, (void **)&cmd, K_NO_WAIT) != 0)
-	{
-		LOG_ERR("Failed to allocate BLE command - queue full [DEVICE ID %d]", device_id);
-		return NULL;
-	}
-
-	memset(cmd, 0, sizeof(struct ble_cmd));
-	return cmd;
-}
-
-/* Free a command back to memory pool */
-static void ble_cmd_free(struct ble_cmd *cmd)
-{
-	if (cmd)
-	{
-		struct k_mem_slab *slab = (cmd->device_id == 0) ? &ble_cmd_slab_0 : &ble_cmd_slab_1;
-		k_mem_slab_free(slab, (void *)cmd);
-	}
-}
-
-/* Enqueue a command */
-static int ble_cmd_enqueue(struct ble_cmd *cmd, bool high_priority)
-{
-	if (!cmd)
-	{
-		return -EINVAL;
-	}
-
-	if (!device_ctx)
-	{
-		LOG_ERR("Cannot enqueue command - device_ctx not initialized");
-		return -EINVAL;
-	}
-
-	k_mutex_lock(&ble_queue_mutex[cmd->device_id], K_FOREVER);
-	if (high_priority)
-	{
-		sys_slist_prepend(&ble_cmd_queue[cmd->device_id], &cmd->node);
-	}
-	else
-	{
-		sys_slist_append(&ble_cmd_queue[cmd->device_id], &cmd->node);
-	}
-	k_mutex_unlock(&ble_queue_mutex[cmd->device_id]);
-
-	// Signal the processing thread
-	k_sem_give(ble_cmd_sem[cmd->device_id]);
-
-	LOG_DBG("%sBLE command enqueued, type: %s [DEVICE ID %d]",
-			high_priority ? "High priority " : "", command_type_to_string(cmd->type),
-			cmd->device_id);
-	return 0;
-}
-
-/* Dequeue a command */
-static struct ble_cmd *ble_cmd_dequeue(uint8_t device_id)
-{
-	struct ble_cmd *cmd = NULL;
-
-	k_mutex_lock(&ble_queue_mutex[device_id], K_FOREVER);
-	sys_snode_t *node = sys_slist_get(&ble_cmd_queue[device_id]);
-	if (node)
-	{
-		cmd = CONTAINER_OF(node, struct ble_cmd, node);
-	}
-	k_mutex_unlock(&ble_queue_mutex[device_id]);
-
-	return cmd;
-}
 
 static void security_request_handler(struct k_work *work)
 {
 	uint8_t device_id = (work == &security_request_work[0].work) ? 0 : 1;
 	struct device_context *ctx = &device_ctx[device_id];
 
-	if (security_request_in_progress)
+	// The retry policy of the command tries again after a back-off
+	if (security_request_in_progress[device_id])
+	{
+		LOG_WRN("Security procedure still running [DEVICE ID %d]", device_id);
+		ble_cmd_complete(device_id, ble_cmd_take_id(&security_cmd_id[device_id]), -EALREADY);
+		return;
+	}
+
+	// No security_changed_cb() follows if the link is already there
+	if (bt_conn_get_security(ctx->conn) >= BT_SECURITY_WANTED)
 	{
-		k_work_schedule(&security_request_work[device_id], K_MSEC(0));
+		LOG_DBG("Link already secure [DEVICE ID %d]", device_id);
+		ble_cmd_complete(device_id, ble_cmd_take_id(&security_cmd_id[device_id]), 0);
 		return;
 	}
 
@@ -141,18 +88,12 @@ static void security_request_handler(struct k_work *work)
 	int err = bt_conn_set_security(device_ctx[device_id].conn, BT_SECURITY_WANTED);
 	if (err)
 	{
-		if (err == -EACCES) {
-			LOG_WRN("Security request already in progress [DEVICE ID %d]", device_id);
-			LOG_DBG("Re-enqueueing security request command [DEVICE ID %d]", device_id);
-			ble_cmd_request_security(ctx->device_id);
-		}
-
 		LOG_ERR("Failed to set security (err %d) [DEVICE ID %d]", err, device_id);
-		ble_cmd_complete(device_id, err);
+		ble_cmd_complete(device_id, ble_cmd_take_id(&security_cmd_id[device_id]), err);
 		return;
 	}
 
-	security_request_in_progress = true;
+	security_request_in_progress[device_id] = true;
 	LOG_DBG("Security request initiated [DEVICE ID %d]", device_id);
 
 	if (ctx->state == CONN_STATE_CONNECTED)
@@ -161,6 +102,13 @@ static void security_request_handler(struct k_work *work)
 	}
 }
 
+int ble_manager_start_security(uint8_t device_id, ble_cmd_handle_t cmd_id)
+{
+	security_cmd_id[device_id] = cmd_id;
+	k_work_schedule(&security_request_work[device_id], K_MSEC(0));
+	return 0;
+}
+
 int8_t ble_manager_disable_bt() {
 	return bt_disable();
 }
@@ -183,9 +131,9 @@ void pairing_complete(struct bt_conn *conn, bool bonded)
 	{
 		LOG_INF("New device paired successfully - saving bond [DEVICE ID %d]", ctx->device_id);
 
-		// Save the bond
-		LOG_DBG("Saving bond information to flash [DEVICE ID %d]", ctx->device_id);
-		settings_save();
+		// Save the bond from the persistence thread, not the RX path
+		LOG_DBG("Queuing bond information for flash [DEVICE ID %d]", ctx->device_id);
+		persist_worker_save_all();
 
 		devices_manager_update_bonded_devices_collection();
 		devices_manager_get_bonded_devices_collection(bonded_devices);
@@ -197,7 +145,7 @@ void pairing_complete(struct bt_conn *conn, bool bonded)
 				ctx->device_id);
 	}
 
-	security_request_in_progress = false;
+	security_request_in_progress[ctx->device_id] = false;
 	app_controller_notify_device_ready(ctx->device_id);
 }
 
@@ -206,8 +154,14 @@ void pairing_failed(struct bt_conn *conn, enum bt_security_err reason)
 	struct device_context *ctx = devices_manager_get_device_context_by_conn(conn);
 	LOG_ERR("Pairing failed: %d [DEVICE ID %d]", reason, ctx->device_id);
 
-	security_request_in_progress = false;
-	ble_cmd_request_security(ctx->device_id);
+	security_request_in_progress[ctx->device_id] = false;
+
+	// Normally security_changed_cb() reports it first, the retry policy takes it from there
+	ble_cmd_handle_t cmd_id = ble_cmd_take_id(&security_cmd_id[ctx->device_id]);
+	if (cmd_id)
+	{
+		ble_cmd_complete(ctx->device_id, cmd_id, reason);
+	}
 }
 
 struct bt_conn_auth_info_cb auth_info_callbacks = {
@@ -221,6 +175,7 @@ void security_changed_cb(struct bt_conn *conn, bt_security_t level, enum bt_secu
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
 	struct device_context *ctx = devices_manager_get_device_context_by_conn(conn);
+	wake_trace_record(WAKE_TRACE_SECURITY_CHANGED, ctx->device_id);
 
 	if (!err)
 	{
@@ -231,6 +186,10 @@ void security_changed_cb(struct bt_conn *conn, bt_security_t level, enum bt_secu
 		{
 			LOG_DBG("Encryption established at level %u [DEVICE ID %d]", level,
 					ctx->device_id);
+			ble_manager_negotiate_link(ctx);
+
+			/* Validate cached handles before any discovery command runs */
+			ble_cmd_gatt_db_hash_read(ctx->device_id, true);
 
 			if (ctx->state == CONN_STATE_BONDED)
 			{
@@ -251,10 +210,34 @@ void security_changed_cb(struct bt_conn *conn, bt_security_t level, enum bt_secu
 	else
 	{
 		LOG_ERR("Security failed: %s level %u err %d [DEVICE ID %d]", addr, level, err, ctx->device_id);
+
+		/* The stored LTK was rejected - retry through a fresh connection */
+		if (ctx->state == CONN_STATE_BONDED &&
+			(err == BT_SECURITY_ERR_AUTH_FAIL || err == BT_SECURITY_ERR_PIN_OR_KEY_MISSING))
+		{
+			security_request_in_progress[ctx->device_id] = false;
+			ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&security_cmd_id[ctx->device_id]),
+							 err);
+			ble_manager_trusted_bond_fallback(ctx->device_id);
+			return;
+		}
+	}
+
+	security_request_in_progress[ctx->device_id] = false;
+	ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&security_cmd_id[ctx->device_id]), err);
+}
+
+bool ble_manager_trusted_bond_fallback(uint8_t device_id)
+{
+	if (trusted_bond_fallback_used[device_id])
+	{
+		LOG_ERR("Trusted bond fallback already used - giving up [DEVICE ID %d]", device_id);
+		return false;
 	}
 
-	security_request_in_progress = false;
-	ble_cmd_complete(ctx->device_id, err);
+	trusted_bond_fallback_used[device_id] = true;
+	ble_manager_establish_trusted_bond(device_id);
+	return true;
 }
 
 void ble_manager_establish_trusted_bond(uint8_t device_id)
@@ -314,6 +297,24 @@ int ble_manager_disconnect_device(struct bt_conn *conn)
 static void connected_cb(struct bt_conn *conn, uint8_t err)
 {
 	struct device_context *ctx = devices_manager_get_device_context_by_conn(conn);
+	if (!ctx && (auto_connect_pending[0] || auto_connect_pending[1]))
+	{
+		if (err)
+		{
+			LOG_WRN("Auto-connect failed (err 0x%02X) - retrying", err);
+			k_work_submit(&auto_connect_work);
+			return;
+		}
+
+		/* Auto-connect does not hand out the conn object up front */
+		ctx = devices_manager_get_device_context_by_addr(bt_conn_get_dst(conn));
+		if (ctx && auto_connect_pending[ctx->device_id])
+		{
+			auto_connect_pending[ctx->device_id] = false;
+			ctx->conn = bt_conn_ref(conn);
+			k_work_submit(&auto_connect_work);
+		}
+	}
 	if (!ctx)
 	{
 		LOG_DBG("Using first slot for new connection");
@@ -328,13 +329,32 @@ static void connected_cb(struct bt_conn *conn, uint8_t err)
 		return;
 	}
 
+	wake_trace_record(WAKE_TRACE_CONNECTED, ctx->device_id);
+
 	const bt_addr_le_t *addr = bt_conn_get_dst(conn);
+	cmd_latency_set_peer(ctx->device_id, addr);
 	char addr_str[BT_ADDR_LE_STR_LEN];
 	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
 
 	ctx->conn = conn;
 	bt_addr_le_copy(&ctx->info.addr, addr);
 
+	/* Every link starts out on 1M PHY with 27-byte PDUs and the default MTU */
+	ctx->link = (struct device_link_info){
+		.tx_phy = BT_GAP_LE_PHY_1M,
+		.rx_phy = BT_GAP_LE_PHY_1M,
+		.tx_max_len = BT_GAP_DATA_LEN_DEFAULT,
+		.rx_max_len = BT_GAP_DATA_LEN_DEFAULT,
+		.mtu = BT_ATT_DEFAULT_LE_MTU,
+	};
+
+	struct bt_conn_info info;
+	if (bt_conn_get_info(conn, &info) == 0)
+	{
+		ctx->link.interval = info.le.interval;
+		ctx->link.latency = info.le.latency;
+	}
+
 	/* Show connected status on display */
 	display_manager_show_status("Connected");
 
@@ -365,8 +385,18 @@ static void disconnected_cb(struct bt_conn *conn, uint8_t reason)
 	bt_conn_unref(ctx->conn);
 	ctx->conn = NULL;
 
+	/* The Database Hash is checked again on the next connection */
+	handle_cache_set_trusted(&ctx->info.addr, false);
+
+	/* The next link is created with the discovery parameters again */
+	k_work_cancel_delayable(&conn_param_work[ctx->device_id]);
+	conn_profile_base[ctx->device_id] = BLE_CONN_PROFILE_DISCOVERY;
+	conn_profile_applied[ctx->device_id] = BLE_CONN_PROFILE_DISCOVERY;
+	conn_boost_until[ctx->device_id] = 0;
+
 	// if (queue_is_active[ctx->device_id])
 	ble_cmd_queue_reset(ctx->device_id);
+	state_reconciler_reset(ctx->device_id);
 
 	if (ctx->info.vcp_discovered)
 	{
@@ -435,21 +465,222 @@ static void disconnected_cb(struct bt_conn *conn, uint8_t reason)
 	}
 }
 
+static void le_param_updated_cb(struct bt_conn *conn, uint16_t interval, uint16_t latency,
+				uint16_t timeout)
+{
+	struct device_context *ctx = devices_manager_get_device_context_by_conn(conn);
+	if (!ctx)
+	{
+		return;
+	}
+
+	LOG_DBG("Connection parameters updated: interval %u.%02u ms, latency %u, timeout %u ms [DEVICE ID %d]",
+			interval * 5 / 4, (interval * 125) % 100, latency, timeout * 10, ctx->device_id);
+
+	// Command timeouts are floored at a few of these events
+	ctx->link.interval = interval;
+	ctx->link.latency = latency;
+}
+
+static const char *phy_to_string(uint8_t phy)
+{
+	switch (phy)
+	{
+	case BT_GAP_LE_PHY_1M:
+		return "1M";
+	case BT_GAP_LE_PHY_2M:
+		return "2M";
+	case BT_GAP_LE_PHY_CODED:
+		return "Coded";
+	default:
+		return "unknown";
+	}
+}
+
+static void le_phy_updated_cb(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+	struct device_context *ctx = devices_manager_get_device_context_by_conn(conn);
+	if (!ctx)
+	{
+		return;
+	}
+
+	ctx->link.tx_phy = param->tx_phy;
+	ctx->link.rx_phy = param->rx_phy;
+	LOG_INF("PHY updated: TX %s, RX %s [DEVICE ID %d]", phy_to_string(param->tx_phy),
+			phy_to_string(param->rx_phy), ctx->device_id);
+}
+
+static void le_data_len_updated_cb(struct bt_conn *conn, struct bt_conn_le_data_len_info *info)
+{
+	struct device_context *ctx = devices_manager_get_device_context_by_conn(conn);
+	if (!ctx)
+	{
+		return;
+	}
+
+	ctx->link.tx_max_len = info->tx_max_len;
+	ctx->link.rx_max_len = info->rx_max_len;
+	LOG_INF("Data length updated: TX %u, RX %u octets [DEVICE ID %d]", info->tx_max_len,
+			info->rx_max_len, ctx->device_id);
+}
+
 BT_CONN_CB_DEFINE(conn_callbacks) = {
 	.connected = connected_cb,
 	.disconnected = disconnected_cb,
+	.le_param_updated = le_param_updated_cb,
+	.le_phy_updated = le_phy_updated_cb,
+	.le_data_len_updated = le_data_len_updated_cb,
 	.security_changed = security_changed_cb,
 };
 
+/* The MTU exchange itself is started by CONFIG_BT_GATT_AUTO_UPDATE_MTU */
+static void att_mtu_updated_cb(struct bt_conn *conn, uint16_t tx, uint16_t rx)
+{
+	struct device_context *ctx = devices_manager_get_device_context_by_conn(conn);
+	if (!ctx)
+	{
+		return;
+	}
+
+	ctx->link.mtu = MIN(tx, rx);
+	LOG_INF("ATT MTU updated: %u [DEVICE ID %d]", ctx->link.mtu, ctx->device_id);
+}
+
+static struct bt_gatt_cb gatt_callbacks = {
+	.att_mtu_updated = att_mtu_updated_cb,
+};
+
+/**
+ * @brief Ask for 2M PHY and the maximum data length once the link is encrypted
+ *
+ * Both are requests: a peer without 2M support keeps the link on 1M and the
+ * controller grants whatever data length both sides support. The granted
+ * values are reported by le_phy_updated_cb() and le_data_len_updated_cb().
+ */
+static void ble_manager_negotiate_link(struct device_context *ctx)
+{
+	int err;
+
+	if (ctx->link.encrypted_at_ms == 0)
+	{
+		ctx->link.encrypted_at_ms = k_uptime_get();
+	}
+
+	if (ctx->link.tx_phy != BT_GAP_LE_PHY_2M || ctx->link.rx_phy != BT_GAP_LE_PHY_2M)
+	{
+		err = bt_conn_le_phy_update(ctx->conn, BT_CONN_LE_PHY_PARAM_2M);
+		if (err)
+		{
+			LOG_WRN("2M PHY request failed (err %d) - staying on 1M [DEVICE ID %d]", err,
+					ctx->device_id);
+		}
+	}
+
+	if (ctx->link.tx_max_len < BT_GAP_DATA_LEN_MAX)
+	{
+		err = bt_conn_le_data_len_update(ctx->conn, BT_LE_DATA_LEN_PARAM_MAX);
+		if (err)
+		{
+			LOG_WRN("Data length update failed (err %d) [DEVICE ID %d]", err, ctx->device_id);
+		}
+	}
+}
+
+/**
+ * @brief Log how long service discovery took since encryption and what the link granted
+ */
+void ble_manager_report_discovery_time(uint8_t device_id)
+{
+	struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
+	if (!ctx || !ctx->conn || ctx->link.encrypted_at_ms == 0)
+	{
+		return;
+	}
+
+	LOG_INF("Discovery took %lld ms (PHY %s/%s, data length %u/%u, MTU %u) [DEVICE ID %d]",
+			k_uptime_get() - ctx->link.encrypted_at_ms, phy_to_string(ctx->link.tx_phy),
+			phy_to_string(ctx->link.rx_phy), ctx->link.tx_max_len, ctx->link.rx_max_len,
+			ctx->link.mtu, device_id);
+}
+
+static void conn_param_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	uint8_t device_id = (dwork == &conn_param_work[0]) ? 0 : 1;
+	struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
+	enum ble_conn_profile target = conn_profile_base[device_id];
+
+	int64_t remaining = conn_boost_until[device_id] - k_uptime_get();
+	if (remaining > 0)
+	{
+		/* Come back to relax once the boost expires */
+		target = BLE_CONN_PROFILE_BOOST;
+		k_work_schedule(dwork, K_MSEC(remaining));
+	}
+
+	if (!ctx || !ctx->conn || target == conn_profile_applied[device_id])
+	{
+		return;
+	}
+
+	int err = bt_conn_le_param_update(ctx->conn, &conn_profiles[target]);
+	if (err)
+	{
+		LOG_WRN("Failed to apply %s connection parameters (err %d) [DEVICE ID %d]",
+				conn_profile_names[target], err, device_id);
+		return;
+	}
+
+	LOG_DBG("Requested %s connection parameters [DEVICE ID %d]", conn_profile_names[target],
+			device_id);
+	conn_profile_applied[device_id] = target;
+}
+
+/**
+ * @brief Select the connection parameter profile of a device
+ *
+ * Takes effect immediately unless a boost is active, in which case it is
+ * applied when the boost expires.
+ */
+void ble_manager_set_conn_profile(uint8_t device_id, enum ble_conn_profile profile)
+{
+	if (device_id >= 2 || profile >= BLE_CONN_PROFILE_COUNT || profile == BLE_CONN_PROFILE_BOOST)
+	{
+		return;
+	}
+
+	conn_profile_base[device_id] = profile;
+	k_work_reschedule(&conn_param_work[device_id], K_NO_WAIT);
+}
+
+/**
+ * @brief Switch a device to the boost profile for BLE_CONN_BOOST_HOLD_MS
+ *
+ * Called after a button press has enqueued its command, so the command is not
+ * held back by the parameter update. Further presses extend the boost.
+ */
+void ble_manager_boost_conn(uint8_t device_id)
+{
+	if (device_id >= 2)
+	{
+		return;
+	}
+
+	conn_boost_until[device_id] = k_uptime_get() + BLE_CONN_BOOST_HOLD_MS;
+	k_work_reschedule(&conn_param_work[device_id], K_NO_WAIT);
+}
+
+/* GN Hearing HI service UUID, only advertised by the NRPA of a hearing aid */
+#define GN_HI_SERVICE_UUID 0xFEFE
+
 /* Device discovery function
    Extracts device name and service UUID from advertisement data */
 static bool parse_adv(struct bt_data *data, void *user_data)
 {
 	struct scan_callback_data *scan_data = (struct scan_callback_data *)user_data;
-	char addr_str[BT_ADDR_LE_STR_LEN];
-	bt_addr_le_to_str(&scan_data->addr, addr_str, sizeof(addr_str));
-	
-	// LOG_DBG("Advertisement data type 0x%X len %u from %s", data->type, data->data_len, addr_str);
+
+	// LOG_DBG("Advertisement data type 0x%X len %u", data->type, data->data_len);
 
 	switch (data->type)
 	{
@@ -463,8 +694,10 @@ static bool parse_adv(struct bt_data *data, void *user_data)
 				uint16_t uuid_val = sys_get_le16(&data->data[i]);
 				LOG_DBG("Service Data UUID 0x%04X", uuid_val);
 
-				if (uuid_val == 0xFEFE)
+				if (uuid_val == GN_HI_SERVICE_UUID)
 				{
+					char addr_str[BT_ADDR_LE_STR_LEN];
+					bt_addr_le_to_str(&scan_data->addr, addr_str, sizeof(addr_str));
 					LOG_INF("Found GN Hearing HI service UUID from %s", addr_str);
 					// LOG_HEXDUMP_DBG(data->data, data->data_len, "Service Data");
 					scan_data->is_GN_HI = true;
@@ -489,21 +722,73 @@ static bool parse_adv(struct bt_data *data, void *user_data)
 	return true;
 }
 
-static void advertisement_found_cb(const bt_addr_le_t *addr, int8_t rssi, uint8_t type, struct net_buf_simple *ad)
+/* Decide from the raw AD structures, in place and without copying or
+ * formatting anything, whether an advertisement is worth a full parse: it
+ * lists the GN Hearing HI service UUID, or it names a device that is already
+ * in the scanned list. In crowded places this runs for dozens of
+ * advertisements per 100 ms on the host RX thread, next to connection
+ * traffic, and nearly all of them are from other devices. */
+static bool adv_prefilter(const bt_addr_le_t *addr, const struct net_buf_simple *ad)
 {
-	// LOG_DBG("Recevied adv type %u from %s, RSSI %d dBm, AD len %u", type, addr_str, rssi, ad->len);
+	const uint8_t *p = ad->data;
+	uint16_t left = ad->len;
+	bool has_name = false;
 
-	char addr_str[BT_ADDR_LE_STR_LEN];
-	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
+	// Each AD structure is a length byte, a type byte and length - 1 bytes of data
+	while (left >= 2 && p[0] != 0 && p[0] < left)
+	{
+		uint8_t type = p[1];
+		const uint8_t *data = &p[2];
+		uint8_t data_len = p[0] - 1;
+
+		switch (type)
+		{
+		case BT_DATA_UUID16_SOME:
+		case BT_DATA_UUID16_ALL:
+		case BT_DATA_SVC_DATA16:
+			for (uint8_t i = 0; i + 2 <= data_len; i += 2)
+			{
+				if (sys_get_le16(&data[i]) == GN_HI_SERVICE_UUID)
+				{
+					return true;
+				}
+			}
+			break;
+
+		case BT_DATA_NAME_COMPLETE:
+		case BT_DATA_NAME_SHORTENED:
+			has_name = true;
+			break;
+
+		default:
+			break;
+		}
+
+		left -= p[0] + 1;
+		p += p[0] + 1;
+	}
+
+	// Names arrive in the scan response of the RPA, only known devices take them
+	return has_name && devices_manager_is_scanned_device(addr);
+}
+
+static void advertisement_found_cb(const bt_addr_le_t *addr, int8_t rssi, uint8_t type, struct net_buf_simple *ad)
+{
+	// LOG_DBG("Recevied adv type %u, RSSI %d dBm, AD len %u", type, rssi, ad->len);
 
 	if (type != BT_GAP_ADV_TYPE_EXT_ADV) {
-		// LOG_DBG("Received adv from %s, RSSI %d dBm, EAD len %u", addr_str, rssi, ad->len);
+		// LOG_DBG("Received adv, RSSI %d dBm, EAD len %u", rssi, ad->len);
+		return;
+	}
+
+	if (!adv_prefilter(addr, ad))
+	{
 		return;
-	} else {
-		// LOG_DBG("Received extended adv from %s, RSSI %d dBm, EXT_AD len %u", addr_str, rssi, ad->len);
 	}
 
 	int err;
+	char addr_str[BT_ADDR_LE_STR_LEN];
+	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
 
 	struct scan_callback_data scan_data = {0};
 	scan_data.addr = *addr;
@@ -626,7 +911,7 @@ int ble_manager_init(void)
 {
 	bt_conn_auth_info_cb_register(&auth_info_callbacks);
 
-	int err = ble_queues_init();
+	int err = ble_cmd_queue_init();
 	if (err)
 	{
 		LOG_ERR("BLE queue init failed (err %d)", err);
@@ -638,7 +923,10 @@ int ble_manager_init(void)
 	{
 		k_work_init_delayable(&security_request_work[i], security_request_handler);
 		k_work_init_delayable(&connect_work[i], connect_work_handler);
+		k_work_init_delayable(&conn_param_work[i], conn_param_work_handler);
 	}
+	k_work_init(&auto_connect_work, auto_connect_work_handler);
+	bt_gatt_cb_register(&gatt_callbacks);
 
 	err = devices_manager_init();
 	if (err)
@@ -699,8 +987,9 @@ int ble_manager_connect(uint8_t device_id, const bt_addr_le_t *addr)
 		return err;
 	}
 
+	wake_trace_record(WAKE_TRACE_CONN_CREATE, device_id);
 	err = bt_conn_le_create(addr, BT_CONN_LE_CREATE_CONN,
-		BT_LE_CONN_PARAM_DEFAULT, &ctx->conn);
+		&conn_profiles[BLE_CONN_PROFILE_DISCOVERY], &ctx->conn);
 	if (err) {
 		LOG_DBG("Failed to establish conn: %d [DEVICE ID %d]\n", err, device_id);
 		return err;
@@ -787,760 +1076,248 @@ int ble_manager_connect_to_bonded_device(uint8_t device_id)
 	return 0;
 }
 
-void bt_ready_cb(int err)
+/* Reuse a live link to a bonded device instead of creating a new one */
+static bool ble_manager_reuse_bonded_link(struct device_context *ctx)
 {
-	if (err)
+	struct bt_conn_info info;
+
+	if (!ctx->conn || bt_conn_get_info(ctx->conn, &info) != 0 ||
+		info.state != BT_CONN_STATE_CONNECTED)
 	{
-		LOG_ERR("Bluetooth init failed (err %d)", err);
-		return;
+		return false;
 	}
 
-	LOG_INF("Bluetooth initialized");
+	devices_manager_set_device_state(ctx, CONN_STATE_BONDED);
+	app_controller_notify_device_connected(ctx->device_id);
 
-	if (IS_ENABLED(CONFIG_SETTINGS))
+	if (bt_conn_get_security(ctx->conn) >= BT_SECURITY_L2)
 	{
-		LOG_DBG("Loading BT settings from flash");
-		err = settings_load_subtree("bt");
-		if (err)
-		{
-			LOG_WRN("Failed to load BT settings (err %d)", err);
-		}
+		LOG_INF("Reusing encrypted link [DEVICE ID %d]", ctx->device_id);
+		app_controller_notify_device_ready(ctx->device_id);
+	}
+	else
+	{
+		LOG_INF("Reusing link, requesting encryption [DEVICE ID %d]", ctx->device_id);
+		ble_cmd_request_security(ctx->device_id);
 	}
 
-	LOG_DBG("Clearing filter accept list");
-	bt_le_filter_accept_list_clear();
-
-	/* Initialize BLE manager */
-	err = ble_manager_init();
-	if (err)
-	{
-		LOG_ERR("BLE manager init failed (err %d)", err);
-		return;
-	}
-
-	app_controller_notify_system_ready();
+	return true;
 }
 
-// static void is_bonded_device_cb(const struct bt_bond_info *info, void *user_data)
-// {
-// 	struct check_bonded_data
-// 	{
-// 		const bt_addr_le_t *target_addr;
-// 		bool found;
-// 	} *data = user_data;
-
-// 	if (bt_addr_le_eq(&info->addr, data->target_addr))
-// 	{
-// 		data->found = true;
-// 		LOG_DBG("Found bonded device");
-// 	}
-// }
-
-// static bool is_bonded_device(const bt_addr_le_t *addr)
-// {
-// 	struct check_bonded_data
-// 	{
-// 		const bt_addr_le_t *target_addr;
-// 		bool found;
-// 	} check_data = {.target_addr = addr, .found = false};
-
-// 	char addr_str[BT_ADDR_LE_STR_LEN];
-// 	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
-// 	LOG_DBG("Checking if device %s is bonded", addr_str);
-// 	bt_foreach_bond(BT_ID_DEFAULT, is_bonded_device_cb, &check_data);
-
-// 	return check_data.found;
-// }
-
-/* Execute a single BLE command */
-static int ble_cmd_execute(struct ble_cmd *cmd)
+/* Reset a device context for a fresh connection to its bonded address */
+static int ble_manager_prepare_bonded_ctx(uint8_t device_id)
 {
-	int err = 0;
-
-	/* Save command fields to local variables before execution.
-	 * The command may be freed by synchronous callbacks during execution
-	 * (e.g., has_discover_cb can call ble_cmd_complete synchronously). */
-	uint8_t device_id = cmd->device_id;
-	enum ble_cmd_type type = cmd->type;
-	uint8_t d0 = cmd->d0;
-
-	LOG_DBG("Executing BLE command type %s [DEVICE ID %d]", command_type_to_string(type),
-			device_id);
+	struct device_context *ctx = &device_ctx[device_id];
+	struct bonded_device_entry entry = bonded_devices->devices[device_id];
 
-	if (device_id != 0 && device_id != 1)
+	if (bt_addr_le_cmp(&entry.addr, &bt_addr_le_none) == 0)
 	{
-		LOG_ERR("Invalid device ID in BLE command: %d", device_id);
+		LOG_ERR("No bonded device found to connect to [DEVICE ID %d]", device_id);
 		return -EINVAL;
 	}
 
-	switch (type)
-	{
-	case BLE_CMD_REQUEST_SECURITY:
-		k_work_schedule(&security_request_work[device_id], K_MSEC(0));
-		break;
-
-	/* VCP */
-	case BLE_CMD_VCP_DISCOVER:
-		err = vcp_cmd_discover(device_id);
-		break;
-	case BLE_CMD_VCP_VOLUME_UP:
-		err = vcp_cmd_volume_up(device_id);
-		break;
-	case BLE_CMD_VCP_VOLUME_DOWN:
-		err = vcp_cmd_volume_down(device_id);
-		break;
-	case BLE_CMD_VCP_SET_VOLUME:
-		err = vcp_cmd_set_volume(device_id, d0);
-		break;
-	case BLE_CMD_VCP_MUTE:
-		err = vcp_cmd_mute(device_id);
-		break;
-	case BLE_CMD_VCP_UNMUTE:
-		err = vcp_cmd_unmute(device_id);
-		break;
-	case BLE_CMD_VCP_READ_STATE:
-		err = vcp_cmd_read_state(device_id);
-		break;
-	case BLE_CMD_VCP_READ_FLAGS:
-		err = vcp_cmd_read_flags(device_id);
-		break;
-
-	/* BAS */
-	case BLE_CMD_BAS_DISCOVER:
-		err = battery_discover(device_id);
-		break;
-	case BLE_CMD_BAS_READ_LEVEL:
-		err = battery_read_level(device_id);
-		break;
-
-	/* CSIP */
-	case BLE_CMD_CSIP_DISCOVER:
-		err = csip_cmd_discover(device_id);
-		break;
-
-	/* HAS */
-	case BLE_CMD_HAS_DISCOVER:
-		err = has_cmd_discover(device_id);
-		break;
-	case BLE_CMD_HAS_READ_PRESETS:
-		err = has_cmd_read_presets(device_id);
-		break;
-	case BLE_CMD_HAS_SET_PRESET:
-		err = has_cmd_set_active_preset(device_id, d0);
-		break;
-	case BLE_CMD_HAS_NEXT_PRESET:
-		err = has_cmd_next_preset(device_id);
-		break;
-	case BLE_CMD_HAS_PREV_PRESET:
-		err = has_cmd_prev_preset(device_id);
-		break;
-
-	default:
-		LOG_ERR("Unknown BLE command type: %d", type);
-		err = -EINVAL;
-		break;
-	}
-
-	/** Check if the local data matches the data at the cmd address
-	 * This is to catch any cases where the command may have been freed
-	 * during fast execution (e.g., in a callback).
-	 */
-	if (device_id != cmd->device_id || type != cmd->type || d0 != cmd->d0)
-	{
-		LOG_DBG("Command finished during execution callback, skipping logging");
-		return err;
-	}
-
-	if (err)
-	{
-		LOG_ERR("BLE command execution failed: type %s (err %d) [DEVICE ID %d]",
-				command_type_to_string(type), err, device_id);
-	} else {
-		LOG_DBG("BLE command execution succeeded: type=%s, err=%d [DEVICE ID %d]",
-				command_type_to_string(type), err, device_id);
-	}
+	memset(ctx, 0, sizeof(struct device_context));
+	bt_addr_le_copy(&ctx->info.addr, &entry.addr);
+	ctx->device_id = device_id;
+	devices_manager_set_device_state(ctx, CONN_STATE_BONDED);
+	session_snapshot_seed_device(ctx);
 
-	return err;
+	return 0;
 }
 
-/* Handle command timeout */
-static void ble_cmd_timeout_handler(struct k_work *work)
+/**
+ * @brief Reconnect to a bonded device and encrypt with the stored LTK
+ *
+ * A live link (e.g. left over from first time use) is reused as is. Otherwise a
+ * single connection is created right away and security is requested from
+ * connected_cb(). The disconnect/reconnect cycle of
+ * ble_manager_establish_trusted_bond() is only used if encryption fails.
+ *
+ * @param device_id Device ID (0 or 1)
+ * @return 0 on success, negative error code on failure
+ */
+int ble_manager_reconnect_bonded_device(uint8_t device_id)
 {
-	struct device_context *ctx =
-		(work == &ble_cmd_timeout_work[0].work) ? &device_ctx[0] : &device_ctx[1];
-
-	if (!ctx->current_ble_cmd)
-	{
-		LOG_WRN("Timeout but no current command");
-		ble_cmd_in_progress[ctx->device_id] = false;
-		return;
-	}
-	else
+	struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
+	if (!ctx)
 	{
-		LOG_ERR("BLE command timeout (safety net): type=%d", ctx->current_ble_cmd->type);
-
-		// Free the command and move on
-		ble_cmd_free(ctx->current_ble_cmd);
-		ctx->current_ble_cmd = NULL;
-		ble_cmd_in_progress[ctx->device_id] = false;
+		return -EINVAL;
 	}
 
-	// Process next command
-	ble_process_next_command(ctx->device_id);
-	return;
-}
-
-/* Mark command as complete (called when subsystem command completes) */
-void ble_cmd_complete(uint8_t device_id, int err)
-{
-	struct device_context *ctx = &device_ctx[device_id];
-
-	// Cancel timeout
-	k_work_cancel_delayable(&ble_cmd_timeout_work[ctx->device_id]);
+	trusted_bond_fallback_used[device_id] = false;
 
-	if (!ctx->current_ble_cmd)
+	if (ble_manager_reuse_bonded_link(ctx))
 	{
-		LOG_WRN("Command complete but no current command [DEVICE ID %d]", device_id);
-		return;
+		return 0;
 	}
 
+	int err = ble_manager_prepare_bonded_ctx(device_id);
 	if (err)
 	{
-		LOG_ERR("BLE command failed: type=%s, err=%d [DEVICE ID %d]", command_type_to_string(ctx->current_ble_cmd->type), err, device_id);
-		
-		if (ctx->current_ble_cmd->type == BLE_CMD_REQUEST_SECURITY && err == -1)
-		{
-			ble_cmd_request_security(ctx->device_id);
-		} else if (ctx->current_ble_cmd->type >= 0x2 && ctx->current_ble_cmd->type <= 0x8)
-		{
-			if (err == 15)
-			{
-				LOG_ERR("VCP command failed due to insufficient authentication - "
-						"reconnecting [DEVICE ID %d]",
-						ctx->device_id);
-				ble_manager_establish_trusted_bond(ctx->device_id);
-			} else if (err == 0x80) {
-				LOG_ERR("VCP command failed due to incorrect change_counter - reading state [DEVICE ID %d]", ctx->device_id);
-				ble_cmd_vcp_read_state(ctx->current_ble_cmd->device_id, true);
-			}
-		}
-	}
-	else
-	{
-		LOG_DBG("BLE command completed successfully: type=%s [DEVICE ID %d]",
-				command_type_to_string(ctx->current_ble_cmd->type), ctx->device_id);
-
-		if (ctx->current_ble_cmd->type == BLE_CMD_VCP_DISCOVER)
-		{
-			// After VCP discovery, read initial state
-			ble_cmd_vcp_read_state(ctx->device_id, true);
-		}
+		return err;
 	}
 
-	// Free the command
-	ble_cmd_free(ctx->current_ble_cmd);
-	ctx->current_ble_cmd = NULL;
-	ble_cmd_in_progress[ctx->device_id] = false;
+	LOG_INF("Reconnecting to bonded device [DEVICE ID %d]", device_id);
+	k_work_schedule(&connect_work[device_id], K_NO_WAIT);
 
-	// Process next command
-	if (!err)
-	{
-		ble_process_next_command(ctx->device_id);
-	}
+	return 0;
 }
 
-/* Process the next command in the queue */
-static void ble_process_next_command(uint8_t device_id)
+/* (Re)start auto-connect for the bonded devices that are still not connected */
+static void auto_connect_work_handler(struct k_work *work)
 {
-	struct device_context *ctx = &device_ctx[device_id];
+	bool pending = false;
+	int err;
 
-	struct ble_cmd *cmd = ble_cmd_dequeue(ctx->device_id);
-	if (!cmd)
+	err = bt_le_filter_accept_list_clear();
+	if (err)
 	{
-		LOG_DBG("No BLE commands in queue [DEVICE ID %d]", device_id);
-		return;
+		LOG_WRN("Failed to clear filter accept list (err %d)", err);
 	}
 
-	ctx->current_ble_cmd = cmd;
-	ble_cmd_in_progress[ctx->device_id] = true;
-
-	uint8_t cmd_device_id = cmd->device_id;
-	enum ble_cmd_type type = cmd->type;
-	uint8_t d0 = cmd->d0;
-
-	// Execute the command
-	int err = ble_cmd_execute(ctx->current_ble_cmd);
-
-	if (err)
+	for (uint8_t i = 0; i < 2; i++)
 	{
-		// Command failed to initiate
-		LOG_ERR("Failed to initiate BLE command (err %d) [DEVICE ID %d]", err, device_id);
-
-		if (err == -EBUSY)
+		if (!auto_connect_pending[i])
 		{
-			LOG_WRN("Server was busy: type=%s [DEVICE ID %d]", command_type_to_string(ctx->current_ble_cmd->type), device_id);
+			continue;
+		}
 
-			// Re-enqueue the command at the front of the queue if VCP volume command
-			switch (ctx->current_ble_cmd->type)
-			{
-			case BLE_CMD_VCP_VOLUME_UP:
-			case BLE_CMD_VCP_VOLUME_DOWN:
-			case BLE_CMD_VCP_SET_VOLUME:
-			case BLE_CMD_VCP_MUTE:
-			case BLE_CMD_VCP_UNMUTE:
-				LOG_DBG("Re-enqueuing VCP volume command at front of queue [DEVICE ID %d]", device_id);
-				ble_cmd_enqueue(cmd, true);
-				break;
-
-			default:
-				LOG_WRN("Skipping command [DEVICE ID %d]", device_id);
-				ble_cmd_free(cmd);
-				ctx->current_ble_cmd = NULL;
-				ble_cmd_in_progress[ctx->device_id] = false;
-				break;
-			}
+		err = bt_le_filter_accept_list_add(&device_ctx[i].info.addr);
+		if (err && err != -EALREADY)
+		{
+			LOG_ERR("Failed to add device to filter accept list (err %d) [DEVICE ID %d]",
+					err, i);
+			continue;
 		}
 
-		ble_process_next_command(ctx->device_id);
-		return;
+		pending = true;
 	}
 
-	/** Check if the local data matches the data at the cmd address
-	 * This is to catch any cases where the command may have been freed
-	 * during fast execution (e.g., in a callback).
-	 */
-	if (cmd_device_id != cmd->device_id || type != cmd->type || d0 != cmd->d0)
+	if (!pending)
 	{
-		LOG_DBG("Command finished during execution callback");
+		LOG_DBG("All bonded devices connected - auto-connect stopped");
 		return;
 	}
 
-	// Wait for completion callback with timeout
-	LOG_DBG("Command waiting for completion: type=%s [DEVICE ID %d]",
-			command_type_to_string(cmd->type), device_id);
-	k_work_schedule(&ble_cmd_timeout_work[cmd->device_id], K_MSEC(BLE_CMD_TIMEOUT_MS));
-}
-
-int ble_cmd_request_security(uint8_t device_id)
-{
-	struct ble_cmd *cmd = ble_cmd_alloc(device_id);
-	if (!cmd)
-	{
-		return -ENOMEM;
-	}
-
-	cmd->device_id = device_id;
-	cmd->type = BLE_CMD_REQUEST_SECURITY;
-	return ble_cmd_enqueue(cmd, true); // Security requests should always be high priority
-}
-
-int ble_cmd_vcp_discover(uint8_t device_id, bool high_priority)
-{
-	struct device_context *ctx = &device_ctx[device_id];
-
-	struct ble_cmd *cmd = ble_cmd_alloc(device_id);
-	if (!cmd)
-	{
-		return -ENOMEM;
-	}
-
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_VCP_DISCOVER;
-	return ble_cmd_enqueue(cmd, high_priority);
-}
-
-/**
- * @brief Enqueue a VCP volume up command
- * @param device_id Device ID
- * @param high_priority Not used for this command
- * @return 0 on success, negative error code on failure
- */
-int ble_cmd_vcp_volume_up(uint8_t device_id, bool high_priority)
-{
-	(void)high_priority;
-	struct device_context *ctx = &device_ctx[device_id];
-	// ble_cmd_vcp_read_state(ctx->device_id, false);
+	bt_le_scan_stop();
 
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
+	wake_trace_record(WAKE_TRACE_CONN_CREATE, WAKE_TRACE_NO_DEVICE);
+	err = bt_conn_le_create_auto(BT_CONN_LE_CREATE_CONN,
+		&conn_profiles[BLE_CONN_PROFILE_DISCOVERY]);
+	if (err)
 	{
-		return -ENOMEM;
+		LOG_ERR("Failed to start auto-connect (err %d)", err);
 	}
-
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_VCP_VOLUME_UP;
-	return ble_cmd_enqueue(cmd, 0);
 }
 
 /**
- * @brief Enqueue a VCP volume down command
- * @param device_id Device ID
- * @param high_priority Not used for this command
+ * @brief Connect to all bonded devices concurrently
+ *
+ * The bonded addresses are put on the filter accept list and the controller
+ * connects to whichever set member advertises first, then the other. Security
+ * is requested per link from connected_cb(), so encryption of both links runs
+ * in parallel. Live links are reused as in ble_manager_reconnect_bonded_device().
+ *
+ * @param count Number of bonded devices (1 or 2)
  * @return 0 on success, negative error code on failure
  */
-int ble_cmd_vcp_volume_down(uint8_t device_id, bool high_priority)
-{
-	(void)high_priority;
-	struct device_context *ctx = &device_ctx[device_id];
-	ble_cmd_vcp_read_state(ctx->device_id, false);
-
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
-	{
-		return -ENOMEM;
-	}
-
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_VCP_VOLUME_DOWN;
-	return ble_cmd_enqueue(cmd, 0);
-}
-
-int ble_cmd_vcp_set_volume(uint8_t device_id, uint8_t volume, bool high_priority)
-{
-	struct device_context *ctx = &device_ctx[device_id];
-	ble_cmd_vcp_read_state(ctx->device_id, false);
-
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
-	{
-		return -ENOMEM;
-	}
-
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_VCP_SET_VOLUME;
-	cmd->d0 = volume;
-	return ble_cmd_enqueue(cmd, high_priority);
-}
-
-int ble_cmd_vcp_mute(uint8_t device_id, bool high_priority)
-{
-	struct device_context *ctx = &device_ctx[device_id];
-	ble_cmd_vcp_read_state(ctx->device_id, false);
-
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
-	{
-		return -ENOMEM;
-	}
-
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_VCP_MUTE;
-	return ble_cmd_enqueue(cmd, high_priority);
-}
-
-int ble_cmd_vcp_unmute(uint8_t device_id, bool high_priority)
-{
-	struct device_context *ctx = &device_ctx[device_id];
-	ble_cmd_vcp_read_state(ctx->device_id, false);
-
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
-	{
-		return -ENOMEM;
-	}
-
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_VCP_UNMUTE;
-	return ble_cmd_enqueue(cmd, high_priority);
-}
-
-int ble_cmd_vcp_read_state(uint8_t device_id, bool high_priority)
-{
-	struct device_context *ctx = &device_ctx[device_id];
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
-	{
-		return -ENOMEM;
-	}
-
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_VCP_READ_STATE;
-	return ble_cmd_enqueue(cmd, high_priority);
-}
-
-int ble_cmd_vcp_read_flags(uint8_t device_id, bool high_priority)
-{
-	struct device_context *ctx = &device_ctx[device_id];
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
-	{
-		return -ENOMEM;
-	}
-
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_VCP_READ_FLAGS;
-	return ble_cmd_enqueue(cmd, high_priority);
-}
-
-int ble_cmd_bas_discover(uint8_t device_id, bool high_priority)
-{
-	struct device_context *ctx = &device_ctx[device_id];
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
-	{
-		return -ENOMEM;
-	}
-
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_BAS_DISCOVER;
-	return ble_cmd_enqueue(cmd, high_priority);
-}
-
-int ble_cmd_bas_read_level(uint8_t device_id, bool high_priority)
+int ble_manager_connect_bonded_devices(uint8_t count)
 {
-	struct device_context *ctx = &device_ctx[device_id];
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
-	{
-		return -ENOMEM;
-	}
+	bool pending = false;
 
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_BAS_READ_LEVEL;
-	return ble_cmd_enqueue(cmd, high_priority);
-}
-
-int ble_cmd_csip_discover(uint8_t device_id, bool high_priority)
-{
-	struct device_context *ctx = &device_ctx[device_id];
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
+	for (uint8_t i = 0; i < count && i < 2; i++)
 	{
-		return -ENOMEM;
-	}
+		trusted_bond_fallback_used[i] = false;
 
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_CSIP_DISCOVER;
-	return ble_cmd_enqueue(cmd, high_priority);
-}
-
-int ble_cmd_has_discover(uint8_t device_id, bool high_priority)
-{
-	struct device_context *ctx = &device_ctx[device_id];
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
-	{
-		return -ENOMEM;
-	}
-
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_HAS_DISCOVER;
-	return ble_cmd_enqueue(cmd, high_priority);
-}
-
-int ble_cmd_has_read_presets(uint8_t device_id, bool high_priority)
-{
-	struct device_context *ctx = &device_ctx[device_id];
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
-	{
-		return -ENOMEM;
-	}
+		if (ble_manager_reuse_bonded_link(&device_ctx[i]))
+		{
+			continue;
+		}
 
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_HAS_READ_PRESETS;
-	return ble_cmd_enqueue(cmd, high_priority);
-}
+		int err = ble_manager_prepare_bonded_ctx(i);
+		if (err)
+		{
+			return err;
+		}
 
-int ble_cmd_has_set_preset(uint8_t device_id, uint8_t preset_index, bool high_priority)
-{
-	if (!presets_loaded) {
-		ble_cmd_has_read_presets(device_id, true);
+		auto_connect_pending[i] = true;
+		pending = true;
 	}
 
-	struct device_context *ctx = &device_ctx[device_id];
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
+	if (pending)
 	{
-		return -ENOMEM;
+		LOG_INF("Auto-connecting to %d bonded device(s)", count);
+		k_work_submit(&auto_connect_work);
 	}
 
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_HAS_SET_PRESET;
-	cmd->d0 = preset_index;
-	return ble_cmd_enqueue(cmd, high_priority);
+	return 0;
 }
 
-int ble_cmd_has_next_preset(uint8_t device_id, bool high_priority)
+void bt_ready_cb(int err)
 {
-	if (!device_ctx[0].has_ctlr.presets_read) {
-		ble_cmd_has_read_presets(0, true);
-	}
-	if (!device_ctx[1].has_ctlr.presets_read) {
-		ble_cmd_has_read_presets(1, true);
-	}
-
-	struct device_context *ctx = &device_ctx[device_id];
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
+	if (err)
 	{
-		return -ENOMEM;
+		LOG_ERR("Bluetooth init failed (err %d)", err);
+		return;
 	}
 
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_HAS_NEXT_PRESET;
-	return ble_cmd_enqueue(cmd, high_priority);
-}
-
-int ble_cmd_has_prev_preset(uint8_t device_id, bool high_priority)
-{
-	if (!presets_loaded) {
-		ble_cmd_has_read_presets(device_id, true);
-	}
+	LOG_INF("Bluetooth initialized");
+	wake_trace_record(WAKE_TRACE_BT_READY, WAKE_TRACE_NO_DEVICE);
 
-	struct device_context *ctx = &device_ctx[device_id];
-	struct ble_cmd *cmd = ble_cmd_alloc(ctx->device_id);
-	if (!cmd)
+	if (IS_ENABLED(CONFIG_SETTINGS))
 	{
-		return -ENOMEM;
+		LOG_DBG("Loading BT settings from flash");
+		err = settings_load_subtree("bt");
+		if (err)
+		{
+			LOG_WRN("Failed to load BT settings (err %d)", err);
+		}
 	}
 
-	cmd->device_id = ctx->device_id;
-	cmd->type = BLE_CMD_HAS_PREV_PRESET;
-	return ble_cmd_enqueue(cmd, high_priority);
-}
-
-/* Reset BLE command queue */
-void ble_cmd_queue_reset(uint8_t device_id)
-{
-	struct device_context *ctx = &device_ctx[device_id];
-
-	// Clear command queues
-	k_mutex_lock(&ble_queue_mutex[ctx->device_id], K_FOREVER);
-
-	struct ble_cmd *cmd;
-	while ((cmd = (struct ble_cmd *)sys_slist_get(&ble_cmd_queue[ctx->device_id])) != NULL)
-	{
-		ble_cmd_free(cmd);
-	}
-	k_mutex_unlock(&ble_queue_mutex[ctx->device_id]);
+	LOG_DBG("Clearing filter accept list");
+	bt_le_filter_accept_list_clear();
 
-	// Cancel any pending command
-	if (ctx->current_ble_cmd)
+	/* Initialize BLE manager */
+	err = ble_manager_init();
+	if (err)
 	{
-		ble_cmd_free(ctx->current_ble_cmd);
-		ctx->current_ble_cmd = NULL;
+		LOG_ERR("BLE manager init failed (err %d)", err);
+		return;
 	}
 
-	ble_cmd_in_progress[ctx->device_id] = false;
-	k_work_cancel_delayable(&ble_cmd_timeout_work[ctx->device_id]);
-
-	LOG_DBG("BLE command queue reset");
-}
-
-/* Command processing thread */
-static void ble_cmd_thread_0(void)
-{
-	LOG_INF("[DEVICE ID 0] BLE command thread started");
-
-	while (1)
-	{
-		// Wait for a command to be enqueued
-		k_sem_take(ble_cmd_sem[0], K_FOREVER);
-
-		// Don't process if device_ctx isn't initialized yet
-		if (!device_ctx)
-		{
-			LOG_WRN("[DEVICE ID 0] BLE CMD thread woken but device_ctx not initialized yet");
-			continue;
-		}
-
-		// LOG_DBG("[DEVICE ID 0] BLE CMD thread woken");
-
-		// Process the next command only if nothing is in progress
-		// If a command is already in progress, it will call ble_process_next_command()
-		// when it completes via ble_cmd_complete()
-		if (!device_ctx[0].current_ble_cmd /*&& queue_is_active[0]*/)
-		{
-			// LOG_DBG("[DEVICE ID 0] BLE CMD thread processing next command");
-			ble_process_next_command(0);
-		}
-		else
-		{
-			// LOG_DBG("[DEVICE ID 0] BLE CMD thread skipping - command already in progress");
-		}
-	}
+	app_controller_notify_system_ready();
 }
 
-static void ble_cmd_thread_1(void)
-{
-	LOG_INF("[DEVICE ID 1] BLE command thread started");
-
-	while (1)
-	{
-		// Wait for a command to be enqueued
-		k_sem_take(ble_cmd_sem[1], K_FOREVER);
-
-		// Don't process if device_ctx isn't initialized yet
-		if (!device_ctx)
-		{
-			LOG_WRN("[DEVICE ID 1] BLE CMD thread woken but device_ctx not initialized yet");
-			continue;
-		}
+// static void is_bonded_device_cb(const struct bt_bond_info *info, void *user_data)
+// {
+// 	struct check_bonded_data
+// 	{
+// 		const bt_addr_le_t *target_addr;
+// 		bool found;
+// 	} *data = user_data;
 
-		// LOG_DBG("[DEVICE ID 1] BLE CMD thread woken");
+// 	if (bt_addr_le_eq(&info->addr, data->target_addr))
+// 	{
+// 		data->found = true;
+// 		LOG_DBG("Found bonded device");
+// 	}
+// }
 
-		// Process the next command only if nothing is in progress
-		// If a command is already in progress, it will call ble_process_next_command_1()
-		// when it completes via ble_cmd_complete()
-		if (!device_ctx[1].current_ble_cmd /*&& queue_is_active[1]*/)
-		{
-			// LOG_DBG("[DEVICE ID 1] BLE CMD thread processing next command");
-			ble_process_next_command(1);
-		}
-		else
-		{
-			// LOG_DBG("[DEVICE ID 1] BLE CMD thread skipping - command already in progress");
-		}
-	}
-}
+// static bool is_bonded_device(const bt_addr_le_t *addr)
+// {
+// 	struct check_bonded_data
+// 	{
+// 		const bt_addr_le_t *target_addr;
+// 		bool found;
+// 	} check_data = {.target_addr = addr, .found = false};
 
-/* Command thread */
-K_THREAD_DEFINE(ble_cmd_thread_0_id, 1024, ble_cmd_thread_0, NULL, NULL, NULL, 7, 0, 0);
-K_THREAD_DEFINE(ble_cmd_thread_1_id, 1024, ble_cmd_thread_1, NULL, NULL, NULL, 7, 0, 0);
+// 	char addr_str[BT_ADDR_LE_STR_LEN];
+// 	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
+// 	LOG_DBG("Checking if device %s is bonded", addr_str);
+// 	bt_foreach_bond(BT_ID_DEFAULT, is_bonded_device_cb, &check_data);
 
-static char *command_type_to_string(enum ble_cmd_type type)
-{
-	switch (type)
-	{
-	case BLE_CMD_REQUEST_SECURITY:
-		return "BLE_CMD_REQUEST_SECURITY";
-	case BLE_CMD_VCP_DISCOVER:
-		return "BLE_CMD_VCP_DISCOVER";
-	case BLE_CMD_VCP_VOLUME_UP:
-		return "BLE_CMD_VCP_VOLUME_UP";
-	case BLE_CMD_VCP_VOLUME_DOWN:
-		return "BLE_CMD_VCP_VOLUME_DOWN";
-	case BLE_CMD_VCP_SET_VOLUME:
-		return "BLE_CMD_VCP_SET_VOLUME";
-	case BLE_CMD_VCP_MUTE:
-		return "BLE_CMD_VCP_MUTE";
-	case BLE_CMD_VCP_UNMUTE:
-		return "BLE_CMD_VCP_UNMUTE";
-	case BLE_CMD_VCP_READ_STATE:
-		return "BLE_CMD_VCP_READ_STATE";
-	case BLE_CMD_VCP_READ_FLAGS:
-		return "BLE_CMD_VCP_READ_FLAGS";
-	case BLE_CMD_BAS_DISCOVER:
-		return "BLE_CMD_BAS_DISCOVER";
-	case BLE_CMD_BAS_READ_LEVEL:
-		return "BLE_CMD_BAS_READ_LEVEL";
-	case BLE_CMD_CSIP_DISCOVER:
-		return "BLE_CMD_CSIP_DISCOVER";
-	case BLE_CMD_HAS_DISCOVER:
-		return "BLE_CMD_HAS_DISCOVER";
-	case BLE_CMD_HAS_READ_PRESETS:
-		return "BLE_CMD_HAS_READ_PRESETS";
-	case BLE_CMD_HAS_SET_PRESET:
-		return "BLE_CMD_HAS_SET_PRESET";
-	case BLE_CMD_HAS_NEXT_PRESET:
-		return "BLE_CMD_HAS_NEXT_PRESET";
-	case BLE_CMD_HAS_PREV_PRESET:
-		return "BLE_CMD_HAS_PREV_PRESET";
-	default:
-		return "UNKNOWN_COMMAND";
-	}
-}
+// 	return check_data.found;
+// }
 
 /* Called from the battery_reader notification cb*/
 void ble_manager_set_device_ctx_battery_level(struct bt_conn *conn, uint8_t level)
@@ -1553,4 +1330,4 @@ void ble_manager_set_device_ctx_battery_level(struct bt_conn *conn, uint8_t leve
 	}
 
 	ctx->bas_ctlr.battery_level = level;
-}
\ No newline at end of file
+}
@@ -14,6 +14,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "ble_cmd_queue.h"
+
 /**
  * @brief Helper macro for fulfilling scanning parameters
  * according to the CAP Connection procedures "Ready for Audio related Peripheral" mode.
@@ -77,47 +79,16 @@ struct bt_vcp_ctlr {
     } state;
 };
 
-/* BLE command types */
-enum ble_cmd_type {
-    BLE_CMD_REQUEST_SECURITY,
-
-    /* VCP commands */
-    BLE_CMD_VCP_DISCOVER,
-    BLE_CMD_VCP_VOLUME_UP,
-    BLE_CMD_VCP_VOLUME_DOWN,
-    BLE_CMD_VCP_SET_VOLUME,
-    BLE_CMD_VCP_MUTE,
-    BLE_CMD_VCP_UNMUTE,
-    BLE_CMD_VCP_READ_STATE,
-    BLE_CMD_VCP_READ_FLAGS,
-
-    /* Battery Service commands */
-    BLE_CMD_BAS_DISCOVER,
-    BLE_CMD_BAS_READ_LEVEL,
-
-    /* CSIP commands */
-    BLE_CMD_CSIP_DISCOVER,
-
-    /* Hearing Access Service commands */
-    BLE_CMD_HAS_DISCOVER,
-    BLE_CMD_HAS_READ_PRESETS,
-    BLE_CMD_HAS_SET_PRESET,
-    BLE_CMD_HAS_NEXT_PRESET,
-    BLE_CMD_HAS_PREV_PRESET,
-};
-
-/* BLE command structure */
-struct ble_cmd {
-    uint8_t device_id;
-    enum ble_cmd_type type;
-    uint8_t d0;  // Data parameter (e.g., volume level)
-    uint8_t retry_count;
-    sys_snode_t node;  // For linked list
+/* Connection parameter profiles, applied with bt_conn_le_param_update() */
+enum ble_conn_profile {
+    BLE_CONN_PROFILE_DISCOVERY, /* Short interval while services are discovered */
+    BLE_CONN_PROFILE_IDLE,      /* Long interval with peripheral latency while waiting for input */
+    BLE_CONN_PROFILE_BOOST,     /* Short interval after user input, relaxed again afterwards */
+    BLE_CONN_PROFILE_COUNT,
 };
 
-/* Command queue configuration */
-#define BLE_CMD_QUEUE_SIZE 10
-#define BLE_CMD_TIMEOUT_MS 10000
+/* How long a boost is held after the last button press */
+#define BLE_CONN_BOOST_HOLD_MS 3000
 
 /* BLE manager public functions */
 int ble_manager_init(void);
@@ -128,30 +99,36 @@ void ble_manager_set_device_ctx_battery_level(struct bt_conn *conn, uint8_t leve
 void ble_manager_start_scan_for_HIs(void);
 void ble_manager_stop_scan_for_HIs(void);
 int ble_manager_connect_to_bonded_device(uint8_t device_id);
+int ble_manager_reconnect_bonded_device(uint8_t device_id);
+int ble_manager_connect_bonded_devices(uint8_t count);
 int ble_manager_autoconnect_to_device_by_addr(uint8_t device_id,const bt_addr_le_t *addr);
 int ble_manager_connect_to_scanned_device(uint8_t device_id, uint8_t idx);
 void ble_manager_establish_trusted_bond(uint8_t device_id);
+void ble_manager_set_conn_profile(uint8_t device_id, enum ble_conn_profile profile);
+void ble_manager_boost_conn(uint8_t device_id);
+void ble_manager_report_discovery_time(uint8_t device_id);
 
+/**
+ * @brief Start the security procedure of a link
+ *
+ * Executor of BLE_CMD_REQUEST_SECURITY, the command is completed once the
+ * link reaches BT_SECURITY_WANTED or the procedure fails.
+ *
+ * @param device_id Device ID
+ * @param cmd_id Handle of the command
+ * @return 0
+ */
+int ble_manager_start_security(uint8_t device_id, ble_cmd_handle_t cmd_id);
 
-/* BLE command queue API */
-int ble_cmd_request_security(uint8_t device_id);
-int ble_cmd_vcp_discover(uint8_t device_id, bool high_priority);
-int ble_cmd_vcp_volume_up(uint8_t device_id, bool high_priority);
-int ble_cmd_vcp_volume_down(uint8_t device_id, bool high_priority);
-int ble_cmd_vcp_set_volume(uint8_t device_id, uint8_t volume, bool high_priority);
-int ble_cmd_vcp_mute(uint8_t device_id, bool high_priority);
-int ble_cmd_vcp_unmute(uint8_t device_id, bool high_priority);
-int ble_cmd_vcp_read_state(uint8_t device_id, bool high_priority);
-int ble_cmd_vcp_read_flags(uint8_t device_id, bool high_priority);
-
-int ble_cmd_bas_discover(uint8_t device_id, bool high_priority);
-int ble_cmd_bas_read_level(uint8_t device_id, bool high_priority);
-
-int ble_cmd_csip_discover(uint8_t device_id, bool high_priority);
-
-void ble_cmd_queue_reset(uint8_t queue_id);
-
-void ble_cmd_complete(uint8_t device_id, int err);
+/**
+ * @brief Fall back to the disconnect/reconnect cycle after an authentication failure
+ *
+ * Only tried once per device per reconnect attempt.
+ *
+ * @param device_id Device ID
+ * @return true if the fallback was started
+ */
+bool ble_manager_trusted_bond_fallback(uint8_t device_id);
 
 /* Connection management */
 extern struct bt_conn_cb conn_callbacks;
@@ -161,10 +138,4 @@ int ble_manager_disconnect_device(struct bt_conn *conn);
 /* Connection initiation */
 int schedule_auto_connect(uint8_t device_id);
 
-/* HAS command queue API */
-int ble_cmd_has_discover(uint8_t device_id, bool high_priority);
-int ble_cmd_has_read_presets(uint8_t device_id, bool high_priority);
-int ble_cmd_has_set_preset(uint8_t device_id, uint8_t preset_index, bool high_priority);
-int ble_cmd_has_next_preset(uint8_t device_id, bool high_priority);
-int ble_cmd_has_prev_preset(uint8_t device_id, bool high_priority);
 #endif /* BLE_MANAGER_H */
\ No newline at end of file
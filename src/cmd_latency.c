@@ -0,0 +1,494 @@
+/**
+ * @file cmd_latency.c
+ * @brief Per-command-type latency histograms for the BLE command queue
+ */
+
+#include "cmd_latency.h"
+
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+#if defined(CONFIG_SHELL)
+#include <stdlib.h>
+#include <zephyr/shell/shell.h>
+#endif
+
+LOG_MODULE_REGISTER(cmd_latency, LOG_LEVEL_INF);
+
+struct cmd_latency_type_stats {
+	struct cmd_latency_counters counters;
+	uint16_t hist[CMD_LATENCY_PHASE_COUNT][CMD_LATENCY_BUCKETS];
+};
+
+struct cmd_latency_err {
+	int16_t err;
+	uint16_t count;
+};
+
+struct cmd_latency_device {
+	bt_addr_le_t peer;
+	uint16_t other_errors; /* Codes that found no free slot */
+	struct cmd_latency_err errors[CMD_LATENCY_ERR_SLOTS];
+	struct cmd_latency_type_stats types[BLE_CMD_TYPE_COUNT];
+};
+
+static struct cmd_latency_device stats[CONFIG_BT_MAX_CONN];
+static struct k_spinlock stats_lock;
+
+static const char *const phase_names[CMD_LATENCY_PHASE_COUNT] = {
+	[CMD_LATENCY_QUEUED] = "queued",
+	[CMD_LATENCY_EXECUTE] = "execute",
+	[CMD_LATENCY_RESPONSE] = "response",
+};
+
+/* Counters saturate instead of wrapping, a full one still reads as "many" */
+static inline void counter_inc(uint16_t *counter)
+{
+	if (*counter < UINT16_MAX) {
+		(*counter)++;
+	}
+}
+
+static uint8_t bucket_of(uint32_t cycles)
+{
+	uint32_t units = k_cyc_to_us_floor32(cycles) / CMD_LATENCY_BUCKET_BASE_US;
+	uint8_t bucket = units ? 32 - __builtin_clz(units) : 0;
+
+	return MIN(bucket, CMD_LATENCY_BUCKETS - 1);
+}
+
+static bool valid(uint8_t device_id, enum ble_cmd_type type)
+{
+	return device_id < CONFIG_BT_MAX_CONN && (unsigned int)type < BLE_CMD_TYPE_COUNT;
+}
+
+void cmd_latency_set_peer(uint8_t device_id, const bt_addr_le_t *addr)
+{
+	if (device_id >= CONFIG_BT_MAX_CONN || !addr) {
+		return;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+
+	if (bt_addr_le_cmp(&stats[device_id].peer, addr) != 0) {
+		memset(&stats[device_id], 0, sizeof(stats[device_id]));
+		bt_addr_le_copy(&stats[device_id].peer, addr);
+	}
+
+	k_spin_unlock(&stats_lock, key);
+}
+
+void cmd_latency_record(uint8_t device_id, enum ble_cmd_type type, enum cmd_latency_phase phase,
+			uint32_t cycles)
+{
+	if (!valid(device_id, type) || phase >= CMD_LATENCY_PHASE_COUNT) {
+		return;
+	}
+
+	uint8_t bucket = bucket_of(cycles);
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+
+	counter_inc(&stats[device_id].types[type].hist[phase][bucket]);
+
+	k_spin_unlock(&stats_lock, key);
+}
+
+void cmd_latency_count_start(uint8_t device_id, enum ble_cmd_type type)
+{
+	if (!valid(device_id, type)) {
+		return;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+
+	counter_inc(&stats[device_id].types[type].counters.started);
+
+	k_spin_unlock(&stats_lock, key);
+}
+
+/* Count an error code in the first matching or free slot. Lock must be held. */
+static void count_error(struct cmd_latency_device *dev, int err)
+{
+	for (int i = 0; i < CMD_LATENCY_ERR_SLOTS; i++) {
+		struct cmd_latency_err *slot = &dev->errors[i];
+
+		if (slot->count == 0) {
+			slot->err = (int16_t)err;
+		}
+
+		if (slot->err == err) {
+			counter_inc(&slot->count);
+			return;
+		}
+	}
+
+	counter_inc(&dev->other_errors);
+}
+
+void cmd_latency_count_result(uint8_t device_id, enum ble_cmd_type type, int err)
+{
+	if (!valid(device_id, type)) {
+		return;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+	struct cmd_latency_counters *counters = &stats[device_id].types[type].counters;
+
+	switch (err) {
+	case 0:
+		counter_inc(&counters->completed);
+		break;
+	case -ETIMEDOUT:
+		counter_inc(&counters->timeouts);
+		break;
+	case -EBUSY:
+		counter_inc(&counters->busy);
+		break;
+	case -ETIME:
+		counter_inc(&counters->expired);
+		break;
+	default:
+		counter_inc(&counters->failed);
+		break;
+	}
+
+	if (err) {
+		count_error(&stats[device_id], err);
+	}
+
+	k_spin_unlock(&stats_lock, key);
+}
+
+static bool type_used(const struct cmd_latency_type_stats *t)
+{
+	static const struct cmd_latency_type_stats empty;
+
+	return memcmp(t, &empty, sizeof(empty)) != 0;
+}
+
+size_t cmd_latency_dump(void (*out)(const uint8_t *data, size_t len, void *arg), void *arg)
+{
+	uint8_t buf[1 + sizeof(struct cmd_latency_counters) +
+		    CMD_LATENCY_PHASE_COUNT * CMD_LATENCY_BUCKETS * sizeof(uint16_t)];
+	size_t total = 0;
+	uint8_t *p = buf;
+
+	sys_put_le32(CMD_LATENCY_DUMP_MAGIC, p);
+	p += 4;
+	*p++ = CMD_LATENCY_DUMP_VERSION;
+	*p++ = CMD_LATENCY_BUCKETS;
+	*p++ = CMD_LATENCY_PHASE_COUNT;
+	*p++ = CONFIG_BT_MAX_CONN;
+	sys_put_le16(CMD_LATENCY_BUCKET_BASE_US, p);
+	p += 2;
+	out(buf, p - buf, arg);
+	total += p - buf;
+
+	for (uint8_t dev = 0; dev < CONFIG_BT_MAX_CONN; dev++) {
+		struct cmd_latency_err errors[CMD_LATENCY_ERR_SLOTS];
+		bool used[BLE_CMD_TYPE_COUNT];
+		uint8_t used_count = 0;
+		bt_addr_le_t peer;
+		uint16_t other_errors;
+
+		/* Types seen now are written, even if more arrive while dumping */
+		k_spinlock_key_t key = k_spin_lock(&stats_lock);
+		peer = stats[dev].peer;
+		other_errors = stats[dev].other_errors;
+		memcpy(errors, stats[dev].errors, sizeof(errors));
+		for (int t = 0; t < BLE_CMD_TYPE_COUNT; t++) {
+			used[t] = type_used(&stats[dev].types[t]);
+			used_count += used[t];
+		}
+		k_spin_unlock(&stats_lock, key);
+
+		p = buf;
+		*p++ = peer.type;
+		memcpy(p, peer.a.val, sizeof(peer.a.val));
+		p += sizeof(peer.a.val);
+		sys_put_le16(other_errors, p);
+		p += 2;
+		out(buf, p - buf, arg);
+		total += p - buf;
+
+		for (int i = 0; i < CMD_LATENCY_ERR_SLOTS; i++) {
+			p = buf;
+			sys_put_le16((uint16_t)errors[i].err, p);
+			sys_put_le16(errors[i].count, p + 2);
+			out(buf, 4, arg);
+			total += 4;
+		}
+
+		out(&used_count, 1, arg);
+		total += 1;
+
+		for (int t = 0; t < BLE_CMD_TYPE_COUNT; t++) {
+			struct cmd_latency_type_stats copy;
+
+			if (!used[t]) {
+				continue;
+			}
+
+			key = k_spin_lock(&stats_lock);
+			copy = stats[dev].types[t];
+			k_spin_unlock(&stats_lock, key);
+
+			p = buf;
+			*p++ = t;
+			sys_put_le16(copy.counters.started, p);
+			sys_put_le16(copy.counters.completed, p + 2);
+			sys_put_le16(copy.counters.failed, p + 4);
+			sys_put_le16(copy.counters.timeouts, p + 6);
+			sys_put_le16(copy.counters.busy, p + 8);
+			sys_put_le16(copy.counters.expired, p + 10);
+			p += 12;
+			for (int ph = 0; ph < CMD_LATENCY_PHASE_COUNT; ph++) {
+				for (int b = 0; b < CMD_LATENCY_BUCKETS; b++) {
+					sys_put_le16(copy.hist[ph][b], p);
+					p += 2;
+				}
+			}
+			out(buf, p - buf, arg);
+			total += p - buf;
+		}
+	}
+
+	return total;
+}
+
+/* Upper bound in us of the bucket holding the given share of the samples,
+ * 0 if there are none. The last bucket has no upper bound and reports its
+ * lower one instead. */
+static uint32_t percentile_us(const uint16_t *hist, uint8_t percent)
+{
+	uint32_t samples = 0;
+	uint32_t seen = 0;
+
+	for (int b = 0; b < CMD_LATENCY_BUCKETS; b++) {
+		samples += hist[b];
+	}
+
+	if (samples == 0) {
+		return 0;
+	}
+
+	for (int b = 0; b < CMD_LATENCY_BUCKETS - 1; b++) {
+		seen += hist[b];
+		if (seen * 100 >= samples * percent) {
+			return (uint32_t)CMD_LATENCY_BUCKET_BASE_US << b;
+		}
+	}
+
+	return (uint32_t)CMD_LATENCY_BUCKET_BASE_US << (CMD_LATENCY_BUCKETS - 2);
+}
+
+static void cmd_latency_print(uint8_t device_id, bool histograms,
+			      void (*print)(void *arg, const char *fmt, ...), void *arg)
+{
+	struct cmd_latency_device *dev = &stats[device_id];
+	char addr_str[BT_ADDR_LE_STR_LEN];
+	bool any = false;
+
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+	bt_addr_le_t peer = dev->peer;
+	k_spin_unlock(&stats_lock, key);
+
+	bt_addr_le_to_str(&peer, addr_str, sizeof(addr_str));
+	print(arg, "Command latency [DEVICE ID %d] %s", device_id, addr_str);
+
+	for (int t = 0; t < BLE_CMD_TYPE_COUNT; t++) {
+		struct cmd_latency_type_stats copy;
+
+		key = k_spin_lock(&stats_lock);
+		copy = dev->types[t];
+		k_spin_unlock(&stats_lock, key);
+
+		if (!type_used(&copy)) {
+			continue;
+		}
+
+		const struct cmd_latency_counters *c = &copy.counters;
+		any = true;
+
+		/* Skip the "BLE_CMD_" prefix */
+		print(arg, "  %s: %u started, %u ok, %u failed, %u timeout, %u busy, %u expired",
+		      command_type_to_string(t) + 8, c->started, c->completed, c->failed,
+		      c->timeouts, c->busy, c->expired);
+
+		for (int ph = 0; ph < CMD_LATENCY_PHASE_COUNT; ph++) {
+			const uint16_t *hist = copy.hist[ph];
+			uint32_t p50 = percentile_us(hist, 50);
+
+			if (p50 == 0) {
+				continue;
+			}
+
+			/* Bucket bounds, not exact values */
+			print(arg, "    %-8s p50 %u us, p90 %u us, p99 %u us", phase_names[ph], p50,
+			      percentile_us(hist, 90), percentile_us(hist, 99));
+
+			if (histograms) {
+				print(arg, "    %5u %5u %5u %5u %5u %5u %5u %5u", hist[0], hist[1], hist[2],
+				      hist[3], hist[4], hist[5], hist[6], hist[7]);
+				print(arg, "    %5u %5u %5u %5u %5u %5u %5u %5u", hist[8], hist[9], hist[10],
+				      hist[11], hist[12], hist[13], hist[14], hist[15]);
+			}
+		}
+	}
+
+	if (!any) {
+		print(arg, "  No commands recorded");
+		return;
+	}
+
+	key = k_spin_lock(&stats_lock);
+	struct cmd_latency_err errors[CMD_LATENCY_ERR_SLOTS];
+	uint16_t other_errors = dev->other_errors;
+	memcpy(errors, dev->errors, sizeof(errors));
+	k_spin_unlock(&stats_lock, key);
+
+	for (int i = 0; i < CMD_LATENCY_ERR_SLOTS && errors[i].count; i++) {
+		print(arg, "  err %d: %u", errors[i].err, errors[i].count);
+	}
+
+	if (other_errors) {
+		print(arg, "  other errors: %u", other_errors);
+	}
+}
+
+static void cmd_latency_log_print(void *arg, const char *fmt, ...)
+{
+	ARG_UNUSED(arg);
+
+	char line[128];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintk(line, sizeof(line), fmt, args);
+	va_end(args);
+
+	LOG_INF("%s", line);
+}
+
+void cmd_latency_log_stats(void)
+{
+	for (uint8_t i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		cmd_latency_print(i, false, cmd_latency_log_print, NULL);
+	}
+}
+
+void cmd_latency_reset(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+
+	for (uint8_t i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		bt_addr_le_t peer = stats[i].peer;
+
+		memset(&stats[i], 0, sizeof(stats[i]));
+		stats[i].peer = peer;
+	}
+
+	k_spin_unlock(&stats_lock, key);
+}
+
+#if defined(CONFIG_SHELL)
+static void cmd_latency_shell_print(void *arg, const char *fmt, ...)
+{
+	const struct shell *sh = arg;
+	va_list args;
+
+	va_start(args, fmt);
+	shell_vfprintf(sh, SHELL_NORMAL, fmt, args);
+	va_end(args);
+	shell_fprintf(sh, SHELL_NORMAL, "\n");
+}
+
+static int cmd_latency_show(const struct shell *sh, size_t argc, char **argv)
+{
+	if (argc > 1) {
+		int device_id = atoi(argv[1]);
+
+		if (device_id < 0 || device_id >= CONFIG_BT_MAX_CONN) {
+			shell_error(sh, "Invalid device ID %d", device_id);
+			return -EINVAL;
+		}
+
+		cmd_latency_print(device_id, true, cmd_latency_shell_print, (void *)sh);
+		return 0;
+	}
+
+	for (uint8_t i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		cmd_latency_print(i, true, cmd_latency_shell_print, (void *)sh);
+	}
+
+	return 0;
+}
+
+/* Hex lines of 32 bytes, joined by the host tool that decodes them */
+struct hex_line {
+	const struct shell *sh;
+	uint8_t len;
+	uint8_t data[32];
+};
+
+static void hex_line_flush(struct hex_line *line)
+{
+	char hex[2 * sizeof(line->data) + 1];
+
+	if (line->len == 0) {
+		return;
+	}
+
+	bin2hex(line->data, line->len, hex, sizeof(hex));
+	shell_print(line->sh, "%s", hex);
+	line->len = 0;
+}
+
+static void hex_line_out(const uint8_t *data, size_t len, void *arg)
+{
+	struct hex_line *line = arg;
+
+	while (len--) {
+		line->data[line->len++] = *data++;
+		if (line->len == sizeof(line->data)) {
+			hex_line_flush(line);
+		}
+	}
+}
+
+static int cmd_latency_dump_hex(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	struct hex_line line = {.sh = sh};
+	size_t total = cmd_latency_dump(hex_line_out, &line);
+
+	hex_line_flush(&line);
+	shell_print(sh, "%u bytes", (unsigned int)total);
+	return 0;
+}
+
+static int cmd_latency_clear(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	cmd_latency_reset();
+	shell_print(sh, "Command latency statistics cleared");
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(cmd_latency_cmds,
+	SHELL_CMD_ARG(show, NULL, "Print counters, percentiles and histograms [device]",
+		      cmd_latency_show, 1, 1),
+	SHELL_CMD(dump, NULL, "Print the binary dump as hex", cmd_latency_dump_hex),
+	SHELL_CMD(reset, NULL, "Clear all statistics", cmd_latency_clear),
+	SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(cmd_latency, &cmd_latency_cmds, "BLE command latency statistics", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,119 @@
+/**
+ * @file cmd_latency.h
+ * @brief Per-command-type latency histograms for the BLE command queue
+ *
+ * Every command is timed in three phases: waiting in its queue, inside
+ * ble_cmd_execute() and from its start until ble_cmd_complete() or the
+ * timeout. Each phase is counted in a fixed log2 histogram per command type
+ * and device, next to counters for completions, errors, timeouts, -EBUSY
+ * starts and commands dropped from the queue. The address of the hearing aid
+ * the samples were taken from is kept with them, so dumps of several remotes
+ * can be grouped by hearing aid model and firmware afterwards.
+ *
+ * The statistics live in normal RAM and cover one power cycle; the summary is
+ * logged before System OFF.
+ */
+
+#ifndef CMD_LATENCY_H_
+#define CMD_LATENCY_H_
+
+#include "ble_manager.h"
+
+#include <zephyr/bluetooth/addr.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Histogram buckets: bucket 0 holds samples below CMD_LATENCY_BUCKET_BASE_US,
+ * bucket n those below CMD_LATENCY_BUCKET_BASE_US << n, the last one the rest */
+#define CMD_LATENCY_BUCKETS 16
+#define CMD_LATENCY_BUCKET_BASE_US 256
+
+/* Distinct error codes counted per device, further codes only in the total */
+#define CMD_LATENCY_ERR_SLOTS 8
+
+/* Binary dump format, see cmd_latency_dump() */
+#define CMD_LATENCY_DUMP_MAGIC 0x54414C43 /* "CLAT" */
+#define CMD_LATENCY_DUMP_VERSION 1
+
+enum cmd_latency_phase {
+	CMD_LATENCY_QUEUED,   /* Enqueued until started */
+	CMD_LATENCY_EXECUTE,  /* Inside ble_cmd_execute() */
+	CMD_LATENCY_RESPONSE, /* Started until completed */
+	CMD_LATENCY_PHASE_COUNT,
+};
+
+/**
+ * @brief Counters of one command type on one device
+ */
+struct cmd_latency_counters {
+	uint16_t started;
+	uint16_t completed; /* Completed with 0 */
+	uint16_t failed;    /* Completed or failed to start with another error */
+	uint16_t timeouts;  /* Safety-net timeout, -ETIMEDOUT */
+	uint16_t busy;      /* -EBUSY, retried by the owner */
+	uint16_t expired;   /* Dropped from the queue unstarted, -ETIME */
+};
+
+/**
+ * @brief Forget the samples of a device slot if another hearing aid connected to it
+ *
+ * @param device_id Device ID
+ * @param addr Address of the connected hearing aid
+ */
+void cmd_latency_set_peer(uint8_t device_id, const bt_addr_le_t *addr);
+
+/**
+ * @brief Record the duration of one phase of a command
+ *
+ * @param device_id Device ID
+ * @param type Command type
+ * @param phase Phase that ended
+ * @param cycles Duration in hardware cycles
+ */
+void cmd_latency_record(uint8_t device_id, enum ble_cmd_type type, enum cmd_latency_phase phase,
+			uint32_t cycles);
+
+/**
+ * @brief Count a command that started
+ *
+ * @param device_id Device ID
+ * @param type Command type
+ */
+void cmd_latency_count_start(uint8_t device_id, enum ble_cmd_type type);
+
+/**
+ * @brief Count how a command ended
+ *
+ * @param device_id Device ID
+ * @param type Command type
+ * @param err 0 or the error the command finished with
+ */
+void cmd_latency_count_result(uint8_t device_id, enum ble_cmd_type type, int err);
+
+/**
+ * @brief Write the statistics in the binary dump format
+ *
+ * Little-endian, packed: a header {u32 magic, u8 version, u8 buckets,
+ * u8 phases, u8 devices, u16 bucket base in us}, then per device
+ * {7 byte address, u16 other errors, CMD_LATENCY_ERR_SLOTS x {i16 err,
+ * u16 count}, u8 types} followed by that many {u8 type,
+ * struct cmd_latency_counters, phases x buckets x u16}. Only types with at
+ * least one sample or count are written.
+ *
+ * @param out Called with consecutive pieces of the dump
+ * @param arg Passed to out
+ * @return Total number of bytes written
+ */
+size_t cmd_latency_dump(void (*out)(const uint8_t *data, size_t len, void *arg), void *arg);
+
+/**
+ * @brief Log a per-type summary of both devices
+ */
+void cmd_latency_log_stats(void);
+
+/**
+ * @brief Clear all statistics
+ */
+void cmd_latency_reset(void);
+
+#endif /* CMD_LATENCY_H_ */
@@ -2,6 +2,8 @@
 #include "ble_manager.h"
 #include "devices_manager.h"
 #include "app_controller.h"
+#include "session_snapshot.h"
+#include "device_settings.h"
 
 LOG_MODULE_REGISTER(csip_coordinator, LOG_LEVEL_INF);
 
@@ -31,10 +33,20 @@ static struct rsi_scan_context {
 	.rsi_found = false,
 };
 
-int csip_cmd_discover(uint8_t device_id)
+/* Command waiting for the discovery callback (per device), 0 if none */
+static ble_cmd_handle_t discover_cmd[CONFIG_BT_MAX_CONN];
+
+int csip_cmd_discover(uint8_t device_id, ble_cmd_handle_t cmd_id)
 {
     struct device_context *ctx = &device_ctx[device_id];
-    return bt_csip_set_coordinator_discover(ctx->conn);
+
+    discover_cmd[device_id] = cmd_id;
+    int err = bt_csip_set_coordinator_discover(ctx->conn);
+    if (err) {
+        discover_cmd[device_id] = 0;
+    }
+
+    return err;
 }
 
 static void csip_discover_cb(struct bt_conn *conn, const struct bt_csip_set_coordinator_set_member *members, int err, size_t set_count)
@@ -44,7 +56,7 @@ static void csip_discover_cb(struct bt_conn *conn, const struct bt_csip_set_coor
 
     if (err) {
         LOG_ERR("CSIP Coordinator discovery failed (err %d) [DEVICE ID %d]", err, dev_ctx->device_id);
-        ble_cmd_complete(dev_ctx->device_id, err);
+        ble_cmd_complete(dev_ctx->device_id, ble_cmd_take_id(&discover_cmd[dev_ctx->device_id]), err);
         return;
     }
 
@@ -54,7 +66,8 @@ static void csip_discover_cb(struct bt_conn *conn, const struct bt_csip_set_coor
 
     if (set_count == 0 || !members) {
         LOG_WRN("No set members discovered [DEVICE ID %d]", dev_ctx->device_id);
-        ble_cmd_complete(dev_ctx->device_id, -ENODATA);
+        ble_cmd_complete(dev_ctx->device_id, ble_cmd_take_id(&discover_cmd[dev_ctx->device_id]),
+                         -ENODATA);
         return;
     }
 
@@ -96,13 +109,13 @@ static void csip_discover_cb(struct bt_conn *conn, const struct bt_csip_set_coor
             LOG_ERR("Failed to store CSIP data to settings (err %d) [DEVICE ID %d]",
                     store_err, dev_ctx->device_id);
         } else {
-            LOG_INF("CSIP data stored to flash [DEVICE ID %d]", dev_ctx->device_id);
+            LOG_INF("CSIP data queued for flash [DEVICE ID %d]", dev_ctx->device_id);
         }
     }
 
     // Notify state machine that CSIP discovery is complete
 	app_controller_notify_csip_discovered(dev_ctx->device_id, err);
-    ble_cmd_complete(dev_ctx->device_id, err);
+    ble_cmd_complete(dev_ctx->device_id, ble_cmd_take_id(&discover_cmd[dev_ctx->device_id]), err);
 }
 
 static void csip_sirk_changed_cb(struct bt_csip_set_coordinator_csis_inst *inst)
@@ -231,76 +244,24 @@ int csip_settings_store_sirk(const bt_addr_le_t *addr, const uint8_t *sirk, uint
 	char addr_str[BT_ADDR_LE_STR_LEN];
 	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
 
-	// Create settings key for SIRK: "harc/device/<addr>/sirk"
-	char key_sirk[64];
-	snprintk(key_sirk, sizeof(key_sirk), "harc/device/%s/sirk", addr_str);
-
-	// Create settings key for rank: "harc/device/<addr>/rank"
-	char key_rank[64];
-	snprintk(key_rank, sizeof(key_rank), "harc/device/%s/rank", addr_str);
-
-	int err;
-
-	// Store SIRK
-	err = settings_save_one(key_sirk, sirk, CSIP_SIRK_SIZE);
-	if (err) {
-		LOG_ERR("Failed to store SIRK for %s (err %d)", addr_str, err);
-		return err;
-	}
+	// SIRK and rank go into the per-device record in a single write
+	struct device_settings_record update = {
+		.valid = DEVICE_RECORD_CSIP,
+		.rank = rank,
+	};
+	memcpy(update.sirk, sirk, CSIP_SIRK_SIZE);
 
-	// Store rank
-	err = settings_save_one(key_rank, &rank, sizeof(rank));
+	int err = device_settings_update(addr, &update, DEVICE_RECORD_CSIP);
 	if (err) {
-		LOG_ERR("Failed to store rank for %s (err %d)", addr_str, err);
+		LOG_ERR("Failed to store CSIP info for %s (err %d)", addr_str, err);
 		return err;
 	}
+	session_snapshot_set_sirk(addr, sirk, rank);
 
 	LOG_INF("Stored CSIP info for %s: rank=%d", addr_str, rank);
 	return 0;
 }
 
-/* Context for settings load callback */
-struct csip_load_context {
-	uint8_t *sirk;
-	uint8_t *rank;
-	bool sirk_found;
-	bool rank_found;
-};
-
-/* Settings load callback for CSIP data */
-static int csip_settings_load_cb(const char *key, size_t len, settings_read_cb read_cb,
-                                   void *cb_arg, void *param)
-{
-	struct csip_load_context *ctx = (struct csip_load_context *)param;
-	const char *name;
-
-	if (!key) {
-		return 0;
-	}
-
-	// Extract the leaf name from the key (after last '/')
-	name = strrchr(key, '/');
-	if (name) {
-		name++; // Skip the '/'
-	} else {
-		name = key;
-	}
-
-	if (strcmp(name, "sirk") == 0) {
-		if (len == CSIP_SIRK_SIZE) {
-			read_cb(cb_arg, ctx->sirk, CSIP_SIRK_SIZE);
-			ctx->sirk_found = true;
-		}
-	} else if (strcmp(name, "rank") == 0) {
-		if (len == sizeof(uint8_t)) {
-			read_cb(cb_arg, ctx->rank, sizeof(uint8_t));
-			ctx->rank_found = true;
-		}
-	}
-
-	return 0;
-}
-
 /**
  * @brief Load SIRK and rank for a bonded device
  *
@@ -315,37 +276,22 @@ int csip_settings_load_sirk(const bt_addr_le_t *addr, uint8_t *sirk, uint8_t *ra
 		return -EINVAL;
 	}
 
-	char addr_str[BT_ADDR_LE_STR_LEN];
-	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
-
-	// Create settings key base for this device
-	char key_base[64];
-	snprintk(key_base, sizeof(key_base), "harc/device/%s", addr_str);
-
-	// Set up context for callback
-	struct csip_load_context ctx = {
-		.sirk = sirk,
-		.rank = rank,
-		.sirk_found = false,
-		.rank_found = false,
-	};
-
-	// Load settings for this device
-	int err = settings_load_subtree_direct(key_base, csip_settings_load_cb, &ctx);
-	if (err) {
-		LOG_DBG("Failed to load settings for %s (err %d)", addr_str, err);
-		return -ENOENT;
+	// Restored from retained RAM after System OFF - no NVS walk needed
+	if (session_snapshot_get_sirk(addr, sirk, rank) == 0) {
+		return 0;
 	}
 
-	if (!ctx.sirk_found || !ctx.rank_found) {
-		LOG_DBG("CSIP data not found for %s (SIRK: %s, rank: %s)",
-		        addr_str,
-		        ctx.sirk_found ? "yes" : "no",
-		        ctx.rank_found ? "yes" : "no");
+	struct device_settings_record record;
+	if (device_settings_load(addr, &record) != 0 || !(record.valid & DEVICE_RECORD_CSIP)) {
+		LOG_DBG("CSIP data not found");
 		return -ENOENT;
 	}
 
-	LOG_DBG("Loaded CSIP info for %s: rank=%d", addr_str, *rank);
+	memcpy(sirk, record.sirk, CSIP_SIRK_SIZE);
+	*rank = record.rank;
+
+	session_snapshot_set_sirk(addr, sirk, *rank);
+	LOG_DBG("Loaded CSIP info: rank=%d", *rank);
 	return 0;
 }
 
@@ -361,27 +307,15 @@ int csip_settings_clear_device(const bt_addr_le_t *addr)
 		return -EINVAL;
 	}
 
-	char addr_str[BT_ADDR_LE_STR_LEN];
-	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
-
-	// Create settings keys
-	char key_sirk[64];
-	char key_rank[64];
-	snprintk(key_sirk, sizeof(key_sirk), "harc/device/%s/sirk", addr_str);
-	snprintk(key_rank, sizeof(key_rank), "harc/device/%s/rank", addr_str);
-
-	// Delete settings
-	int err1 = settings_delete(key_sirk);
-	int err2 = settings_delete(key_rank);
-
-	if (err1 || err2) {
-		LOG_WRN("Failed to clear settings for %s (SIRK: %d, rank: %d)",
-		        addr_str, err1, err2);
-	} else {
-		LOG_INF("Cleared CSIP settings for %s", addr_str);
+	struct device_settings_record update = {0};
+	int err = device_settings_update(addr, &update, DEVICE_RECORD_CSIP);
+	if (err) {
+		LOG_WRN("Failed to clear CSIP settings (err %d)", err);
+		return err;
 	}
 
-	return (err1 || err2) ? -EIO : 0;
+	LOG_INF("Cleared CSIP settings");
+	return 0;
 }
 
 static bool rsi_scan_adv_parse(struct bt_data *data, void *user_data)
@@ -1,6 +1,7 @@
 #ifndef CSIP_COORDINATOR_H
 #define CSIP_COORDINATOR_H
 
+#include "ble_manager.h"
 #include <zephyr/kernel.h>
 #include <zephyr/bluetooth/bluetooth.h>
 #include <zephyr/bluetooth/conn.h>
@@ -10,7 +11,7 @@
 
 struct device_context;
 
-int csip_cmd_discover(uint8_t device_id);
+int csip_cmd_discover(uint8_t device_id, ble_cmd_handle_t cmd_id);
 
 /* Global state */
 extern bool csip_discovered;
@@ -0,0 +1,508 @@
+/**
+ * @file device_settings.c
+ * @brief Consolidated per-device record in NVS settings
+ *
+ * The whole "harc" subtree is read once by a static settings handler into a
+ * RAM table keyed by binary address, during the settings_load() in main().
+ * Lookups after that are memory reads; stores and clears update the table and
+ * queue the NVS write on the persistence worker.
+ */
+
+#include "device_settings.h"
+#include "persist_worker.h"
+
+#include <zephyr/settings/settings.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/crc.h>
+#include <stddef.h>
+#include <string.h>
+
+LOG_MODULE_REGISTER(device_settings, LOG_LEVEL_INF);
+
+#define DEVICE_RECORD_ALL (DEVICE_RECORD_CSIP | DEVICE_RECORD_VCP | DEVICE_RECORD_HAS | \
+			   DEVICE_RECORD_BAS | DEVICE_RECORD_DB_HASH)
+
+/* Version 1 record, before the Database Hash was added */
+struct device_settings_record_v1 {
+	uint8_t version;
+	uint8_t valid;
+	uint8_t sirk[CSIP_SIRK_SIZE];
+	uint8_t rank;
+	struct bt_vcp_vol_ctlr_handles vcp_handles;
+	struct has_cached_data has_cache;
+	struct bt_bas_handles bas_handles;
+	uint32_t crc;
+};
+
+/* Keys written by older firmware, one per profile */
+static const char *const legacy_keys[] = {
+	"sirk", "rank", "vcp_handles", "has_cache", "has_handles", "bas_handles",
+};
+
+struct settings_entry {
+	bt_addr_le_t addr;
+	struct device_settings_record record; /* record.valid == 0 if nothing is stored */
+	bool in_use;
+
+	/* Legacy keys seen while loading, merged into the record on commit */
+	struct device_settings_record legacy;
+	bool legacy_sirk;
+	bool legacy_rank;
+	bool legacy_found;
+};
+
+/* RAM copy of the harc/ subtree, one entry per device */
+static struct settings_entry settings_table[CONFIG_BT_MAX_PAIRED];
+static bool settings_table_loaded;
+static K_MUTEX_DEFINE(settings_table_mutex);
+
+/* Records migrated from legacy keys, persisted once the table mutex is released.
+ * A full persistence journal runs the job in the submitting thread, and the job
+ * takes the write mutex before the table mutex, so submitting with the table
+ * mutex held can deadlock against the persistence thread. */
+static bt_addr_le_t migrated[ARRAY_SIZE(settings_table)];
+static uint8_t migrated_count;
+static bool table_loading; /* ensure_table_loaded() runs under the caller's mutex */
+
+static void record_persist_job(const bt_addr_le_t *addr);
+static void submit_migrated(void);
+
+static uint32_t record_crc(const struct device_settings_record *record)
+{
+	return crc32_ieee((const uint8_t *)record, offsetof(struct device_settings_record, crc));
+}
+
+static void record_key(const bt_addr_le_t *addr, char *key, size_t len, const char *leaf)
+{
+	char addr_str[BT_ADDR_LE_STR_LEN];
+	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
+
+	snprintk(key, len, "harc/device/%s/%s", addr_str, leaf);
+}
+
+/* Find the entry of a device, optionally claiming a free one. Mutex must be held. */
+static struct settings_entry *table_get(const bt_addr_le_t *addr, bool create)
+{
+	struct settings_entry *free_entry = NULL;
+
+	for (uint8_t i = 0; i < ARRAY_SIZE(settings_table); i++) {
+		struct settings_entry *entry = &settings_table[i];
+
+		if (entry->in_use && bt_addr_le_cmp(&entry->addr, addr) == 0) {
+			return entry;
+		}
+
+		if (!entry->in_use && !free_entry) {
+			free_entry = entry;
+		}
+	}
+
+	if (!create || !free_entry) {
+		return NULL;
+	}
+
+	memset(free_entry, 0, sizeof(*free_entry));
+	bt_addr_le_copy(&free_entry->addr, addr);
+	free_entry->in_use = true;
+	return free_entry;
+}
+
+/* Parse the "<addr> (<type>)" key component written by bt_addr_le_to_str() */
+static int parse_addr(const char *name, size_t len, bt_addr_le_t *addr)
+{
+	char addr_str[BT_ADDR_LE_STR_LEN];
+
+	if (len >= sizeof(addr_str)) {
+		return -EINVAL;
+	}
+
+	memcpy(addr_str, name, len);
+	addr_str[len] = '\0';
+
+	char *type = strchr(addr_str, ' ');
+	if (!type) {
+		return -EINVAL;
+	}
+	*type++ = '\0';
+
+	return bt_addr_le_from_str(addr_str, type, addr);
+}
+
+/* Read a legacy value if it has the expected size */
+static bool read_legacy(const char *name, size_t len, size_t expected, settings_read_cb read_cb,
+			void *cb_arg, void *dst)
+{
+	if (len != expected) {
+		LOG_WRN("Invalid legacy %s size: %zu (expected %zu)", name, len, expected);
+		return false;
+	}
+
+	return read_cb(cb_arg, dst, expected) == expected;
+}
+
+/* Store one leaf of harc/device/<addr>/ in its table entry */
+static int entry_set_leaf(struct settings_entry *entry, const char *name, size_t len,
+			  settings_read_cb read_cb, void *cb_arg)
+{
+	struct device_settings_record *legacy = &entry->legacy;
+
+	if (strcmp(name, "record") == 0 && len == sizeof(struct device_settings_record_v1)) {
+		struct device_settings_record_v1 v1;
+
+		read_cb(cb_arg, &v1, sizeof(v1));
+		if (v1.version != 1 ||
+		    v1.crc != crc32_ieee((const uint8_t *)&v1, offsetof(struct device_settings_record_v1, crc))) {
+			LOG_WRN("Discarding version 1 record with bad CRC");
+			return 0;
+		}
+
+		/* Without a hash the handles are rediscovered once, the rest is kept */
+		entry->record = (struct device_settings_record){
+			.valid = v1.valid & (DEVICE_RECORD_CSIP | DEVICE_RECORD_VCP | DEVICE_RECORD_HAS |
+					     DEVICE_RECORD_BAS),
+			.rank = v1.rank,
+			.vcp_handles = v1.vcp_handles,
+			.has_cache = v1.has_cache,
+			.bas_handles = v1.bas_handles,
+		};
+		memcpy(entry->record.sirk, v1.sirk, CSIP_SIRK_SIZE);
+		entry->legacy_found = true;
+		return 0;
+	}
+
+	if (strcmp(name, "record") == 0) {
+		struct device_settings_record record;
+
+		if (len != sizeof(record)) {
+			LOG_WRN("Invalid record size: %zu (expected %zu)", len, sizeof(record));
+			return 0;
+		}
+
+		read_cb(cb_arg, &record, sizeof(record));
+		if (record.version != DEVICE_SETTINGS_RECORD_VERSION || record.crc != record_crc(&record)) {
+			LOG_WRN("Discarding record with version %u / bad CRC", record.version);
+			return 0;
+		}
+
+		entry->record = record;
+		return 0;
+	}
+
+	if (strcmp(name, "sirk") == 0) {
+		entry->legacy_sirk = read_legacy(name, len, CSIP_SIRK_SIZE, read_cb, cb_arg,
+						 legacy->sirk);
+	} else if (strcmp(name, "rank") == 0) {
+		entry->legacy_rank = read_legacy(name, len, sizeof(uint8_t), read_cb, cb_arg,
+						 &legacy->rank);
+	} else if (strcmp(name, "vcp_handles") == 0) {
+		if (read_legacy(name, len, sizeof(legacy->vcp_handles), read_cb, cb_arg,
+				&legacy->vcp_handles)) {
+			legacy->valid |= DEVICE_RECORD_VCP;
+		}
+	} else if (strcmp(name, "has_cache") == 0) {
+		if (read_legacy(name, len, sizeof(legacy->has_cache), read_cb, cb_arg,
+				&legacy->has_cache)) {
+			legacy->valid |= DEVICE_RECORD_HAS;
+		}
+	} else if (strcmp(name, "has_handles") == 0) {
+		/* Oldest format, without the features byte. has_cache wins if both exist */
+		if (!(legacy->valid & DEVICE_RECORD_HAS) &&
+		    read_legacy(name, len, sizeof(legacy->has_cache.handles), read_cb, cb_arg,
+				&legacy->has_cache.handles)) {
+			legacy->has_cache.features = 0;
+			legacy->valid |= DEVICE_RECORD_HAS;
+		}
+	} else if (strcmp(name, "bas_handles") == 0) {
+		if (read_legacy(name, len, sizeof(legacy->bas_handles), read_cb, cb_arg,
+				&legacy->bas_handles)) {
+			legacy->valid |= DEVICE_RECORD_BAS;
+		}
+	} else {
+		return 0;
+	}
+
+	entry->legacy_found = true;
+	return 0;
+}
+
+/* Settings handler for harc/, called for every key during settings_load() */
+static int device_settings_h_set(const char *name, size_t len, settings_read_cb read_cb,
+				 void *cb_arg)
+{
+	const char *next;
+	bt_addr_le_t addr;
+
+	if (!settings_name_steq(name, "device", &next) || !next) {
+		return -ENOENT;
+	}
+
+	const char *leaf;
+	int addr_len = settings_name_next(next, &leaf);
+	if (!leaf || parse_addr(next, addr_len, &addr)) {
+		LOG_WRN("Ignoring malformed key harc/%s", name);
+		return 0;
+	}
+
+	k_mutex_lock(&settings_table_mutex, K_FOREVER);
+
+	struct settings_entry *entry = table_get(&addr, true);
+	int err = 0;
+	if (entry) {
+		err = entry_set_leaf(entry, leaf, len, read_cb, cb_arg);
+	} else {
+		LOG_WRN("Settings table full - ignoring harc/%s", name);
+	}
+
+	k_mutex_unlock(&settings_table_mutex);
+	return err;
+}
+
+/* Merge legacy keys into the records once the whole subtree has been read */
+static int device_settings_h_commit(void)
+{
+	k_mutex_lock(&settings_table_mutex, K_FOREVER);
+
+	for (uint8_t i = 0; i < ARRAY_SIZE(settings_table); i++) {
+		struct settings_entry *entry = &settings_table[i];
+
+		if (!entry->in_use || !entry->legacy_found) {
+			continue;
+		}
+
+		/* SIRK and rank are only usable together */
+		if (entry->legacy_sirk && entry->legacy_rank) {
+			entry->legacy.valid |= DEVICE_RECORD_CSIP;
+		}
+
+		/* Members already in the record take precedence */
+		uint8_t members = entry->legacy.valid & ~entry->record.valid;
+
+		if (members & DEVICE_RECORD_CSIP) {
+			memcpy(entry->record.sirk, entry->legacy.sirk, CSIP_SIRK_SIZE);
+			entry->record.rank = entry->legacy.rank;
+		}
+		if (members & DEVICE_RECORD_VCP) {
+			entry->record.vcp_handles = entry->legacy.vcp_handles;
+		}
+		if (members & DEVICE_RECORD_HAS) {
+			entry->record.has_cache = entry->legacy.has_cache;
+		}
+		if (members & DEVICE_RECORD_BAS) {
+			entry->record.bas_handles = entry->legacy.bas_handles;
+		}
+		entry->record.valid |= members;
+
+		char addr_str[BT_ADDR_LE_STR_LEN];
+		bt_addr_le_to_str(&entry->addr, addr_str, sizeof(addr_str));
+		LOG_INF("Migrating legacy settings for %s into record (valid 0x%02X)", addr_str,
+			entry->record.valid);
+
+		/* Flash writes are kept out of the settings_load() path */
+		if (migrated_count < ARRAY_SIZE(migrated)) {
+			bt_addr_le_copy(&migrated[migrated_count++], &entry->addr);
+		}
+	}
+
+	settings_table_loaded = true;
+
+	k_mutex_unlock(&settings_table_mutex);
+
+	/* Under ensure_table_loaded() the caller still holds the mutex and submits */
+	if (!table_loading) {
+		submit_migrated();
+	}
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(harc, "harc", NULL, device_settings_h_set,
+			       device_settings_h_commit, NULL);
+
+static void delete_legacy_keys(const bt_addr_le_t *addr)
+{
+	char key[64];
+
+	for (size_t i = 0; i < ARRAY_SIZE(legacy_keys); i++) {
+		record_key(addr, key, sizeof(key), legacy_keys[i]);
+		settings_delete(key);
+	}
+}
+
+/* Write a record to NVS, or delete it if nothing is left */
+static int record_save(const bt_addr_le_t *addr, struct device_settings_record *record)
+{
+	char key[64];
+	int err;
+
+	record_key(addr, key, sizeof(key), "record");
+
+	if (!(record->valid & DEVICE_RECORD_ALL)) {
+		return settings_delete(key);
+	}
+
+	record->version = DEVICE_SETTINGS_RECORD_VERSION;
+	record->crc = record_crc(record);
+
+	err = settings_save_one(key, record, sizeof(*record));
+	if (err) {
+		LOG_ERR("Failed to store record at %s (err %d)", key, err);
+		return err;
+	}
+
+	LOG_DBG("Stored record at %s (valid 0x%02X)", key, record->valid);
+	return 0;
+}
+
+/* Persistence job: bring NVS in line with the RAM table for one device */
+static void record_persist_job(const bt_addr_le_t *addr)
+{
+	struct device_settings_record record = {0};
+	bool delete_legacy = true;
+
+	k_mutex_lock(&settings_table_mutex, K_FOREVER);
+
+	struct settings_entry *entry = table_get(addr, false);
+	if (entry) {
+		record = entry->record;
+		delete_legacy = entry->legacy_found;
+		entry->legacy_found = false;
+	}
+
+	k_mutex_unlock(&settings_table_mutex);
+
+	/* A cleared device has no entry; its legacy keys go along with the record */
+	if (record_save(addr, &record) == 0 && delete_legacy) {
+		delete_legacy_keys(addr);
+	}
+}
+
+/* Queue the records migrated by the commit handler. The table mutex must not
+ * be held. */
+static void submit_migrated(void)
+{
+	bt_addr_le_t addrs[ARRAY_SIZE(migrated)];
+	uint8_t count;
+
+	k_mutex_lock(&settings_table_mutex, K_FOREVER);
+	count = migrated_count;
+	memcpy(addrs, migrated, count * sizeof(addrs[0]));
+	migrated_count = 0;
+	k_mutex_unlock(&settings_table_mutex);
+
+	for (uint8_t i = 0; i < count; i++) {
+		persist_worker_submit(record_persist_job, &addrs[i]);
+	}
+}
+
+/* The table is filled by settings_load() in main(), which is skipped when the
+ * session snapshot was restored. Load just the harc subtree in that case. */
+static void ensure_table_loaded(void)
+{
+	if (settings_table_loaded) {
+		return;
+	}
+
+	table_loading = true;
+	int err = settings_load_subtree("harc");
+	table_loading = false;
+	if (err) {
+		LOG_WRN("Failed to load harc settings (err %d)", err);
+	}
+
+	settings_table_loaded = true;
+}
+
+int device_settings_load(const bt_addr_le_t *addr, struct device_settings_record *record)
+{
+	int err = -ENOENT;
+
+	if (!addr || !record) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&settings_table_mutex, K_FOREVER);
+	ensure_table_loaded();
+
+	struct settings_entry *entry = table_get(addr, false);
+	if (entry && entry->record.valid) {
+		*record = entry->record;
+		err = 0;
+	}
+
+	k_mutex_unlock(&settings_table_mutex);
+	submit_migrated();
+	return err;
+}
+
+int device_settings_update(const bt_addr_le_t *addr, const struct device_settings_record *update,
+			   uint8_t mask)
+{
+	if (!addr || !update) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&settings_table_mutex, K_FOREVER);
+	ensure_table_loaded();
+
+	struct settings_entry *entry = table_get(addr, true);
+	if (!entry) {
+		k_mutex_unlock(&settings_table_mutex);
+		submit_migrated();
+		LOG_ERR("Settings table full");
+		return -ENOMEM;
+	}
+
+	struct device_settings_record *record = &entry->record;
+
+	if (mask & DEVICE_RECORD_CSIP) {
+		memcpy(record->sirk, update->sirk, CSIP_SIRK_SIZE);
+		record->rank = update->rank;
+	}
+	if (mask & DEVICE_RECORD_VCP) {
+		record->vcp_handles = update->vcp_handles;
+	}
+	if (mask & DEVICE_RECORD_HAS) {
+		record->has_cache = update->has_cache;
+	}
+	if (mask & DEVICE_RECORD_BAS) {
+		record->bas_handles = update->bas_handles;
+	}
+	if (mask & DEVICE_RECORD_DB_HASH) {
+		memcpy(record->db_hash, update->db_hash, GATT_DB_HASH_SIZE);
+	}
+	record->valid = (record->valid & ~mask) | (update->valid & mask);
+	if (!record->valid) {
+		entry->in_use = false;
+	}
+
+	k_mutex_unlock(&settings_table_mutex);
+
+	submit_migrated();
+	persist_worker_submit(record_persist_job, addr);
+	return 0;
+}
+
+int device_settings_clear(const bt_addr_le_t *addr)
+{
+	if (!addr) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&settings_table_mutex, K_FOREVER);
+	ensure_table_loaded();
+
+	struct settings_entry *entry = table_get(addr, false);
+	if (entry) {
+		entry->in_use = false;
+	}
+
+	k_mutex_unlock(&settings_table_mutex);
+
+	submit_migrated();
+	/* Deletes the record and any legacy keys */
+	persist_worker_submit(record_persist_job, addr);
+
+	char addr_str[BT_ADDR_LE_STR_LEN];
+	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
+	LOG_INF("Cleared record of %s", addr_str);
+	return 0;
+}
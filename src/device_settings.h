@@ -0,0 +1,89 @@
+/**
+ * @file device_settings.h
+ * @brief Consolidated per-device record in NVS settings
+ *
+ * Everything cached for a hearing aid (CSIP SIRK/rank, the VCP, HAS and BAS
+ * handles and the Database Hash they were discovered with) lives in a single versioned, CRC-protected record stored at
+ * "harc/device/<addr>/record". The harc/ subtree is read into RAM once at boot
+ * by a static settings handler; loads are served from RAM and updates are
+ * written by the persistence worker with one settings_save_one(). The per-key
+ * layout used by older firmware is merged on load and migrated into the record.
+ */
+
+#ifndef DEVICE_SETTINGS_H_
+#define DEVICE_SETTINGS_H_
+
+#include "ble_manager.h"
+#include "has_settings.h"
+#include "bas_settings.h"
+
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/audio/vcp.h>
+#include <stdint.h>
+
+#define DEVICE_SETTINGS_RECORD_VERSION 2
+
+/* Size of the GATT Database Hash characteristic value */
+#define GATT_DB_HASH_SIZE 16
+
+/* Validity flags of the record members */
+#define DEVICE_RECORD_CSIP BIT(0)
+#define DEVICE_RECORD_VCP  BIT(1)
+#define DEVICE_RECORD_HAS  BIT(2)
+#define DEVICE_RECORD_BAS  BIT(3)
+#define DEVICE_RECORD_DB_HASH BIT(4)
+
+/**
+ * @brief Per-device record as stored in NVS
+ */
+struct device_settings_record {
+	uint8_t version;
+	uint8_t valid; /* DEVICE_RECORD_* flags */
+	uint8_t sirk[CSIP_SIRK_SIZE];
+	uint8_t rank;
+	struct bt_vcp_vol_ctlr_handles vcp_handles;
+	struct has_cached_data has_cache;
+	struct bt_bas_handles bas_handles;
+	uint8_t db_hash[GATT_DB_HASH_SIZE]; /* Peer Database Hash the handles belong to */
+	uint32_t crc; /* crc32_ieee over everything above, must stay last */
+};
+
+/**
+ * @brief Load the record of a device
+ *
+ * Served from the RAM copy of the harc/ subtree. If settings_load() was
+ * skipped on this boot, the subtree is loaded on first use.
+ *
+ * @param addr Bluetooth address of the device
+ * @param record Buffer for the record
+ * @return 0 on success, -ENOENT if nothing is stored, negative errno on failure
+ */
+int device_settings_load(const bt_addr_le_t *addr, struct device_settings_record *record);
+
+/**
+ * @brief Update members of the record of a device
+ *
+ * Read-modify-write: members flagged in @p mask are copied from @p update,
+ * everything else is kept. Members flagged in @p mask but not valid in
+ * @p update are cleared. The record is deleted once nothing is left in it.
+ * The RAM copy is updated immediately; the NVS write is queued.
+ *
+ * @param addr Bluetooth address of the device
+ * @param update Source of the new member values
+ * @param mask DEVICE_RECORD_* flags of the members to update
+ * @return 0 on success, negative errno on failure
+ */
+int device_settings_update(const bt_addr_le_t *addr, const struct device_settings_record *update,
+			   uint8_t mask);
+
+/**
+ * @brief Delete the record and any legacy keys of a device
+ *
+ * The RAM copy is dropped immediately; the NVS deletes are queued.
+ *
+ * @param addr Bluetooth address of the device
+ * @return 0 on success, negative errno on failure
+ */
+int device_settings_clear(const bt_addr_le_t *addr);
+
+#endif /* DEVICE_SETTINGS_H_ */
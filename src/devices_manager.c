@@ -6,6 +6,9 @@
 #include "has_settings.h"
 #include "vcp_settings.h"
 #include "bas_settings.h"
+#include "session_snapshot.h"
+#include "device_settings.h"
+#include "persist_worker.h"
 
 LOG_MODULE_REGISTER(devices_manager, LOG_LEVEL_INF);
 
@@ -142,33 +145,12 @@ void devices_manager_clear_all_bonds(void)
 	LOG_WRN("Clearing all bonds...");
 
 	for (ssize_t i = 0; i < bonded_devices->count; i++) {
-		// Erase handles from memory
-		int err = has_settings_clear_handles(&bonded_devices->devices[i].addr);
+		// Erase the cached SIRK/rank and handles (record and any legacy keys)
+		int err = device_settings_clear(&bonded_devices->devices[i].addr);
 		if (err != 0) {
-			LOG_ERR("Failed to clear HAS handles for device %d (err %d)", i, err);
+			LOG_ERR("Failed to clear settings record for device %d (err %d)", i, err);
 		} else {
-			LOG_DBG("Cleared HAS handles for device %d", i);
-		}
-
-		err = vcp_settings_clear_handles(&bonded_devices->devices[i].addr);
-		if (err != 0) {
-			LOG_ERR("Failed to clear VCP handles for device %d (err %d)", i, err);
-		} else {
-			LOG_DBG("Cleared VCP handles for device %d", i);
-		}
-
-		err = csip_settings_clear_device(&bonded_devices->devices[i].addr);
-		if (err != 0) {
-			LOG_ERR("Failed to clear CSIP device settings for device %d (err %d)", i, err);
-		} else {
-			LOG_DBG("Cleared CSIP device settings for device %d", i);
-		}
-
-		err = bas_settings_clear_handles(&bonded_devices->devices[i].addr);
-		if (err != 0) {
-			LOG_ERR("Failed to clear BAS handles for device %d (err %d)", i, err);
-		} else {
-			LOG_DBG("Cleared BAS handles for device %d", i);
+			LOG_DBG("Cleared settings record for device %d", i);
 		}
 
 		err = bt_unpair(BT_ID_DEFAULT, &bonded_devices->devices[i].addr);
@@ -179,10 +161,11 @@ void devices_manager_clear_all_bonds(void)
 		}
 	}
 
-	settings_save();
+	persist_worker_save_all();
 
 	// Erase bonds from RAM
 	memset(bonded_devices, 0, sizeof(struct bond_collection));
+	session_snapshot_invalidate();
 
 	LOG_INF("All bonds cleared");
 	app_controller_notify_bonds_cleared();
@@ -231,6 +214,7 @@ void devices_manager_update_bonded_devices_collection(void)
 	LOG_INF("Updating bonded devices collection...");
 	memset(bonded_devices, 0, sizeof(struct bond_collection));
 	enumerate_bonded_devices(bonded_devices);
+	session_snapshot_set_bonds(bonded_devices);
 	LOG_INF("Bonded devices collection updated. Total bonded devices: %d",
 		bonded_devices->count);
 }
@@ -281,6 +265,18 @@ struct device_context *devices_manager_get_device_context_by_conn(struct bt_conn
 	}
 }
 
+struct device_context *devices_manager_get_device_context_by_addr(const bt_addr_le_t *addr)
+{
+	for (uint8_t i = 0; i < 2; i++) {
+		if (bt_addr_le_cmp(&device_ctx[i].info.addr, addr) == 0) {
+			return &device_ctx[i];
+		}
+	}
+
+	LOG_DBG("No device with matching address found");
+	return NULL;
+}
+
 struct device_context *devices_manager_get_device_context_by_id(uint8_t device_id)
 {
 	if (device_id != 1 && device_id != 0) {
@@ -458,6 +454,32 @@ int devices_manager_update_scanned_device_name(const bt_addr_le_t *addr, const c
 	return -ENOENT;
 }
 
+bool devices_manager_is_scanned_device(const bt_addr_le_t *addr)
+{
+	bool found = false;
+
+	if (!addr) {
+		return false;
+	}
+
+	init_scanned_list();
+
+	k_mutex_lock(&scanned_list_mutex, K_FOREVER);
+
+	sys_snode_t *node;
+	SYS_SLIST_FOR_EACH_NODE(&scanned_devices_list, node) {
+		struct scanned_device_entry *entry = CONTAINER_OF(node, struct scanned_device_entry, node);
+
+		if (bt_addr_le_cmp(&entry->addr, addr) == 0) {
+			found = true;
+			break;
+		}
+	}
+
+	k_mutex_unlock(&scanned_list_mutex);
+	return found;
+}
+
 uint8_t devices_manager_get_scanned_device_count(void)
 {
 	init_scanned_list();
@@ -64,6 +64,18 @@ enum connection_state
     CONN_STATE_TRUSTING,
 };
 
+/* What the link actually granted, filled in by the ble_manager callbacks */
+struct device_link_info {
+    uint8_t tx_phy; /* BT_GAP_LE_PHY_* */
+    uint8_t rx_phy;
+    uint16_t tx_max_len; /* LL payload octets */
+    uint16_t rx_max_len;
+    uint16_t mtu; /* ATT MTU */
+    uint16_t interval; /* Connection interval, 1.25 ms units */
+    uint16_t latency; /* Peripheral latency, connection events */
+    int64_t encrypted_at_ms; /* Uptime when encryption was established, 0 if not yet */
+};
+
 struct device_context {
     uint8_t device_id; /* 0 = left/primary, 1 = right/secondary */
     struct bt_conn *conn; /* Zephyr connection handle */
@@ -72,7 +84,7 @@ struct device_context {
     struct bt_vcp_ctlr vcp_ctlr; /* Volume control state */
     struct bt_has_ctlr has_ctlr; /* Hearing access state */
     struct bt_bas_ctlr bas_ctlr; /* Battery service state */
-    struct ble_cmd *current_ble_cmd; /* Active command for this device */
+    struct device_link_info link; /* Negotiated PHY, data length and MTU */
 };
 
 extern struct device_context *device_ctx;  /* Holds the 2 hearing aid device contexts */
@@ -104,6 +116,13 @@ int devices_manager_add_scanned_device(const bt_addr_le_t *addr, int8_t rssi);
  * @return 0 on success, negative error code on failure
  */
 int devices_manager_update_scanned_device_name(const bt_addr_le_t *addr, const char *name);
+
+/**
+ * @brief Check whether an address is in the scanned devices list
+ * @param addr Pointer to the address
+ * @return true if the address was added by devices_manager_add_scanned_device()
+ */
+bool devices_manager_is_scanned_device(const bt_addr_le_t *addr);
 uint8_t devices_manager_get_scanned_device_count(void);
 struct scanned_device_entry *devices_manager_get_scanned_device(uint8_t idx);
 void devices_manager_clear_scanned_devices(void);
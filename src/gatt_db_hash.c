@@ -0,0 +1,119 @@
+/**
+ * @file gatt_db_hash.c
+ * @brief Validation of cached GATT handles against the peer's Database Hash
+ */
+
+#include "gatt_db_hash.h"
+#include "ble_manager.h"
+#include "devices_manager.h"
+#include "device_settings.h"
+#include "handle_cache.h"
+#include "session_snapshot.h"
+
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+LOG_MODULE_REGISTER(gatt_db_hash, LOG_LEVEL_INF);
+
+static struct bt_gatt_read_params read_params[CONFIG_BT_MAX_CONN];
+static ble_cmd_handle_t read_cmd[CONFIG_BT_MAX_CONN];
+static const struct bt_uuid_16 db_hash_uuid = BT_UUID_INIT_16(BT_UUID_GATT_DB_HASH_VAL);
+
+/* Hash the cached handles were discovered with, snapshot first */
+static int load_stored_hash(const bt_addr_le_t *addr, uint8_t *hash)
+{
+	if (session_snapshot_get_db_hash(addr, hash) == 0) {
+		return 0;
+	}
+
+	struct device_settings_record record;
+	if (device_settings_load(addr, &record) != 0 || !(record.valid & DEVICE_RECORD_DB_HASH)) {
+		return -ENOENT;
+	}
+
+	memcpy(hash, record.db_hash, GATT_DB_HASH_SIZE);
+	session_snapshot_set_db_hash(addr, hash);
+	return 0;
+}
+
+static void check_hash(struct device_context *ctx, const uint8_t *hash)
+{
+	uint8_t stored[GATT_DB_HASH_SIZE];
+
+	if (load_stored_hash(&ctx->info.addr, stored) == 0 &&
+	    memcmp(stored, hash, GATT_DB_HASH_SIZE) == 0) {
+		LOG_INF("Database Hash matches - using cached handles [DEVICE ID %d]", ctx->device_id);
+		handle_cache_set_trusted(&ctx->info.addr, true);
+		return;
+	}
+
+	LOG_WRN("Database Hash changed or unknown - rediscovering [DEVICE ID %d]", ctx->device_id);
+	LOG_HEXDUMP_DBG(hash, GATT_DB_HASH_SIZE, "Database Hash:");
+
+	handle_cache_invalidate_all(&ctx->info.addr);
+
+	struct device_settings_record update = {
+		.valid = DEVICE_RECORD_DB_HASH,
+	};
+	memcpy(update.db_hash, hash, GATT_DB_HASH_SIZE);
+	device_settings_update(&ctx->info.addr, &update, DEVICE_RECORD_DB_HASH);
+	session_snapshot_set_db_hash(&ctx->info.addr, hash);
+
+	/* The cache is empty now; what gets discovered next belongs to this hash */
+	handle_cache_set_trusted(&ctx->info.addr, true);
+}
+
+static uint8_t db_hash_read_cb(struct bt_conn *conn, uint8_t err,
+			       struct bt_gatt_read_params *params, const void *data,
+			       uint16_t length)
+{
+	struct device_context *ctx = devices_manager_get_device_context_by_conn(conn);
+	if (!ctx) {
+		return BT_GATT_ITER_STOP;
+	}
+
+	if (err || !data) {
+		LOG_WRN("Database Hash not available (err %u) - not using cached handles [DEVICE ID %d]",
+			err, ctx->device_id);
+		ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&read_cmd[ctx->device_id]), 0);
+		return BT_GATT_ITER_STOP;
+	}
+
+	if (length != GATT_DB_HASH_SIZE) {
+		LOG_WRN("Unexpected Database Hash length %u [DEVICE ID %d]", length, ctx->device_id);
+		ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&read_cmd[ctx->device_id]), 0);
+		return BT_GATT_ITER_STOP;
+	}
+
+	check_hash(ctx, data);
+	ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&read_cmd[ctx->device_id]), 0);
+	return BT_GATT_ITER_STOP;
+}
+
+int gatt_db_hash_cmd_read(uint8_t device_id, ble_cmd_handle_t cmd_id)
+{
+	struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
+	if (!ctx || !ctx->conn) {
+		return -ENOTCONN;
+	}
+
+	/* Untrusted until the hash of this connection has been checked */
+	handle_cache_set_trusted(&ctx->info.addr, false);
+
+	struct bt_gatt_read_params *params = &read_params[device_id];
+	memset(params, 0, sizeof(*params));
+	params->func = db_hash_read_cb;
+	params->handle_count = 0;
+	params->by_uuid.uuid = &db_hash_uuid.uuid;
+	params->by_uuid.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
+	params->by_uuid.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+
+	read_cmd[device_id] = cmd_id;
+	int err = bt_gatt_read(ctx->conn, params);
+	if (err) {
+		read_cmd[device_id] = 0;
+	}
+
+	return err;
+}
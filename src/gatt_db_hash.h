@@ -0,0 +1,32 @@
+/**
+ * @file gatt_db_hash.h
+ * @brief Validation of cached GATT handles against the peer's Database Hash
+ *
+ * The Database Hash characteristic (0x2B2A) is read once per connection,
+ * right after encryption and before any discovery command runs. The cached
+ * VCP, HAS and BAS handles are only used if it matches the hash stored with
+ * them. On a mismatch, or if nothing was stored, all profile caches of the
+ * device are dropped, the new hash is stored and the discoveries that follow
+ * run in full once.
+ */
+
+#ifndef GATT_DB_HASH_H_
+#define GATT_DB_HASH_H_
+
+#include "ble_manager.h"
+
+#include <stdint.h>
+
+/**
+ * @brief Read and check the Database Hash of a device (BLE_CMD_GATT_DB_HASH_READ)
+ *
+ * Always completes the command with 0: if the hash cannot be read the cache
+ * simply stays untrusted for this connection.
+ *
+ * @param device_id Device ID
+ * @param cmd_id Command completed by the read callback
+ * @return 0 if the read was started, negative errno otherwise
+ */
+int gatt_db_hash_cmd_read(uint8_t device_id, ble_cmd_handle_t cmd_id);
+
+#endif /* GATT_DB_HASH_H_ */
@@ -0,0 +1,331 @@
+/**
+ * @file handle_cache.c
+ * @brief Profile-agnostic cache of discovered GATT handles
+ */
+
+#include "handle_cache.h"
+#include "devices_manager.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+LOG_MODULE_REGISTER(handle_cache, LOG_LEVEL_INF);
+
+#define HANDLE_CACHE_PENDING_MAX (HANDLE_CACHE_PROFILE_COUNT * CONFIG_BT_MAX_PAIRED)
+
+struct pending_write {
+	bool in_use;
+	uint8_t profile;
+	bt_addr_le_t addr;
+	uint8_t data[HANDLE_CACHE_DATA_MAX];
+};
+
+static const struct handle_cache_ops *profiles[HANDLE_CACHE_PROFILE_COUNT];
+static struct handle_cache_stats stats[HANDLE_CACHE_PROFILE_COUNT];
+static struct pending_write pending[HANDLE_CACHE_PENDING_MAX];
+
+/* Devices whose cache was validated on the current connection */
+static bt_addr_le_t trusted_addrs[CONFIG_BT_MAX_CONN];
+
+/* Kept static to spare the stack of the Bluetooth RX thread */
+static struct bond_collection collection;
+static uint8_t stored[HANDLE_CACHE_DATA_MAX];
+
+static K_MUTEX_DEFINE(cache_mutex);
+
+static void flush_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(flush_work, flush_work_handler);
+
+int handle_cache_register(enum handle_cache_profile profile, const struct handle_cache_ops *ops)
+{
+	if (profile >= HANDLE_CACHE_PROFILE_COUNT || !ops || !ops->load || !ops->store ||
+	    !ops->clear) {
+		return -EINVAL;
+	}
+
+	if (ops->size > HANDLE_CACHE_DATA_MAX) {
+		LOG_ERR("%s handles too large for cache (%zu > %d)", ops->name, ops->size,
+			HANDLE_CACHE_DATA_MAX);
+		return -EINVAL;
+	}
+
+	profiles[profile] = ops;
+	return 0;
+}
+
+/* Mutex must be held */
+static bt_addr_le_t *trusted_get(const bt_addr_le_t *addr)
+{
+	for (uint8_t i = 0; i < ARRAY_SIZE(trusted_addrs); i++) {
+		if (bt_addr_le_cmp(&trusted_addrs[i], addr) == 0) {
+			return &trusted_addrs[i];
+		}
+	}
+
+	return NULL;
+}
+
+void handle_cache_set_trusted(const bt_addr_le_t *addr, bool trusted)
+{
+	k_mutex_lock(&cache_mutex, K_FOREVER);
+
+	bt_addr_le_t *slot = trusted_get(addr);
+	if (trusted && !slot) {
+		slot = trusted_get(BT_ADDR_LE_ANY);
+		if (slot) {
+			bt_addr_le_copy(slot, addr);
+		}
+	} else if (!trusted && slot) {
+		bt_addr_le_copy(slot, BT_ADDR_LE_ANY);
+	}
+
+	k_mutex_unlock(&cache_mutex);
+}
+
+/* Mutex must be held */
+static struct pending_write *pending_get(enum handle_cache_profile profile,
+					 const bt_addr_le_t *addr)
+{
+	for (uint8_t i = 0; i < ARRAY_SIZE(pending); i++) {
+		if (pending[i].in_use && pending[i].profile == profile &&
+		    bt_addr_le_cmp(&pending[i].addr, addr) == 0) {
+			return &pending[i];
+		}
+	}
+
+	return NULL;
+}
+
+int handle_cache_load(enum handle_cache_profile profile, const bt_addr_le_t *addr, void *data)
+{
+	if (profile >= HANDLE_CACHE_PROFILE_COUNT || !profiles[profile] || !addr || !data) {
+		return -EINVAL;
+	}
+
+	const struct handle_cache_ops *ops = profiles[profile];
+	int err;
+
+	k_mutex_lock(&cache_mutex, K_FOREVER);
+
+	struct pending_write *entry = pending_get(profile, addr);
+	if (!trusted_get(addr)) {
+		err = -ESTALE;
+	} else if (entry) {
+		memcpy(data, entry->data, ops->size);
+		err = 0;
+	} else {
+		err = ops->load(addr, data);
+	}
+
+	if (err == 0) {
+		stats[profile].hits++;
+	} else {
+		stats[profile].misses++;
+	}
+
+	k_mutex_unlock(&cache_mutex);
+	return err;
+}
+
+/* Queue one device unless its handles are already stored or pending. Mutex must be held. */
+static bool queue_write(enum handle_cache_profile profile, const bt_addr_le_t *addr,
+			const void *data)
+{
+	const struct handle_cache_ops *ops = profiles[profile];
+	struct pending_write *entry = pending_get(profile, addr);
+
+	if (entry) {
+		if (memcmp(entry->data, data, ops->size) == 0) {
+			stats[profile].writes_skipped++;
+			return false;
+		}
+	} else {
+		if (ops->load(addr, stored) == 0 && memcmp(stored, data, ops->size) == 0) {
+			stats[profile].writes_skipped++;
+			return false;
+		}
+
+		for (uint8_t i = 0; i < ARRAY_SIZE(pending); i++) {
+			if (!pending[i].in_use) {
+				entry = &pending[i];
+				break;
+			}
+		}
+
+		if (!entry) {
+			LOG_WRN("No free pending slot for %s handles", ops->name);
+			return false;
+		}
+
+		entry->in_use = true;
+		entry->profile = profile;
+		bt_addr_le_copy(&entry->addr, addr);
+	}
+
+	memcpy(entry->data, data, ops->size);
+	return true;
+}
+
+int handle_cache_store(enum handle_cache_profile profile, const bt_addr_le_t *addr,
+		       const void *data)
+{
+	if (profile >= HANDLE_CACHE_PROFILE_COUNT || !profiles[profile] || !addr || !data) {
+		return -EINVAL;
+	}
+
+	struct bonded_device_entry current;
+	int queued = 0;
+
+	k_mutex_lock(&cache_mutex, K_FOREVER);
+
+	if (queue_write(profile, addr, data)) {
+		queued++;
+	}
+
+	/* All hearing aids of a set run the same firmware and share the GATT
+	 * layout, so the handles are valid for the other members as well */
+	if (devices_manager_find_bonded_entry_by_addr(addr, &current) && current.is_set_member &&
+	    devices_manager_get_bonded_devices_collection(&collection) == 0) {
+		for (uint8_t i = 0; i < collection.count; i++) {
+			const struct bonded_device_entry *member = &collection.devices[i];
+
+			if (bt_addr_le_cmp(&member->addr, addr) == 0 || !member->is_set_member ||
+			    memcmp(member->sirk, current.sirk, CSIP_SIRK_SIZE) != 0) {
+				continue;
+			}
+
+			if (queue_write(profile, &member->addr, data)) {
+				queued++;
+			}
+		}
+	}
+
+	k_mutex_unlock(&cache_mutex);
+
+	if (queued) {
+		k_work_schedule(&flush_work, K_MSEC(HANDLE_CACHE_FLUSH_DELAY_MS));
+		LOG_DBG("Queued %s handles for %d device(s)", profiles[profile]->name, queued);
+	} else {
+		LOG_DBG("%s handles unchanged, nothing to store", profiles[profile]->name);
+	}
+
+	return queued;
+}
+
+int handle_cache_invalidate(enum handle_cache_profile profile, const bt_addr_le_t *addr)
+{
+	if (profile >= HANDLE_CACHE_PROFILE_COUNT || !profiles[profile] || !addr) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&cache_mutex, K_FOREVER);
+
+	struct pending_write *entry = pending_get(profile, addr);
+	if (entry) {
+		entry->in_use = false;
+	}
+
+	int err = profiles[profile]->clear(addr);
+
+	k_mutex_unlock(&cache_mutex);
+	return err;
+}
+
+void handle_cache_invalidate_all(const bt_addr_le_t *addr)
+{
+	for (uint8_t i = 0; i < HANDLE_CACHE_PROFILE_COUNT; i++) {
+		if (profiles[i]) {
+			handle_cache_invalidate(i, addr);
+		}
+	}
+}
+
+void handle_cache_flush(void)
+{
+	k_work_cancel_delayable(&flush_work);
+
+	k_mutex_lock(&cache_mutex, K_FOREVER);
+
+	for (uint8_t i = 0; i < ARRAY_SIZE(pending); i++) {
+		struct pending_write *entry = &pending[i];
+
+		if (!entry->in_use) {
+			continue;
+		}
+
+		const struct handle_cache_ops *ops = profiles[entry->profile];
+		char addr_str[BT_ADDR_LE_STR_LEN];
+		bt_addr_le_to_str(&entry->addr, addr_str, sizeof(addr_str));
+
+		int err = ops->store(&entry->addr, entry->data);
+		if (err) {
+			LOG_WRN("Failed to cache %s handles for %s (err %d)", ops->name, addr_str, err);
+		} else {
+			stats[entry->profile].writes++;
+			LOG_INF("%s handles cached for %s", ops->name, addr_str);
+		}
+
+		entry->in_use = false;
+	}
+
+	k_mutex_unlock(&cache_mutex);
+}
+
+static void flush_work_handler(struct k_work *work)
+{
+	handle_cache_flush();
+}
+
+void handle_cache_get_stats(enum handle_cache_profile profile, struct handle_cache_stats *out)
+{
+	if (profile >= HANDLE_CACHE_PROFILE_COUNT || !out) {
+		return;
+	}
+
+	k_mutex_lock(&cache_mutex, K_FOREVER);
+	*out = stats[profile];
+	k_mutex_unlock(&cache_mutex);
+}
+
+void handle_cache_log_stats(void)
+{
+	for (uint8_t i = 0; i < HANDLE_CACHE_PROFILE_COUNT; i++) {
+		struct handle_cache_stats s;
+
+		if (!profiles[i]) {
+			continue;
+		}
+
+		handle_cache_get_stats(i, &s);
+		LOG_INF("%s cache: %u hit(s), %u miss(es), %u write(s), %u skipped", profiles[i]->name,
+			s.hits, s.misses, s.writes, s.writes_skipped);
+	}
+}
+
+#if defined(CONFIG_SHELL)
+static int cmd_handle_cache(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	for (uint8_t i = 0; i < HANDLE_CACHE_PROFILE_COUNT; i++) {
+		struct handle_cache_stats s;
+
+		if (!profiles[i]) {
+			continue;
+		}
+
+		handle_cache_get_stats(i, &s);
+		shell_print(sh, "%s: %u hit(s), %u miss(es), %u write(s), %u skipped",
+			    profiles[i]->name, s.hits, s.misses, s.writes, s.writes_skipped);
+	}
+
+	return 0;
+}
+
+SHELL_CMD_REGISTER(handle_cache, NULL, "Print GATT handle cache counters", cmd_handle_cache);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,139 @@
+/**
+ * @file handle_cache.h
+ * @brief Profile-agnostic cache of discovered GATT handles
+ *
+ * Each profile (VCP, HAS, BAS) registers load/store/clear operations for its
+ * handle struct. Discovered handles are handed to handle_cache_store() from
+ * the discovery callback; the cache skips writes whose contents are already
+ * stored, fans the handles out to the other members of the same CSIP set and
+ * writes everything in one deferred flush outside the Bluetooth RX context.
+ *
+ * Loads are only served for devices marked trusted with
+ * handle_cache_set_trusted(), i.e. once the peer's Database Hash has been
+ * checked on the current connection.
+ */
+
+#ifndef HANDLE_CACHE_H_
+#define HANDLE_CACHE_H_
+
+#include <zephyr/bluetooth/bluetooth.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Largest handle struct a profile can register */
+#define HANDLE_CACHE_DATA_MAX 48
+
+/* Delay before pending writes are flushed, so both set members land in one batch */
+#define HANDLE_CACHE_FLUSH_DELAY_MS 500
+
+enum handle_cache_profile {
+	HANDLE_CACHE_VCP,
+	HANDLE_CACHE_HAS,
+	HANDLE_CACHE_BAS,
+	HANDLE_CACHE_PROFILE_COUNT,
+};
+
+/**
+ * @brief Persistence operations of a profile
+ */
+struct handle_cache_ops {
+	const char *name;
+	size_t size; /* Size of the profile's handle struct */
+	int (*load)(const bt_addr_le_t *addr, void *data);
+	int (*store)(const bt_addr_le_t *addr, const void *data);
+	int (*clear)(const bt_addr_le_t *addr);
+};
+
+/**
+ * @brief Per-profile cache counters
+ */
+struct handle_cache_stats {
+	uint32_t hits;           /* Loads served from the cache */
+	uint32_t misses;         /* Loads that required a full discovery */
+	uint32_t writes;         /* Records written by a flush */
+	uint32_t writes_skipped; /* Stores dropped because nothing changed */
+};
+
+/**
+ * @brief Register the persistence operations of a profile
+ *
+ * @param profile Profile to register
+ * @param ops Operations, must stay valid for the lifetime of the cache
+ * @return 0 on success, -EINVAL if the handle struct is too large
+ */
+int handle_cache_register(enum handle_cache_profile profile, const struct handle_cache_ops *ops);
+
+/**
+ * @brief Load the cached handles of a device
+ *
+ * Pending (not yet flushed) handles are returned before stored ones.
+ *
+ * @param profile Profile of the handles
+ * @param addr Bluetooth address of the device
+ * @param data Buffer of the profile's handle struct
+ * @return 0 on a hit, -ENOENT on a miss, -ESTALE if the device is not trusted,
+ *         negative errno on failure
+ */
+int handle_cache_load(enum handle_cache_profile profile, const bt_addr_le_t *addr, void *data);
+
+/**
+ * @brief Queue discovered handles for a device and its set members
+ *
+ * Safe to call from Bluetooth callbacks: nothing is written here. Devices
+ * whose stored handles already match are skipped; the rest are written by a
+ * flush HANDLE_CACHE_FLUSH_DELAY_MS later.
+ *
+ * @param profile Profile of the handles
+ * @param addr Bluetooth address of the discovered device
+ * @param data The profile's handle struct
+ * @return Number of devices queued for writing, negative errno on failure
+ */
+int handle_cache_store(enum handle_cache_profile profile, const bt_addr_le_t *addr,
+		       const void *data);
+
+/**
+ * @brief Drop cached handles of a device (e.g. after a failed injection)
+ *
+ * @param profile Profile of the handles
+ * @param addr Bluetooth address of the device
+ * @return 0 on success, negative errno on failure
+ */
+int handle_cache_invalidate(enum handle_cache_profile profile, const bt_addr_le_t *addr);
+
+/**
+ * @brief Drop the cached handles of every profile for a device
+ *
+ * @param addr Bluetooth address of the device
+ */
+void handle_cache_invalidate_all(const bt_addr_le_t *addr);
+
+/**
+ * @brief Allow or stop serving cached handles for a device
+ *
+ * @param addr Bluetooth address of the device
+ * @param trusted true once the cache has been validated for the current connection
+ */
+void handle_cache_set_trusted(const bt_addr_le_t *addr, bool trusted);
+
+/**
+ * @brief Write all pending handles now
+ *
+ * Called before power off so no queued write is lost.
+ */
+void handle_cache_flush(void);
+
+/**
+ * @brief Get the counters of a profile
+ *
+ * @param profile Profile to query
+ * @param stats Buffer for the counters
+ */
+void handle_cache_get_stats(enum handle_cache_profile profile, struct handle_cache_stats *stats);
+
+/**
+ * @brief Log the counters of all registered profiles
+ */
+void handle_cache_log_stats(void);
+
+#endif /* HANDLE_CACHE_H_ */
@@ -1,15 +1,36 @@
 #include "has_controller.h"
 #include "has_settings.h"
+#include "handle_cache.h"
 #include "devices_manager.h"
 #include "ble_manager.h"
 #include "app_controller.h"
 #include "display_manager.h"
+#include "wake_trace.h"
+#include "session_snapshot.h"
+#include "state_reconciler.h"
 
 LOG_MODULE_REGISTER(has_controller, LOG_LEVEL_DBG);
 
 /* Track whether handles were loaded from cache (per device) - skip re-storing if true */
 static bool handles_from_cache[CONFIG_BT_MAX_CONN];
 
+/* Command waiting for each kind of callback (per device), 0 if none.
+ * A preset switch without a waiting command is a notification. */
+static ble_cmd_handle_t discover_cmd[CONFIG_BT_MAX_CONN];
+static ble_cmd_handle_t read_presets_cmd[CONFIG_BT_MAX_CONN];
+static ble_cmd_handle_t switch_cmd[CONFIG_BT_MAX_CONN];
+
+/* Forget the command again if its operation could not be started. The slot is
+ * filled before starting, as callbacks may run before the call returns. */
+static int cmd_started(ble_cmd_handle_t *slot, int err)
+{
+    if (err) {
+        *slot = 0;
+    }
+
+    return err;
+}
+
 /* Forward declarations */
 static void has_discover_cb(struct bt_conn *conn, int err, struct bt_has *has,
                            enum bt_has_hearing_aid_type type,
@@ -43,7 +64,8 @@ static void has_discover_cb(struct bt_conn *conn, int err, struct bt_has *has,
     if (err || !has) {
         LOG_ERR("HAS discovery failed (err %d) [DEVICE ID %d]", err, ctx->device_id);
         app_controller_notify_has_discovered(ctx->device_id, err ? err : -ENOENT);
-        ble_cmd_complete(ctx->device_id, err ? err : -ENOENT);
+        ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&discover_cmd[ctx->device_id]),
+                         err ? err : -ENOENT);
         return;
     }
 
@@ -54,6 +76,7 @@ static void has_discover_cb(struct bt_conn *conn, int err, struct bt_has *has,
     LOG_DBG("is_new_device: %d [DEVICE ID %d]", ctx->info.is_new_device, ctx->device_id);
     ctx->info.has_discovered = true;
     ctx->has_ctlr.has = has;
+    wake_trace_record(WAKE_TRACE_HAS_DISCOVERED, ctx->device_id);
 
     /* Only extract and cache handles if they weren't loaded from cache.
      * This avoids unnecessary stack usage from settings operations when
@@ -78,50 +101,12 @@ static void has_discover_cb(struct bt_conn *conn, int err, struct bt_has *has,
                 features |= 0x04; /* BT_HAS_FEAT_PRESET_SYNC_SUPP */
             }
 
-            /* Store handles for the current device */
-            cache_err = has_settings_store_handles(&ctx->info.addr, &handles, features);
-            if (cache_err == 0) {
-                LOG_INF("HAS handles and features cached to NVS for current device (features=0x%02X)", features);
-            } else {
-                LOG_WRN("Failed to cache HAS data for current device (err %d)", cache_err);
-            }
-
-            /**
-             * Store handles for all other set members
-             */
-            // LOG_DBG("is_new_device: %d [DEVICE ID %d]", ctx->info.is_new_device, ctx->device_id);
-            // if (ctx->info.is_new_device) {
-                struct bond_collection collection;
-                if (devices_manager_get_bonded_devices_collection(&collection) == 0) {
-                    struct bonded_device_entry current_entry;
-                    if (devices_manager_find_bonded_entry_by_addr(&ctx->info.addr, &current_entry) &&
-                        current_entry.is_set_member) {
-
-                        LOG_DBG("Current device is CSIP set member, caching HAS handles for all set members");
-
-                        for (uint8_t i = 0; i < collection.count; i++) {
-                            /* Skip the current device (already stored) */
-                            if (bt_addr_le_cmp(&collection.devices[i].addr, &ctx->info.addr) == 0) {
-                                continue;
-                            }
-
-                            /* Only store for devices in the same CSIP set */
-                            if (collection.devices[i].is_set_member &&
-                                memcmp(collection.devices[i].sirk, current_entry.sirk, CSIP_SIRK_SIZE) == 0) {
-
-                                int err = has_settings_store_handles(&collection.devices[i].addr, &handles, features);
-                                if (err == 0) {
-                                    char addr_str[BT_ADDR_LE_STR_LEN];
-                                    bt_addr_le_to_str(&collection.devices[i].addr, addr_str, sizeof(addr_str));
-                                    LOG_INF("HAS handles also cached for set member: %s", addr_str);
-                                } else {
-                                    LOG_WRN("Failed to cache HAS handles for set member (err %d)", err);
-                                }
-                            }
-                        }
-                    }
-                }
-            // }
+            /* Queued for this device and its set members, written outside the RX context */
+            struct has_cached_data cached_data = {
+                .handles = handles,
+                .features = features,
+            };
+            handle_cache_store(HANDLE_CACHE_HAS, &ctx->info.addr, &cached_data);
         } else {
             LOG_WRN("Failed to extract HAS handles (err %d)", cache_err);
         }
@@ -130,7 +115,7 @@ static void has_discover_cb(struct bt_conn *conn, int err, struct bt_has *has,
     }
 
     app_controller_notify_has_discovered(ctx->device_id, 0);
-    ble_cmd_complete(ctx->device_id, 0);
+    ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&discover_cmd[ctx->device_id]), 0);
 }
 
 /**
@@ -149,13 +134,13 @@ static void has_preset_read_rsp_cb(struct bt_has *has, int err,
 
     if (err) {
         LOG_ERR("Preset read failed (err %d) [DEVICE ID %d]", err, ctx->device_id);
-        ble_cmd_complete(ctx->device_id, err);
+        ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&read_presets_cmd[ctx->device_id]), err);
         return;
     }
 
     if (!record) {
         LOG_DBG("No more presets to read [DEVICE ID %d]", ctx->device_id);
-        ble_cmd_complete(ctx->device_id, err);
+        ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&read_presets_cmd[ctx->device_id]), err);
         return;
     }
 
@@ -187,30 +172,20 @@ static void has_preset_read_rsp_cb(struct bt_has *has, int err,
     if (is_last) {
         LOG_DBG("Preset read complete, total: %u", ctx->has_ctlr.preset_count);
         app_controller_notify_has_presets_read(ctx->device_id, 0);
-        ble_cmd_complete(ctx->device_id, 0);
+        ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&read_presets_cmd[ctx->device_id]), 0);
         ctx->has_ctlr.presets_read = true;
     }
 }
 
 /**
- * @brief Preset switch callback - called when preset is changed
+ * @brief Store the active preset index read from the device and update the display
  */
-static void has_preset_switch_cb(struct bt_has *has, int err, uint8_t index)
+void has_controller_apply_active_preset(uint8_t device_id, uint8_t index)
 {
-    struct device_context *ctx = get_device_context_by_has(has);
-
-    if (!ctx) {
-        LOG_ERR("Preset switch callback from unknown connection");
-        return;
-    }
-
-    if (err) {
-        LOG_ERR("Preset switch failed (err %d)", err);
-        ble_cmd_complete(ctx->device_id, err);
-        return;
-    }
+    struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
 
     ctx->has_ctlr.active_preset_index = index;
+    session_snapshot_set_preset(&ctx->info.addr, index);
 
     // Find preset name for better logging
     char *preset_name = "Unknown";
@@ -224,22 +199,44 @@ static void has_preset_switch_cb(struct bt_has *has, int err, uint8_t index)
     /* Update display with new preset */
     display_manager_update_preset(ctx->device_id, index, preset_name);
 
-    if (ctx->current_ble_cmd && ctx->current_ble_cmd->type) {
-        LOG_DBG("ctx->current_ble_cmd->type=%d", ctx->current_ble_cmd->type);
-            if (ctx->current_ble_cmd->type == BLE_CMD_HAS_NEXT_PRESET ||
-                ctx->current_ble_cmd->type == BLE_CMD_HAS_PREV_PRESET ||
-                ctx->current_ble_cmd->type == BLE_CMD_HAS_SET_PRESET)
-                ble_cmd_complete(ctx->device_id, 0);
+    LOG_INF("Active preset changed to %u: '%s' [DEVICE ID %d]", index, preset_name, ctx->device_id);
+
+    state_reconciler_preset_changed(ctx->device_id);
+}
+
+/**
+ * @brief Preset switch callback - called when preset is changed
+ */
+static void has_preset_switch_cb(struct bt_has *has, int err, uint8_t index)
+{
+    struct device_context *ctx = get_device_context_by_has(has);
+
+    if (!ctx) {
+        LOG_ERR("Preset switch callback from unknown connection");
+        return;
+    }
+
+    if (err) {
+        LOG_ERR("Preset switch failed (err %d)", err);
+        ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&switch_cmd[ctx->device_id]), err);
+        return;
+    }
+
+    has_controller_apply_active_preset(ctx->device_id, index);
+
+    // Complete the set/next/prev command waiting for this switch, if any
+    ble_cmd_handle_t cmd_id = ble_cmd_take_id(&switch_cmd[ctx->device_id]);
+    if (cmd_id) {
+        ble_cmd_complete(ctx->device_id, cmd_id, 0);
     } else {
-        LOG_DBG("ctx->current_ble_cmd->type is NULL");
+        LOG_DBG("Preset switch notification [DEVICE ID %d]", ctx->device_id);
     }
-    LOG_INF("Active preset changed to %u: '%s' [DEVICE ID %d]", index, preset_name, ctx->device_id);
 }
 
 /**
  * @brief Command: Discover HAS on connected device
  */
-int has_cmd_discover(uint8_t device_id)
+int has_cmd_discover(uint8_t device_id, ble_cmd_handle_t cmd_id)
 {
     struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
 
@@ -258,7 +255,7 @@ int has_cmd_discover(uint8_t device_id)
 
     /* Try to load cached handles and features from NVS */
     struct has_cached_data cached_data;
-    int load_err = has_settings_load_handles(&ctx->info.addr, &cached_data);
+    int load_err = handle_cache_load(HANDLE_CACHE_HAS, &ctx->info.addr, &cached_data);
 
     if (load_err == 0) {
         LOG_INF("Found cached HAS data, attempting to restore");
@@ -272,7 +269,7 @@ int has_cmd_discover(uint8_t device_id)
         if (inject_err != 0) {
             LOG_WRN("Failed to inject cached handles (err %d), will perform full discovery", inject_err);
             /* Clear invalid cache */
-            has_settings_clear_handles(&ctx->info.addr);
+            handle_cache_invalidate(HANDLE_CACHE_HAS, &ctx->info.addr);
         } else {
             LOG_INF("Cached handles restored successfully");
             handles_from_cache[device_id] = true;
@@ -283,13 +280,14 @@ int has_cmd_discover(uint8_t device_id)
 
     /* Start discovery - will skip GATT discovery if handles were injected successfully */
     LOG_DBG("Starting HAS discovery [DEVICE ID %d]", ctx->device_id);
-    return bt_has_client_discover(ctx->conn);
+    discover_cmd[device_id] = cmd_id;
+    return cmd_started(&discover_cmd[device_id], bt_has_client_discover(ctx->conn));
 }
 
 /**
  * @brief Command: Read all presets
  */
-int has_cmd_read_presets(uint8_t device_id)
+int has_cmd_read_presets(uint8_t device_id, ble_cmd_handle_t cmd_id)
 {
     struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
 
@@ -305,15 +303,17 @@ int has_cmd_read_presets(uint8_t device_id)
     memset(ctx->has_ctlr.presets, 0, sizeof(ctx->has_ctlr.presets));
 
     // Read starting from first preset - callback will be called for each
-    return bt_has_client_presets_read(ctx->has_ctlr.has,
-                                      BT_HAS_PRESET_INDEX_FIRST,
-                                      HAS_MAX_PRESETS);
+    read_presets_cmd[device_id] = cmd_id;
+    return cmd_started(&read_presets_cmd[device_id],
+                       bt_has_client_presets_read(ctx->has_ctlr.has,
+                                                  BT_HAS_PRESET_INDEX_FIRST,
+                                                  HAS_MAX_PRESETS));
 }
 
 /**
  * @brief Command: Set active preset
  */
-int has_cmd_set_active_preset(uint8_t device_id, uint8_t index)
+int has_cmd_set_active_preset(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t index)
 {
     struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
     if (!ctx) {
@@ -342,13 +342,15 @@ int has_cmd_set_active_preset(uint8_t device_id, uint8_t index)
     LOG_DBG("Setting active preset to %u [DEVICE ID %d]", index, ctx->device_id);
     /* Use sync=false to avoid EOPNOTSUPP error when features aren't populated.
      * The hearing aid will handle synchronization automatically. */
-    return bt_has_client_preset_set(ctx->has_ctlr.has, index, false);
+    switch_cmd[device_id] = cmd_id;
+    return cmd_started(&switch_cmd[device_id],
+                       bt_has_client_preset_set(ctx->has_ctlr.has, index, false));
 }
 
 /**
  * @brief Command: Activate next preset
  */
-int has_cmd_next_preset(uint8_t device_id)
+int has_cmd_next_preset(uint8_t device_id, ble_cmd_handle_t cmd_id)
 {
     struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
     if (!ctx) {
@@ -368,13 +370,14 @@ int has_cmd_next_preset(uint8_t device_id)
     LOG_DBG("Activating next preset [DEVICE ID %d]", device_id);
     /* Use sync=false to avoid EOPNOTSUPP error when features aren't populated.
      * The hearing aid will handle synchronization automatically. */
-    return bt_has_client_preset_next(ctx->has_ctlr.has, false);
+    switch_cmd[device_id] = cmd_id;
+    return cmd_started(&switch_cmd[device_id], bt_has_client_preset_next(ctx->has_ctlr.has, false));
 }
 
 /**
  * @brief Command: Activate previous preset
  */
-int has_cmd_prev_preset(uint8_t device_id)
+int has_cmd_prev_preset(uint8_t device_id, ble_cmd_handle_t cmd_id)
 {
     struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
     
@@ -391,7 +394,8 @@ int has_cmd_prev_preset(uint8_t device_id)
     LOG_DBG("Activating previous preset [DEVICE ID %d]", device_id);
     /* Use sync=false to avoid EOPNOTSUPP error when features aren't populated.
      * The hearing aid will handle synchronization automatically. */
-    return bt_has_client_preset_prev(ctx->has_ctlr.has, false);
+    switch_cmd[device_id] = cmd_id;
+    return cmd_started(&switch_cmd[device_id], bt_has_client_preset_prev(ctx->has_ctlr.has, false));
 }
 
 /**
@@ -435,6 +439,26 @@ int has_get_active_preset(uint8_t device_id)
     return ctx->has_ctlr.active_preset_index;
 }
 
+static int has_cache_load(const bt_addr_le_t *addr, void *data)
+{
+    return has_settings_load_handles(addr, data);
+}
+
+static int has_cache_store(const bt_addr_le_t *addr, const void *data)
+{
+    const struct has_cached_data *cached_data = data;
+
+    return has_settings_store_handles(addr, &cached_data->handles, cached_data->features);
+}
+
+static const struct handle_cache_ops has_cache_ops = {
+    .name = "HAS",
+    .size = sizeof(struct has_cached_data),
+    .load = has_cache_load,
+    .store = has_cache_store,
+    .clear = has_settings_clear_handles,
+};
+
 /**
  * @brief Initialize HAS controller
  */
@@ -442,6 +466,12 @@ int has_controller_init(void)
 {
     int err;
 
+    err = handle_cache_register(HANDLE_CACHE_HAS, &has_cache_ops);
+    if (err) {
+        LOG_ERR("Failed to register HAS handle cache (err %d)", err);
+        return err;
+    }
+
     err = bt_has_client_cb_register(&has_callbacks);
     if (err) {
         LOG_ERR("Failed to register HAS callbacks (err %d)", err);
@@ -20,38 +20,43 @@ int has_controller_init(void);
 /**
  * @brief Discover HAS on connected device (called from command queue)
  * 
+ * @param cmd_id Command completed by the discovery callback
  * @return 0 on success, negative error code on failure
  */
-int has_cmd_discover(uint8_t device_id);
+int has_cmd_discover(uint8_t device_id, ble_cmd_handle_t cmd_id);
 
 /**
  * @brief Read all presets from the hearing aid
  * 
+ * @param cmd_id Command completed after the last preset
  * @return 0 on success, negative error code on failure
  */
-int has_cmd_read_presets(uint8_t device_id);
+int has_cmd_read_presets(uint8_t device_id, ble_cmd_handle_t cmd_id);
 
 /**
  * @brief Set active preset by index
  * 
+ * @param cmd_id Command completed by the preset switch
  * @param index Preset index to activate
  * @return 0 on success, negative error code on failure
  */
-int has_cmd_set_active_preset(uint8_t device_id, uint8_t index);
+int has_cmd_set_active_preset(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t index);
 
 /**
  * @brief Activate next preset
  * 
+ * @param cmd_id Command completed by the preset switch
  * @return 0 on success, negative error code on failure
  */
-int has_cmd_next_preset(uint8_t device_id);
+int has_cmd_next_preset(uint8_t device_id, ble_cmd_handle_t cmd_id);
 
 /**
  * @brief Activate previous preset
  * 
+ * @param cmd_id Command completed by the preset switch
  * @return 0 on success, negative error code on failure
  */
-int has_cmd_prev_preset(uint8_t device_id);
+int has_cmd_prev_preset(uint8_t device_id, ble_cmd_handle_t cmd_id);
 
 /**
  * @brief Get information about a specific preset
@@ -69,6 +74,16 @@ int has_get_preset_info(uint8_t device_id,uint8_t index, struct has_preset_info
  */
 int has_get_active_preset(uint8_t device_id);
 
+/**
+ * @brief Store the active preset index read from the device and update the display
+ *
+ * Shared by the preset switch callback and the wake snapshot.
+ *
+ * @param device_id Device ID
+ * @param index Active preset index
+ */
+void has_controller_apply_active_preset(uint8_t device_id, uint8_t index);
+
 /**
  * @brief Reset HAS controller state
  */
@@ -8,9 +8,49 @@
 #include "display_manager.h"
 #include "power_manager.h"
 #include "button_manager.h"
+#include "wake_trace.h"
+#include "session_snapshot.h"
+
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/iterable_sections.h>
+#include <string.h>
 
 LOG_MODULE_REGISTER(main, LOG_LEVEL_INF);
 
+/* Settings subtrees a snapshot wake does not load up front: "bt" is loaded in
+ * bt_ready_cb() and "harc" by device_settings on first use, with the snapshot
+ * answering most lookups before that. Every other subtree is still loaded. */
+static const char *const snapshot_skipped_subtrees[] = {"bt", "harc"};
+
+static bool subtree_skipped(const char *name)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(snapshot_skipped_subtrees); i++) {
+        size_t len = strlen(snapshot_skipped_subtrees[i]);
+
+        if (strncmp(name, snapshot_skipped_subtrees[i], len) == 0 &&
+            (name[len] == '\0' || name[len] == '/')) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Load the subtrees of all statically registered handlers that are not skipped */
+static void load_unskipped_subtrees(void)
+{
+    STRUCT_SECTION_FOREACH(settings_handler_static, ch) {
+        if (subtree_skipped(ch->name)) {
+            continue;
+        }
+
+        int err = settings_load_subtree(ch->name);
+        if (err) {
+            LOG_ERR("Settings load of %s failed (err %d)", ch->name, err);
+        }
+    }
+}
+
 int main(void)
 {
     int err;
@@ -19,6 +59,9 @@ int main(void)
         err = settings_subsys_init();
         if (err) {
             LOG_ERR("Settings init failed (err %d)", err);
+        } else if (session_snapshot_restored()) {
+            LOG_INF("Woke from System OFF - using session snapshot for the bt and harc settings");
+            load_unskipped_subtrees();
         } else {
             err = settings_load();
             if (err) {
@@ -26,6 +69,7 @@ int main(void)
             }
         }
     }
+    wake_trace_record(WAKE_TRACE_SETTINGS_LOADED, WAKE_TRACE_NO_DEVICE);
 
     err = display_manager_init();
     if (err) {
@@ -59,6 +103,7 @@ int main(void)
     }
 
     /* Initialize Bluetooth */
+    wake_trace_record(WAKE_TRACE_BT_ENABLE, WAKE_TRACE_NO_DEVICE);
     err = bt_enable(bt_ready_cb);
 
     while (1) {
@@ -0,0 +1,156 @@
+/**
+ * @file persist_worker.c
+ * @brief Low-priority thread that performs flash writes for other modules
+ */
+
+#include "persist_worker.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(persist_worker, LOG_LEVEL_INF);
+
+#define PERSIST_WORKER_STACK_SIZE 1536
+
+struct persist_entry {
+	persist_job_t job;
+	bt_addr_le_t addr;
+};
+
+static struct persist_entry journal[PERSIST_JOURNAL_SIZE];
+static uint8_t journal_head;
+static uint8_t journal_count;
+static struct persist_worker_stats stats;
+
+/* Protects the journal and the counters */
+static K_MUTEX_DEFINE(journal_mutex);
+/* Held from taking an entry out of the journal until it is written */
+static K_MUTEX_DEFINE(write_mutex);
+static K_SEM_DEFINE(journal_sem, 0, PERSIST_JOURNAL_SIZE);
+
+static bool journal_pop(struct persist_entry *out)
+{
+	bool found = false;
+
+	k_mutex_lock(&journal_mutex, K_FOREVER);
+
+	if (journal_count > 0) {
+		*out = journal[journal_head];
+		journal_head = (journal_head + 1) % PERSIST_JOURNAL_SIZE;
+		journal_count--;
+		found = true;
+	}
+
+	k_mutex_unlock(&journal_mutex);
+	return found;
+}
+
+static void run_job(const struct persist_entry *entry)
+{
+	entry->job(&entry->addr);
+
+	k_mutex_lock(&journal_mutex, K_FOREVER);
+	stats.written++;
+	k_mutex_unlock(&journal_mutex);
+}
+
+void persist_worker_submit(persist_job_t job, const bt_addr_le_t *addr)
+{
+	struct persist_entry entry = {
+		.job = job,
+	};
+
+	bt_addr_le_copy(&entry.addr, addr ? addr : BT_ADDR_LE_ANY);
+
+	k_mutex_lock(&journal_mutex, K_FOREVER);
+
+	/* Jobs write the current RAM state, so a queued duplicate covers this one */
+	for (uint8_t i = 0; i < journal_count; i++) {
+		const struct persist_entry *queued = &journal[(journal_head + i) % PERSIST_JOURNAL_SIZE];
+
+		if (queued->job == job && bt_addr_le_cmp(&queued->addr, &entry.addr) == 0) {
+			stats.coalesced++;
+			k_mutex_unlock(&journal_mutex);
+			return;
+		}
+	}
+
+	if (journal_count == PERSIST_JOURNAL_SIZE) {
+		stats.overflows++;
+		k_mutex_unlock(&journal_mutex);
+
+		LOG_WRN("Persistence journal full - writing synchronously");
+		k_mutex_lock(&write_mutex, K_FOREVER);
+		run_job(&entry);
+		k_mutex_unlock(&write_mutex);
+		return;
+	}
+
+	journal[(journal_head + journal_count) % PERSIST_JOURNAL_SIZE] = entry;
+	journal_count++;
+	stats.queued++;
+
+	k_mutex_unlock(&journal_mutex);
+	k_sem_give(&journal_sem);
+}
+
+static void save_all_job(const bt_addr_le_t *addr)
+{
+	ARG_UNUSED(addr);
+
+	int err = settings_save();
+	if (err) {
+		LOG_ERR("settings_save() failed (err %d)", err);
+	}
+}
+
+void persist_worker_save_all(void)
+{
+	persist_worker_submit(save_all_job, NULL);
+}
+
+void persist_worker_flush(void)
+{
+	struct persist_entry entry;
+	uint8_t count = 0;
+
+	k_mutex_lock(&write_mutex, K_FOREVER);
+
+	while (journal_pop(&entry)) {
+		run_job(&entry);
+		count++;
+	}
+
+	k_mutex_unlock(&write_mutex);
+
+	if (count) {
+		LOG_INF("Flushed %u pending write(s)", count);
+	}
+}
+
+void persist_worker_get_stats(struct persist_worker_stats *out)
+{
+	k_mutex_lock(&journal_mutex, K_FOREVER);
+	*out = stats;
+	k_mutex_unlock(&journal_mutex);
+}
+
+static void persist_worker_thread(void)
+{
+	struct persist_entry entry;
+
+	while (1) {
+		k_sem_take(&journal_sem, K_FOREVER);
+
+		/* The entry may already have been written by a flush */
+		k_mutex_lock(&write_mutex, K_FOREVER);
+		if (journal_pop(&entry)) {
+			run_job(&entry);
+		}
+		k_mutex_unlock(&write_mutex);
+	}
+}
+
+K_THREAD_DEFINE(persist_worker_thread_id, PERSIST_WORKER_STACK_SIZE, persist_worker_thread, NULL,
+		NULL, NULL, K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
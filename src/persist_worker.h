@@ -0,0 +1,68 @@
+/**
+ * @file persist_worker.h
+ * @brief Low-priority thread that performs flash writes for other modules
+ *
+ * Flash writes (and the NVS sector erases they can trigger) are moved off the
+ * Bluetooth RX path: callers update their RAM state, enqueue a write job in a
+ * bounded journal and return. A job is a function plus the address it applies
+ * to, and it writes whatever is current in RAM when it runs, so queuing the
+ * same job twice is coalesced into one write. The journal is drained by
+ * persist_worker_flush() before power off.
+ */
+
+#ifndef PERSIST_WORKER_H_
+#define PERSIST_WORKER_H_
+
+#include <zephyr/bluetooth/bluetooth.h>
+#include <stdint.h>
+
+#define PERSIST_JOURNAL_SIZE 8
+
+/**
+ * @brief Write job, called from the persistence thread
+ *
+ * @param addr Address the job was queued for, or BT_ADDR_LE_ANY
+ */
+typedef void (*persist_job_t)(const bt_addr_le_t *addr);
+
+/**
+ * @brief Journal counters
+ */
+struct persist_worker_stats {
+	uint32_t queued;    /* Jobs added to the journal */
+	uint32_t coalesced; /* Jobs already in the journal */
+	uint32_t overflows; /* Jobs run synchronously because the journal was full */
+	uint32_t written;   /* Jobs run by the thread or a flush */
+};
+
+/**
+ * @brief Queue a write job
+ *
+ * Returns without touching flash unless the journal is full, in which case
+ * the job runs synchronously so nothing is lost.
+ *
+ * @param job Job to run
+ * @param addr Address passed to the job, NULL for BT_ADDR_LE_ANY
+ */
+void persist_worker_submit(persist_job_t job, const bt_addr_le_t *addr);
+
+/**
+ * @brief Queue a full settings_save()
+ */
+void persist_worker_save_all(void);
+
+/**
+ * @brief Run every queued job in the calling thread
+ *
+ * Returns once the journal is empty and no job is in progress.
+ */
+void persist_worker_flush(void);
+
+/**
+ * @brief Get the journal counters
+ *
+ * @param stats Buffer for the counters
+ */
+void persist_worker_get_stats(struct persist_worker_stats *stats);
+
+#endif /* PERSIST_WORKER_H_ */
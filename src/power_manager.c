@@ -4,6 +4,11 @@
 #include "button_manager.h"
 #include "display_manager.h"
 #include "app_controller.h"
+#include "wake_trace.h"
+#include "session_snapshot.h"
+#include "handle_cache.h"
+#include "persist_worker.h"
+#include "cmd_latency.h"
 #include <hal/nrf_gpio.h>
 #include <zephyr/init.h>
 
@@ -16,8 +21,12 @@ SYS_INIT(get_wakeup_source, PRE_KERNEL_1, 0);
 int get_wakeup_source(void) {
     uint32_t reset_cause;
     hwinfo_get_reset_cause(&reset_cause);
+    /* RESETREAS is sticky, clear it so a later soft reset is not taken for a wake */
+    hwinfo_clear_reset_cause();
     power_manager_wake_button = 0;
 
+    session_snapshot_init(reset_cause);
+
     // Check which button woke us up
     if (nrf_gpio_pin_latch_get(VOLUME_UP_BTN_PIN)) {
         // Volume up pressed
@@ -37,6 +46,8 @@ int get_wakeup_source(void) {
         power_manager_wake_button = NEXT_PRESET_BTN_ID;
     }
 
+    wake_trace_start(reset_cause, power_manager_wake_button);
+
     return 0;
 }
 
@@ -83,6 +94,8 @@ void power_manager_prepare_power_off() {
      * - Power off.
     */
 
+    wake_trace_dump();
+
     err = display_manager_sleep();
     if (err) {
         LOG_WRN("Failed to sleep display (err %d) - continuing", err);
@@ -109,6 +122,20 @@ void power_manager_prepare_power_off() {
     if (err) {
         LOG_WRN("Failed to suspend display device (err %d) - continuing", err);
     }
+
+    /* Write handles still waiting for the deferred flush */
+    handle_cache_flush();
+    handle_cache_log_stats();
+    ble_cmd_log_binaural_stats();
+    cmd_latency_log_stats();
+    ble_cmd_log_overload_stats();
+    app_controller_log_event_stats();
+
+    /* Nothing queued for flash may be lost in System OFF */
+    persist_worker_flush();
+
+    /* Keep bonds, handles and last state for the next wake */
+    session_snapshot_seal();
 }
 
 void power_manager_power_off() {
@@ -0,0 +1,368 @@
+/**
+ * @file session_snapshot.c
+ * @brief Retained-RAM session snapshot that survives System OFF
+ */
+
+#include "session_snapshot.h"
+#include "display_manager.h"
+
+#include <zephyr/drivers/hwinfo.h>
+#include <zephyr/linker/section_tags.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/crc.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(CONFIG_SOC_SERIES_NRF52X)
+#include <hal/nrf_power.h>
+#endif
+
+LOG_MODULE_REGISTER(session_snapshot, LOG_LEVEL_INF);
+
+#define SESSION_SNAPSHOT_MAGIC   0x48415243 /* "HARC" */
+#define SESSION_SNAPSHOT_VERSION 2
+
+/* nRF52832 RAM layout: 8 blocks of two 4 KB sections starting at 0x20000000 */
+#define SESSION_RAM_BASE         0x20000000UL
+#define SESSION_RAM_SECTION_SIZE 4096UL
+
+/* Validity flags of a device record */
+#define SNAPSHOT_VCP_HANDLES BIT(0)
+#define SNAPSHOT_HAS_CACHE   BIT(1)
+#define SNAPSHOT_BAS_HANDLES BIT(2)
+#define SNAPSHOT_VOLUME      BIT(3)
+#define SNAPSHOT_PRESET      BIT(4)
+#define SNAPSHOT_BATTERY     BIT(5)
+#define SNAPSHOT_DB_HASH     BIT(6)
+
+struct session_device_record {
+	bt_addr_le_t addr;
+	uint8_t flags;
+	struct bt_vcp_vol_ctlr_handles vcp_handles;
+	struct has_cached_data has_cache;
+	struct bt_bas_handles bas_handles;
+	uint8_t db_hash[GATT_DB_HASH_SIZE];
+	uint8_t volume;
+	uint8_t mute;
+	uint8_t active_preset_index;
+	uint8_t battery_level;
+};
+
+struct session_snapshot {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;
+	struct bond_collection bonds; /* SIRK and rank per bonded device */
+	struct session_device_record devices[CONFIG_BT_MAX_PAIRED];
+	uint32_t crc; /* crc32_ieee over everything above, must stay last */
+};
+
+/* Live copy, updated during the session and sealed at power off */
+static __noinit struct session_snapshot snapshot;
+static bool restored;
+static struct k_spinlock snapshot_lock;
+
+static uint32_t session_snapshot_crc(void)
+{
+	return crc32_ieee((const uint8_t *)&snapshot, offsetof(struct session_snapshot, crc));
+}
+
+static void session_snapshot_reset(void)
+{
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.version = SESSION_SNAPSHOT_VERSION;
+	snapshot.size = sizeof(snapshot);
+}
+
+void session_snapshot_init(uint32_t reset_cause)
+{
+	restored = false;
+
+	if ((reset_cause & RESET_LOW_POWER_WAKE) && snapshot.magic == SESSION_SNAPSHOT_MAGIC &&
+	    snapshot.version == SESSION_SNAPSHOT_VERSION && snapshot.size == sizeof(snapshot) &&
+	    snapshot.crc == session_snapshot_crc()) {
+		restored = true;
+	} else {
+		session_snapshot_reset();
+	}
+
+	/* Unsealed until the next power off */
+	snapshot.magic = 0;
+}
+
+bool session_snapshot_restored(void)
+{
+	return restored;
+}
+
+/* Keep the RAM sections holding the snapshot powered in System OFF */
+static void session_snapshot_retain(void)
+{
+#if defined(CONFIG_SOC_SERIES_NRF52X)
+	uintptr_t start = (uintptr_t)&snapshot - SESSION_RAM_BASE;
+	uintptr_t end = start + sizeof(snapshot) - 1;
+
+	for (uintptr_t section = start / SESSION_RAM_SECTION_SIZE;
+	     section <= end / SESSION_RAM_SECTION_SIZE; section++) {
+		nrf_power_rampower_mask_on(NRF_POWER, section / 2,
+					   NRF_POWER_RAMPOWER_S0RETENTION_MASK << (section % 2));
+	}
+#endif
+}
+
+void session_snapshot_seal(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&snapshot_lock);
+
+	snapshot.magic = SESSION_SNAPSHOT_MAGIC;
+	snapshot.crc = session_snapshot_crc();
+
+	k_spin_unlock(&snapshot_lock, key);
+
+	session_snapshot_retain();
+	LOG_INF("Session snapshot sealed (%u bond(s))", snapshot.bonds.count);
+}
+
+void session_snapshot_invalidate(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&snapshot_lock);
+
+	session_snapshot_reset();
+	restored = false;
+
+	k_spin_unlock(&snapshot_lock, key);
+}
+
+void session_snapshot_set_bonds(const struct bond_collection *bonds)
+{
+	k_spinlock_key_t key = k_spin_lock(&snapshot_lock);
+
+	memcpy(&snapshot.bonds, bonds, sizeof(snapshot.bonds));
+
+	k_spin_unlock(&snapshot_lock, key);
+}
+
+int session_snapshot_get_sirk(const bt_addr_le_t *addr, uint8_t *sirk, uint8_t *rank)
+{
+	int err = -ENOENT;
+	k_spinlock_key_t key = k_spin_lock(&snapshot_lock);
+
+	for (uint8_t i = 0; i < snapshot.bonds.count; i++) {
+		const struct bonded_device_entry *entry = &snapshot.bonds.devices[i];
+
+		if (entry->has_sirk && bt_addr_le_cmp(&entry->addr, addr) == 0) {
+			memcpy(sirk, entry->sirk, CSIP_SIRK_SIZE);
+			*rank = entry->set_rank;
+			err = 0;
+			break;
+		}
+	}
+
+	k_spin_unlock(&snapshot_lock, key);
+	return err;
+}
+
+void session_snapshot_set_sirk(const bt_addr_le_t *addr, const uint8_t *sirk, uint8_t rank)
+{
+	k_spinlock_key_t key = k_spin_lock(&snapshot_lock);
+	struct bonded_device_entry *entry = NULL;
+
+	for (uint8_t i = 0; i < snapshot.bonds.count; i++) {
+		if (bt_addr_le_cmp(&snapshot.bonds.devices[i].addr, addr) == 0) {
+			entry = &snapshot.bonds.devices[i];
+			break;
+		}
+	}
+
+	if (!entry && snapshot.bonds.count < CONFIG_BT_MAX_PAIRED) {
+		entry = &snapshot.bonds.devices[snapshot.bonds.count++];
+		bt_addr_le_copy(&entry->addr, addr);
+	}
+
+	if (entry) {
+		memcpy(entry->sirk, sirk, CSIP_SIRK_SIZE);
+		entry->set_rank = rank;
+		entry->has_sirk = true;
+		entry->is_set_member = true;
+	}
+
+	k_spin_unlock(&snapshot_lock, key);
+}
+
+/* Find the record of a device, optionally claiming a free one. Lock must be held. */
+static struct session_device_record *find_record(const bt_addr_le_t *addr, bool create)
+{
+	struct session_device_record *free_record = NULL;
+
+	for (uint8_t i = 0; i < CONFIG_BT_MAX_PAIRED; i++) {
+		struct session_device_record *record = &snapshot.devices[i];
+
+		if (record->flags && bt_addr_le_cmp(&record->addr, addr) == 0) {
+			return record;
+		}
+
+		if (!record->flags && !free_record) {
+			free_record = record;
+		}
+	}
+
+	if (!create || !free_record) {
+		return NULL;
+	}
+
+	memset(free_record, 0, sizeof(*free_record));
+	bt_addr_le_copy(&free_record->addr, addr);
+	return free_record;
+}
+
+/* Copy a cached item out of the snapshot if its flag is set */
+static int get_item(const bt_addr_le_t *addr, uint8_t flag, size_t offset, void *out, size_t len)
+{
+	int err = -ENOENT;
+	k_spinlock_key_t key = k_spin_lock(&snapshot_lock);
+	struct session_device_record *record = find_record(addr, false);
+
+	if (record && (record->flags & flag)) {
+		memcpy(out, (uint8_t *)record + offset, len);
+		err = 0;
+	}
+
+	k_spin_unlock(&snapshot_lock, key);
+	return err;
+}
+
+/* Store a cached item in the snapshot, or clear it if data is NULL */
+static void set_item(const bt_addr_le_t *addr, uint8_t flag, size_t offset, const void *data,
+		     size_t len)
+{
+	k_spinlock_key_t key = k_spin_lock(&snapshot_lock);
+	struct session_device_record *record = find_record(addr, data != NULL);
+
+	if (record) {
+		if (data) {
+			memcpy((uint8_t *)record + offset, data, len);
+			record->flags |= flag;
+		} else {
+			record->flags &= ~flag;
+		}
+	}
+
+	k_spin_unlock(&snapshot_lock, key);
+}
+
+#define RECORD_OFFSET(member) offsetof(struct session_device_record, member)
+
+int session_snapshot_get_vcp_handles(const bt_addr_le_t *addr,
+				     struct bt_vcp_vol_ctlr_handles *handles)
+{
+	return get_item(addr, SNAPSHOT_VCP_HANDLES, RECORD_OFFSET(vcp_handles), handles,
+			sizeof(*handles));
+}
+
+void session_snapshot_set_vcp_handles(const bt_addr_le_t *addr,
+				      const struct bt_vcp_vol_ctlr_handles *handles)
+{
+	set_item(addr, SNAPSHOT_VCP_HANDLES, RECORD_OFFSET(vcp_handles), handles,
+		 sizeof(struct bt_vcp_vol_ctlr_handles));
+}
+
+int session_snapshot_get_has_cache(const bt_addr_le_t *addr, struct has_cached_data *cached_data)
+{
+	return get_item(addr, SNAPSHOT_HAS_CACHE, RECORD_OFFSET(has_cache), cached_data,
+			sizeof(*cached_data));
+}
+
+void session_snapshot_set_has_cache(const bt_addr_le_t *addr,
+				    const struct has_cached_data *cached_data)
+{
+	set_item(addr, SNAPSHOT_HAS_CACHE, RECORD_OFFSET(has_cache), cached_data,
+		 sizeof(struct has_cached_data));
+}
+
+int session_snapshot_get_bas_handles(const bt_addr_le_t *addr, struct bt_bas_handles *handles)
+{
+	return get_item(addr, SNAPSHOT_BAS_HANDLES, RECORD_OFFSET(bas_handles), handles,
+			sizeof(*handles));
+}
+
+void session_snapshot_set_bas_handles(const bt_addr_le_t *addr,
+				      const struct bt_bas_handles *handles)
+{
+	set_item(addr, SNAPSHOT_BAS_HANDLES, RECORD_OFFSET(bas_handles), handles,
+		 sizeof(struct bt_bas_handles));
+}
+
+int session_snapshot_get_db_hash(const bt_addr_le_t *addr, uint8_t *hash)
+{
+	return get_item(addr, SNAPSHOT_DB_HASH, RECORD_OFFSET(db_hash), hash, GATT_DB_HASH_SIZE);
+}
+
+void session_snapshot_set_db_hash(const bt_addr_le_t *addr, const uint8_t *hash)
+{
+	set_item(addr, SNAPSHOT_DB_HASH, RECORD_OFFSET(db_hash), hash, GATT_DB_HASH_SIZE);
+}
+
+void session_snapshot_set_volume(const bt_addr_le_t *addr, uint8_t volume, uint8_t mute)
+{
+	k_spinlock_key_t key = k_spin_lock(&snapshot_lock);
+	struct session_device_record *record = find_record(addr, true);
+
+	if (record) {
+		record->volume = volume;
+		record->mute = mute;
+		record->flags |= SNAPSHOT_VOLUME;
+	}
+
+	k_spin_unlock(&snapshot_lock, key);
+}
+
+void session_snapshot_set_preset(const bt_addr_le_t *addr, uint8_t index)
+{
+	set_item(addr, SNAPSHOT_PRESET, RECORD_OFFSET(active_preset_index), &index, sizeof(index));
+}
+
+void session_snapshot_set_battery(const bt_addr_le_t *addr, uint8_t level)
+{
+	set_item(addr, SNAPSHOT_BATTERY, RECORD_OFFSET(battery_level), &level, sizeof(level));
+}
+
+void session_snapshot_seed_device(struct device_context *ctx)
+{
+	struct session_device_record record;
+	bool found = false;
+
+	if (!restored) {
+		return;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&snapshot_lock);
+	struct session_device_record *live = find_record(&ctx->info.addr, false);
+
+	if (live) {
+		record = *live;
+		found = true;
+	}
+
+	k_spin_unlock(&snapshot_lock, key);
+
+	if (!found) {
+		return;
+	}
+
+	if (record.flags & SNAPSHOT_VOLUME) {
+		ctx->vcp_ctlr.state.volume = record.volume;
+		ctx->vcp_ctlr.state.mute = record.mute;
+		display_manager_update_volume(ctx->device_id, record.volume, record.mute);
+	}
+
+	if (record.flags & SNAPSHOT_PRESET) {
+		ctx->has_ctlr.active_preset_index = record.active_preset_index;
+		display_manager_update_preset(ctx->device_id, record.active_preset_index, NULL);
+	}
+
+	if (record.flags & SNAPSHOT_BATTERY) {
+		ctx->bas_ctlr.battery_level = record.battery_level;
+		display_manager_update_battery(ctx->device_id, record.battery_level);
+	}
+
+	LOG_DBG("Seeded last known state from snapshot [DEVICE ID %d]", ctx->device_id);
+}
@@ -0,0 +1,137 @@
+/**
+ * @file session_snapshot.h
+ * @brief Retained-RAM session snapshot that survives System OFF
+ *
+ * Holds the bond collection, cached GATT handles and the last known device
+ * state so a wake from System OFF can skip the NVS walks. The snapshot is
+ * sealed with a CRC in power_manager_prepare_power_off() and only trusted on
+ * the next boot if the reset cause is RESET_LOW_POWER_WAKE and the CRC matches.
+ * In every other case the settings in NVS are used as before.
+ */
+
+#ifndef SESSION_SNAPSHOT_H_
+#define SESSION_SNAPSHOT_H_
+
+#include "devices_manager.h"
+#include "vcp_settings.h"
+#include "has_settings.h"
+#include "bas_settings.h"
+#include "device_settings.h"
+
+#include <zephyr/bluetooth/bluetooth.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Validate the retained snapshot after reset
+ *
+ * Called from get_wakeup_source() in PRE_KERNEL_1. The snapshot is discarded
+ * unless the system woke from System OFF and the CRC matches. Either way it
+ * is unsealed afterwards, so a reset before the next power off falls back to
+ * NVS.
+ *
+ * @param reset_cause Reset cause reported by hwinfo
+ */
+void session_snapshot_init(uint32_t reset_cause);
+
+/**
+ * @brief Check if this boot was restored from the snapshot
+ *
+ * @return true if the snapshot was valid and can replace the NVS walks
+ */
+bool session_snapshot_restored(void);
+
+/**
+ * @brief Seal the snapshot with a CRC and keep its RAM retained in System OFF
+ */
+void session_snapshot_seal(void);
+
+/**
+ * @brief Drop everything in the snapshot (e.g. when bonds are cleared)
+ */
+void session_snapshot_invalidate(void);
+
+/**
+ * @brief Replace the bond collection in the snapshot
+ *
+ * @param bonds Current bond collection
+ */
+void session_snapshot_set_bonds(const struct bond_collection *bonds);
+
+/**
+ * @brief Get the CSIP data of a bonded device from the snapshot
+ *
+ * @param addr Bluetooth address of the device
+ * @param sirk Buffer for the SIRK (CSIP_SIRK_SIZE bytes)
+ * @param rank Buffer for the set rank
+ * @return 0 on success, -ENOENT if the snapshot has no SIRK for the device
+ */
+int session_snapshot_get_sirk(const bt_addr_le_t *addr, uint8_t *sirk, uint8_t *rank);
+
+/**
+ * @brief Store the CSIP data of a bonded device in the snapshot
+ *
+ * @param addr Bluetooth address of the device
+ * @param sirk SIRK (CSIP_SIRK_SIZE bytes)
+ * @param rank Set rank
+ */
+void session_snapshot_set_sirk(const bt_addr_le_t *addr, const uint8_t *sirk, uint8_t rank);
+
+/**
+ * @brief Get/set/clear cached VCP handles
+ *
+ * The getters return 0 on success or -ENOENT. Passing NULL to the setters
+ * clears the entry.
+ */
+int session_snapshot_get_vcp_handles(const bt_addr_le_t *addr,
+				     struct bt_vcp_vol_ctlr_handles *handles);
+void session_snapshot_set_vcp_handles(const bt_addr_le_t *addr,
+				      const struct bt_vcp_vol_ctlr_handles *handles);
+
+/**
+ * @brief Get/set/clear cached HAS handles and features
+ */
+int session_snapshot_get_has_cache(const bt_addr_le_t *addr, struct has_cached_data *cached_data);
+void session_snapshot_set_has_cache(const bt_addr_le_t *addr,
+				    const struct has_cached_data *cached_data);
+
+/**
+ * @brief Get/set/clear cached BAS handles
+ */
+int session_snapshot_get_bas_handles(const bt_addr_le_t *addr, struct bt_bas_handles *handles);
+void session_snapshot_set_bas_handles(const bt_addr_le_t *addr,
+				      const struct bt_bas_handles *handles);
+
+/**
+ * @brief Get/set/clear the Database Hash the cached handles belong to
+ *
+ * @p hash is GATT_DB_HASH_SIZE bytes.
+ */
+int session_snapshot_get_db_hash(const bt_addr_le_t *addr, uint8_t *hash);
+void session_snapshot_set_db_hash(const bt_addr_le_t *addr, const uint8_t *hash);
+
+/**
+ * @brief Record the last known volume and mute state of a device
+ */
+void session_snapshot_set_volume(const bt_addr_le_t *addr, uint8_t volume, uint8_t mute);
+
+/**
+ * @brief Record the last known active preset of a device
+ */
+void session_snapshot_set_preset(const bt_addr_le_t *addr, uint8_t index);
+
+/**
+ * @brief Record the last known battery level of a device
+ */
+void session_snapshot_set_battery(const bt_addr_le_t *addr, uint8_t level);
+
+/**
+ * @brief Seed a device context and the display with the last known state
+ *
+ * Does nothing unless the snapshot was restored on this boot.
+ *
+ * @param ctx Device context, with info.addr set
+ */
+void session_snapshot_seed_device(struct device_context *ctx);
+
+#endif /* SESSION_SNAPSHOT_H_ */
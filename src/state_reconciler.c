@@ -0,0 +1,481 @@
+/**
+ * @file state_reconciler.c
+ * @brief Converges each hearing aid to a desired volume, mute and preset
+ */
+
+#include "state_reconciler.h"
+#include "ble_manager.h"
+#include "devices_manager.h"
+#include "vcp_controller.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(state_reconciler, LOG_LEVEL_INF);
+
+enum reconcile_field {
+	RECONCILE_VOLUME = BIT(0),
+	RECONCILE_MUTE = BIT(1),
+	RECONCILE_PRESET = BIT(2),
+};
+
+struct reconcile_state {
+	bt_addr_le_t addr;    /* Peer the targets belong to */
+	uint8_t targets;      /* Fields still to be driven */
+	uint8_t acked;        /* Fields whose target was written, waiting for the device to report */
+	uint8_t volume;
+	bool mute;
+	uint8_t preset;
+	int16_t volume_steps; /* Steps requested while the step size is unknown */
+
+	/* Write in flight, at most one per device */
+	bool busy;
+	uint8_t field;
+	uint8_t value;
+	int8_t relative;      /* Direction of a relative volume write, 0 if absolute */
+	uint8_t attempts;
+};
+
+/* Next write of a device */
+struct write_plan {
+	uint8_t field;
+	enum ble_cmd_type type;
+	uint8_t value;
+	int8_t relative;
+};
+
+static struct reconcile_state states[CONFIG_BT_MAX_CONN];
+
+/* Writes to both ears are released together once a binaural target was set */
+static bool binaural;
+
+/* Protects states, never held while waiting for the Bluetooth stack */
+static K_MUTEX_DEFINE(reconcile_mutex);
+
+static void retry_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(retry_work_0, retry_work_handler);
+static K_WORK_DELAYABLE_DEFINE(retry_work_1, retry_work_handler);
+static struct k_work_delayable *retry_work[CONFIG_BT_MAX_CONN] = {&retry_work_0, &retry_work_1};
+
+static void reconcile(uint8_t device_id);
+
+static const char *field_name(uint8_t field)
+{
+	switch (field) {
+	case RECONCILE_VOLUME:
+		return "volume";
+	case RECONCILE_MUTE:
+		return "mute";
+	case RECONCILE_PRESET:
+		return "preset";
+	default:
+		return "unknown";
+	}
+}
+
+static void write_done(uint8_t device_id, int err)
+{
+	struct reconcile_state *rs = &states[device_id];
+
+	k_mutex_lock(&reconcile_mutex, K_FOREVER);
+
+	if (!rs->busy) {
+		/* Dropped by a reset in the meantime */
+		k_mutex_unlock(&reconcile_mutex);
+		return;
+	}
+
+	rs->busy = false;
+
+	if (err) {
+		LOG_WRN("Writing %s failed (err %d, attempt %u) [DEVICE ID %d]", field_name(rs->field),
+			err, rs->attempts + 1, device_id);
+
+		/* A timed out relative write may have been applied, anything else was not */
+		if (rs->relative && err != -ETIMEDOUT) {
+			rs->volume_steps += rs->relative;
+		}
+
+		if (++rs->attempts >= STATE_RECONCILER_MAX_ATTEMPTS) {
+			LOG_ERR("Giving up on %s target [DEVICE ID %d]", field_name(rs->field),
+				device_id);
+			rs->targets &= ~rs->field;
+			rs->acked &= ~rs->field;
+			if (rs->field == RECONCILE_VOLUME) {
+				rs->volume_steps = 0;
+			}
+			rs->attempts = 0;
+		}
+
+		k_mutex_unlock(&reconcile_mutex);
+		k_work_reschedule(retry_work[device_id], K_MSEC(STATE_RECONCILER_RETRY_DELAY_MS));
+		return;
+	}
+
+	rs->attempts = 0;
+
+	/* Presses during the write moved the target, that is written next */
+	if (!rs->relative && (rs->targets & rs->field)) {
+		bool current = (rs->field == RECONCILE_VOLUME && rs->volume == rs->value) ||
+			       (rs->field == RECONCILE_MUTE && rs->mute == rs->value) ||
+			       (rs->field == RECONCILE_PRESET && rs->preset == rs->value);
+		if (current) {
+			rs->acked |= rs->field;
+		}
+	}
+
+	reconcile(device_id);
+	k_mutex_unlock(&reconcile_mutex);
+}
+
+/* Mutex must be held */
+static void mark_started(uint8_t device_id, const struct write_plan *plan)
+{
+	struct reconcile_state *rs = &states[device_id];
+
+	rs->busy = true;
+	rs->field = plan->field;
+	rs->value = plan->value;
+	rs->relative = plan->relative;
+	rs->volume_steps -= plan->relative;
+
+	LOG_DBG("Writing %s %u%s [DEVICE ID %d]", field_name(plan->field), plan->value,
+		plan->relative ? " (relative)" : "", device_id);
+}
+
+/* Mutex must be held */
+static void start_write(uint8_t device_id, const struct write_plan *plan)
+{
+	int err = ble_cmd_state_write(device_id, plan->type, plan->value, write_done);
+	if (err) {
+		LOG_WRN("Failed to queue %s write (err %d) [DEVICE ID %d]", field_name(plan->field),
+			err, device_id);
+		k_work_reschedule(retry_work[device_id], K_MSEC(STATE_RECONCILER_RETRY_DELAY_MS));
+		return;
+	}
+
+	mark_started(device_id, plan);
+}
+
+/* Settle the target of a field the device just reported. Mutex must be held. */
+static void settle(struct reconcile_state *rs, uint8_t field, bool reached)
+{
+	if (!(rs->targets & field)) {
+		return;
+	}
+
+	/* Reached, or acknowledged and then reported otherwise (e.g. clamped) */
+	if (reached || (rs->acked & field)) {
+		rs->targets &= ~field;
+		rs->acked &= ~field;
+	}
+}
+
+/* Work out the next write a device needs, dropping targets it already has.
+ * Returns false if there is nothing to write now. Mutex must be held. */
+static bool plan_write(uint8_t device_id, struct write_plan *plan)
+{
+	struct reconcile_state *rs = &states[device_id];
+	struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
+
+	if (rs->busy || !ctx || !ctx->conn) {
+		return false;
+	}
+
+	if ((rs->targets || rs->volume_steps) && bt_addr_le_cmp(&rs->addr, &ctx->info.addr) != 0) {
+		LOG_DBG("Dropping targets of a previous peer [DEVICE ID %d]", device_id);
+		rs->targets = 0;
+		rs->acked = 0;
+		rs->volume_steps = 0;
+	}
+
+	if (ctx->info.vcp_discovered) {
+		struct bt_vcp_ctlr *vcp = &ctx->vcp_ctlr;
+		uint8_t step = vcp_controller_get_volume_step(device_id);
+
+		if (rs->volume_steps != 0) {
+			if (step == 0) {
+				plan->relative = rs->volume_steps > 0 ? 1 : -1;
+				plan->field = RECONCILE_VOLUME;
+				plan->type = plan->relative > 0 ? BLE_CMD_VCP_VOLUME_UP
+								: BLE_CMD_VCP_VOLUME_DOWN;
+				plan->value = vcp->state.volume;
+				return true;
+			}
+
+			int32_t base = (rs->targets & RECONCILE_VOLUME) ? rs->volume
+								       : vcp->state.volume;
+			rs->volume = CLAMP(base + rs->volume_steps * step, 0, UINT8_MAX);
+			rs->targets |= RECONCILE_VOLUME;
+			rs->acked &= ~RECONCILE_VOLUME;
+			rs->volume_steps = 0;
+		}
+
+		if ((rs->targets & RECONCILE_VOLUME) && !(rs->acked & RECONCILE_VOLUME)) {
+			if (rs->volume != vcp->state.volume) {
+				*plan = (struct write_plan){
+					.field = RECONCILE_VOLUME,
+					.type = BLE_CMD_VCP_SET_VOLUME,
+					.value = rs->volume,
+				};
+				return true;
+			}
+			rs->targets &= ~RECONCILE_VOLUME;
+		}
+
+		if ((rs->targets & RECONCILE_MUTE) && !(rs->acked & RECONCILE_MUTE)) {
+			if (rs->mute != vcp->state.mute) {
+				*plan = (struct write_plan){
+					.field = RECONCILE_MUTE,
+					.type = rs->mute ? BLE_CMD_VCP_MUTE : BLE_CMD_VCP_UNMUTE,
+					.value = rs->mute,
+				};
+				return true;
+			}
+			rs->targets &= ~RECONCILE_MUTE;
+		}
+	}
+
+	if (ctx->info.has_discovered && (rs->targets & RECONCILE_PRESET) &&
+	    !(rs->acked & RECONCILE_PRESET)) {
+		if (rs->preset != ctx->has_ctlr.active_preset_index) {
+			*plan = (struct write_plan){
+				.field = RECONCILE_PRESET,
+				.type = BLE_CMD_HAS_SET_PRESET,
+				.value = rs->preset,
+			};
+			return true;
+		}
+		rs->targets &= ~RECONCILE_PRESET;
+	}
+
+	return false;
+}
+
+/* Issue the writes both ears need together. Mutex must be held. */
+static void reconcile_pair(void)
+{
+	struct write_plan plan[2];
+	bool needed[2];
+
+	/* Wait for both ears, so the next writes leave at the same time */
+	if (states[0].busy || states[1].busy) {
+		return;
+	}
+
+	for (uint8_t i = 0; i < 2; i++) {
+		needed[i] = plan_write(i, &plan[i]);
+	}
+
+	if (needed[0] && needed[1]) {
+		const enum ble_cmd_type types[2] = {plan[0].type, plan[1].type};
+		const uint8_t values[2] = {plan[0].value, plan[1].value};
+
+		int err = ble_cmd_binaural_write(types, values, write_done);
+		if (err) {
+			LOG_WRN("Failed to queue binaural write (err %d)", err);
+			k_work_reschedule(retry_work[0], K_MSEC(STATE_RECONCILER_RETRY_DELAY_MS));
+			return;
+		}
+
+		mark_started(0, &plan[0]);
+		mark_started(1, &plan[1]);
+	} else if (needed[0]) {
+		start_write(0, &plan[0]);
+	} else if (needed[1]) {
+		start_write(1, &plan[1]);
+	}
+}
+
+/* Issue the next write needed, if none is in flight. Mutex must be held. */
+static void reconcile(uint8_t device_id)
+{
+	struct write_plan plan;
+
+	if (binaural && device_ctx[0].conn && device_ctx[1].conn) {
+		reconcile_pair();
+		return;
+	}
+
+	if (plan_write(device_id, &plan)) {
+		start_write(device_id, &plan);
+	}
+}
+
+static void retry_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	uint8_t device_id = (dwork == retry_work[0]) ? 0 : 1;
+
+	k_mutex_lock(&reconcile_mutex, K_FOREVER);
+	reconcile(device_id);
+	k_mutex_unlock(&reconcile_mutex);
+}
+
+/* Take the targets over for the current peer of the device. Mutex must be held. */
+static struct reconcile_state *claim(uint8_t device_id)
+{
+	struct reconcile_state *rs = &states[device_id];
+
+	bt_addr_le_copy(&rs->addr, &device_ctx[device_id].info.addr);
+	return rs;
+}
+
+/* Move the volume target of a device by one step. Mutex must be held. */
+static void step_target(uint8_t device_id, int8_t direction)
+{
+	struct reconcile_state *rs = claim(device_id);
+	uint8_t step = vcp_controller_get_volume_step(device_id);
+
+	if (step == 0 || rs->volume_steps != 0) {
+		rs->volume_steps += direction;
+	} else {
+		int32_t base = (rs->targets & RECONCILE_VOLUME) ? rs->volume
+								: device_ctx[device_id].vcp_ctlr.state.volume;
+		rs->volume = CLAMP(base + direction * step, 0, UINT8_MAX);
+		rs->targets |= RECONCILE_VOLUME;
+		rs->acked &= ~RECONCILE_VOLUME;
+	}
+}
+
+void state_reconciler_step_volume(uint8_t device_id, int8_t direction)
+{
+	k_mutex_lock(&reconcile_mutex, K_FOREVER);
+	step_target(device_id, direction);
+	reconcile(device_id);
+	k_mutex_unlock(&reconcile_mutex);
+}
+
+void state_reconciler_step_volume_binaural(int8_t direction)
+{
+	k_mutex_lock(&reconcile_mutex, K_FOREVER);
+	binaural = true;
+
+	/* Both targets move before anything is planned, so the writes pair up */
+	step_target(0, direction);
+	step_target(1, direction);
+	reconcile(0);
+	k_mutex_unlock(&reconcile_mutex);
+}
+
+void state_reconciler_set_volume(uint8_t device_id, uint8_t volume)
+{
+	k_mutex_lock(&reconcile_mutex, K_FOREVER);
+
+	struct reconcile_state *rs = claim(device_id);
+	rs->volume = volume;
+	rs->volume_steps = 0;
+	rs->targets |= RECONCILE_VOLUME;
+	rs->acked &= ~RECONCILE_VOLUME;
+
+	reconcile(device_id);
+	k_mutex_unlock(&reconcile_mutex);
+}
+
+void state_reconciler_set_mute(uint8_t device_id, bool mute)
+{
+	k_mutex_lock(&reconcile_mutex, K_FOREVER);
+
+	struct reconcile_state *rs = claim(device_id);
+	rs->mute = mute;
+	rs->targets |= RECONCILE_MUTE;
+	rs->acked &= ~RECONCILE_MUTE;
+
+	reconcile(device_id);
+	k_mutex_unlock(&reconcile_mutex);
+}
+
+void state_reconciler_set_preset(uint8_t device_id, uint8_t index)
+{
+	k_mutex_lock(&reconcile_mutex, K_FOREVER);
+
+	struct reconcile_state *rs = claim(device_id);
+	rs->preset = index;
+	rs->targets |= RECONCILE_PRESET;
+	rs->acked &= ~RECONCILE_PRESET;
+
+	reconcile(device_id);
+	k_mutex_unlock(&reconcile_mutex);
+}
+
+int state_reconciler_next_preset(uint8_t device_id)
+{
+	struct bt_has_ctlr *has = &device_ctx[device_id].has_ctlr;
+
+	if (!has->presets_read || has->preset_count == 0) {
+		return -ENOENT;
+	}
+
+	k_mutex_lock(&reconcile_mutex, K_FOREVER);
+
+	struct reconcile_state *rs = claim(device_id);
+	uint8_t current = (rs->targets & RECONCILE_PRESET) ? rs->preset : has->active_preset_index;
+
+	/* Presets are listed in index order, wrap around to the first available one */
+	int pos = -1;
+	for (int i = 0; i < has->preset_count; i++) {
+		if (has->presets[i].index == current) {
+			pos = i;
+			break;
+		}
+	}
+
+	for (int n = 1; n <= has->preset_count; n++) {
+		struct has_preset_info *preset = &has->presets[(pos + n) % has->preset_count];
+
+		if (preset->available) {
+			rs->preset = preset->index;
+			rs->targets |= RECONCILE_PRESET;
+			rs->acked &= ~RECONCILE_PRESET;
+			break;
+		}
+	}
+
+	reconcile(device_id);
+	k_mutex_unlock(&reconcile_mutex);
+	return 0;
+}
+
+void state_reconciler_vcp_state_changed(uint8_t device_id)
+{
+	struct bt_vcp_ctlr *vcp = &device_ctx[device_id].vcp_ctlr;
+
+	k_mutex_lock(&reconcile_mutex, K_FOREVER);
+
+	struct reconcile_state *rs = &states[device_id];
+	settle(rs, RECONCILE_VOLUME, rs->volume == vcp->state.volume);
+	settle(rs, RECONCILE_MUTE, rs->mute == vcp->state.mute);
+
+	reconcile(device_id);
+	k_mutex_unlock(&reconcile_mutex);
+}
+
+void state_reconciler_preset_changed(uint8_t device_id)
+{
+	k_mutex_lock(&reconcile_mutex, K_FOREVER);
+
+	struct reconcile_state *rs = &states[device_id];
+	settle(rs, RECONCILE_PRESET, rs->preset == device_ctx[device_id].has_ctlr.active_preset_index);
+
+	reconcile(device_id);
+	k_mutex_unlock(&reconcile_mutex);
+}
+
+void state_reconciler_reset(uint8_t device_id)
+{
+	k_mutex_lock(&reconcile_mutex, K_FOREVER);
+
+	struct reconcile_state *rs = &states[device_id];
+
+	/* The write may or may not have landed, write the target again to be sure */
+	rs->busy = false;
+	rs->acked = 0;
+	rs->attempts = 0;
+
+	k_mutex_unlock(&reconcile_mutex);
+
+	k_work_cancel_delayable(retry_work[device_id]);
+	LOG_DBG("Reconciler reset, %s targets kept [DEVICE ID %d]",
+		states[device_id].targets ? "pending" : "no", device_id);
+}
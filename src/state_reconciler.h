@@ -0,0 +1,106 @@
+/**
+ * @file state_reconciler.h
+ * @brief Converges each hearing aid to a desired volume, mute and preset
+ *
+ * Buttons no longer queue one command per press. They move a per-device
+ * target, and the reconciler writes the difference between that target and
+ * the state last reported by the device, one write at a time. Presses that
+ * arrive while a write is in flight only move the target, so a burst ends
+ * in a single absolute write per ear. Writes are absolute and therefore
+ * safe to repeat: failed ones are retried, and targets that were not reached
+ * before a disconnect are written again once the device is back.
+ */
+
+#ifndef STATE_RECONCILER_H_
+#define STATE_RECONCILER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Failed writes of one value before its target is given up */
+#define STATE_RECONCILER_MAX_ATTEMPTS 3
+
+/* Delay before a failed write is retried */
+#define STATE_RECONCILER_RETRY_DELAY_MS 100
+
+/**
+ * @brief Move the volume target by one step
+ *
+ * Until the step size of the device is known the steps are sent as relative
+ * writes, the first of which measures it.
+ *
+ * @param device_id Device ID
+ * @param direction 1 for up, -1 for down
+ */
+void state_reconciler_step_volume(uint8_t device_id, int8_t direction);
+
+/**
+ * @brief Move the volume target of both ears by one step
+ *
+ * From then on writes to the two ears are released together with
+ * ble_cmd_binaural_write() whenever both are connected, so they do not
+ * drift apart behind other work in their queues.
+ *
+ * @param direction 1 for up, -1 for down
+ */
+void state_reconciler_step_volume_binaural(int8_t direction);
+
+/**
+ * @brief Set an absolute volume target
+ *
+ * @param device_id Device ID
+ * @param volume Volume setting (0-255)
+ */
+void state_reconciler_set_volume(uint8_t device_id, uint8_t volume);
+
+/**
+ * @brief Set the mute target
+ *
+ * @param device_id Device ID
+ * @param mute true to mute
+ */
+void state_reconciler_set_mute(uint8_t device_id, bool mute);
+
+/**
+ * @brief Set the active preset target
+ *
+ * @param device_id Device ID
+ * @param index Preset index
+ */
+void state_reconciler_set_preset(uint8_t device_id, uint8_t index);
+
+/**
+ * @brief Move the preset target to the next available preset
+ *
+ * @param device_id Device ID
+ * @return 0 on success, -ENOENT if the preset list has not been read yet
+ */
+int state_reconciler_next_preset(uint8_t device_id);
+
+/**
+ * @brief Report a Volume State received from the device
+ *
+ * Settles volume and mute writes that were acknowledged and writes whatever
+ * still differs from the target.
+ *
+ * @param device_id Device ID
+ */
+void state_reconciler_vcp_state_changed(uint8_t device_id);
+
+/**
+ * @brief Report an active preset received from the device
+ *
+ * @param device_id Device ID
+ */
+void state_reconciler_preset_changed(uint8_t device_id);
+
+/**
+ * @brief Forget the write in flight after a disconnect
+ *
+ * Targets are kept and resumed once the device reports its state again.
+ *
+ * @param device_id Device ID
+ */
+void state_reconciler_reset(uint8_t device_id);
+
+#endif /* STATE_RECONCILER_H_ */
@@ -1,18 +1,54 @@
 #include "vcp_controller.h"
 #include "vcp_settings.h"
+#include "handle_cache.h"
 #include "devices_manager.h"
 #include "app_controller.h"
 #include "ble_manager.h"
 #include "display_manager.h"
+#include "wake_trace.h"
+#include "session_snapshot.h"
+#include "state_reconciler.h"
+
+#include <stdlib.h>
 
 LOG_MODULE_REGISTER(vcp_controller, LOG_LEVEL_INF);
 
 /* Track whether handles were loaded from cache (per device) - skip re-storing if true */
 static bool handles_from_cache[CONFIG_BT_MAX_CONN];
 
+/* Command waiting for each kind of callback (per device), 0 if none.
+ * State and flags callbacks without a waiting read are notifications. */
+static ble_cmd_handle_t discover_cmd[CONFIG_BT_MAX_CONN];
+static ble_cmd_handle_t read_state_cmd[CONFIG_BT_MAX_CONN];
+static ble_cmd_handle_t read_flags_cmd[CONFIG_BT_MAX_CONN];
+static ble_cmd_handle_t write_cmd[CONFIG_BT_MAX_CONN];
+
+/* Volume change of one relative step as observed on the device, 0 until known.
+ * VCS does not expose the step size, so it is measured on the first relative
+ * write: step_from holds the volume it started from until the state moves. */
+static uint8_t volume_step[CONFIG_BT_MAX_CONN];
+static uint8_t step_from[CONFIG_BT_MAX_CONN];
+static bool step_probe[CONFIG_BT_MAX_CONN];
+
+/* Set once the device reported its Volume State on this connection. Until
+ * then the volume in the context may be the one restored from the snapshot,
+ * which is no base to measure a step from. */
+static bool state_valid[CONFIG_BT_MAX_CONN];
+
+/* Forget the command again if its operation could not be started. The slot is
+ * filled before starting, as callbacks may run before the call returns. */
+static int cmd_started(ble_cmd_handle_t *slot, int err)
+{
+    if (err) {
+        *slot = 0;
+    }
+
+    return err;
+}
+
 static struct device_context *get_device_context_by_vol_ctlr(struct bt_vcp_vol_ctlr *vol_ctlr);
 
-int vcp_cmd_discover(uint8_t device_id)
+int vcp_cmd_discover(uint8_t device_id, ble_cmd_handle_t cmd_id)
 {
     struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
     vcp_controller_reset(device_id);
@@ -22,63 +58,113 @@ int vcp_cmd_discover(uint8_t device_id)
 
     /* Try to load cached handles first */
     struct bt_vcp_vol_ctlr_handles cached_handles;
-    int load_err = vcp_settings_load_handles(&ctx->info.addr, &cached_handles);
+    int load_err = handle_cache_load(HANDLE_CACHE_VCP, &ctx->info.addr, &cached_handles);
     if (load_err == 0) {
         LOG_INF("Loaded cached VCP handles [DEVICE ID %d]", device_id);
         int inject_err = bt_vcp_vol_ctlr_set_handles(ctx->conn, &cached_handles);
         if (inject_err != 0) {
             // Here if subscibtion fails
             LOG_WRN("Failed to inject cached VCP handles (err %d), proceeding with full discovery", inject_err);
-            vcp_settings_clear_handles(&ctx->info.addr);
+            handle_cache_invalidate(HANDLE_CACHE_VCP, &ctx->info.addr);
         } else {
             LOG_INF("Cached handles restored successfully");
             handles_from_cache[device_id] = true;
         }
     }
 
-    return bt_vcp_vol_ctlr_discover(ctx->conn, &ctx->vcp_ctlr.vol_ctlr);
+    discover_cmd[device_id] = cmd_id;
+    return cmd_started(&discover_cmd[device_id],
+                       bt_vcp_vol_ctlr_discover(ctx->conn, &ctx->vcp_ctlr.vol_ctlr));
 }
 
-int vcp_cmd_read_state(uint8_t device_id)
+int vcp_cmd_read_state(uint8_t device_id, ble_cmd_handle_t cmd_id)
 {
     struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
-    return bt_vcp_vol_ctlr_read_state(ctx->vcp_ctlr.vol_ctlr);
+    read_state_cmd[device_id] = cmd_id;
+    return cmd_started(&read_state_cmd[device_id], bt_vcp_vol_ctlr_read_state(ctx->vcp_ctlr.vol_ctlr));
+}
+
+int vcp_cmd_read_flags(uint8_t device_id, ble_cmd_handle_t cmd_id)
+{
+    struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
+    read_flags_cmd[device_id] = cmd_id;
+    return cmd_started(&read_flags_cmd[device_id], bt_vcp_vol_ctlr_read_flags(ctx->vcp_ctlr.vol_ctlr));
+}
+
+/* Start measuring the step size if it is not known yet and the volume the
+ * write starts from has been reported by the device */
+static void probe_step(struct device_context *ctx)
+{
+    if (volume_step[ctx->device_id] == 0 && state_valid[ctx->device_id]) {
+        step_from[ctx->device_id] = ctx->vcp_ctlr.state.volume;
+        step_probe[ctx->device_id] = true;
+    }
 }
 
-int vcp_cmd_read_flags(uint8_t device_id)
+int vcp_cmd_volume_up(uint8_t device_id, ble_cmd_handle_t cmd_id)
 {
     struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
-    return bt_vcp_vol_ctlr_read_flags(ctx->vcp_ctlr.vol_ctlr);
+    probe_step(ctx);
+    write_cmd[device_id] = cmd_id;
+    return cmd_started(&write_cmd[device_id], bt_vcp_vol_ctlr_vol_up(ctx->vcp_ctlr.vol_ctlr));
 }
 
-int vcp_cmd_volume_up(uint8_t device_id)
+int vcp_cmd_volume_down(uint8_t device_id, ble_cmd_handle_t cmd_id)
 {
     struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
-    return bt_vcp_vol_ctlr_vol_up(ctx->vcp_ctlr.vol_ctlr);
+    probe_step(ctx);
+    write_cmd[device_id] = cmd_id;
+    return cmd_started(&write_cmd[device_id], bt_vcp_vol_ctlr_vol_down(ctx->vcp_ctlr.vol_ctlr));
 }
 
-int vcp_cmd_volume_down(uint8_t device_id)
+int vcp_cmd_set_volume(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t volume)
 {
     struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
-    return bt_vcp_vol_ctlr_vol_down(ctx->vcp_ctlr.vol_ctlr);
+    write_cmd[device_id] = cmd_id;
+    return cmd_started(&write_cmd[device_id], bt_vcp_vol_ctlr_set_vol(ctx->vcp_ctlr.vol_ctlr, volume));
 }
 
-int vcp_cmd_set_volume(uint8_t device_id, uint8_t volume)
+int vcp_cmd_mute(uint8_t device_id, ble_cmd_handle_t cmd_id)
 {
     struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
-    return bt_vcp_vol_ctlr_set_vol(ctx->vcp_ctlr.vol_ctlr, volume);
+    write_cmd[device_id] = cmd_id;
+    return cmd_started(&write_cmd[device_id], bt_vcp_vol_ctlr_mute(ctx->vcp_ctlr.vol_ctlr));
 }
 
-int vcp_cmd_mute(uint8_t device_id)
+int vcp_cmd_unmute(uint8_t device_id, ble_cmd_handle_t cmd_id)
 {
     struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
-    return bt_vcp_vol_ctlr_mute(ctx->vcp_ctlr.vol_ctlr);
+    write_cmd[device_id] = cmd_id;
+    return cmd_started(&write_cmd[device_id], bt_vcp_vol_ctlr_unmute(ctx->vcp_ctlr.vol_ctlr));
+}
+
+uint8_t vcp_controller_get_volume_step(uint8_t device_id)
+{
+    return volume_step[device_id];
 }
 
-int vcp_cmd_unmute(uint8_t device_id)
+void vcp_controller_apply_state(uint8_t device_id, uint8_t volume, uint8_t mute)
 {
     struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
-    return bt_vcp_vol_ctlr_unmute(ctx->vcp_ctlr.vol_ctlr);
+
+    /* A step that ended at either end of the range may have been cut short */
+    if (step_probe[device_id] && volume != step_from[device_id]) {
+        step_probe[device_id] = false;
+        if (volume != 0 && volume != UINT8_MAX) {
+            volume_step[device_id] = abs(volume - step_from[device_id]);
+            LOG_INF("Volume step size is %u [DEVICE ID %d]", volume_step[device_id], device_id);
+        }
+    }
+
+    ctx->vcp_ctlr.state.volume = volume;
+    ctx->vcp_ctlr.state.mute = mute;
+    state_valid[device_id] = true;
+    session_snapshot_set_volume(&ctx->info.addr, volume, mute);
+
+    /* Update display with current volume state */
+    display_manager_update_volume(ctx->device_id, volume, mute);
+
+    state_reconciler_vcp_state_changed(ctx->device_id);
 }
 
 static void vcp_state_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err, uint8_t volume, uint8_t mute)
@@ -86,23 +172,20 @@ static void vcp_state_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err, uint8_t volu
     struct device_context *ctx = get_device_context_by_vol_ctlr(vol_ctlr);
     if (err) {
         LOG_ERR("VCP state error (err %d) [DEVICE ID %d]", err, ctx->device_id);
-        ble_cmd_complete(ctx->device_id, err);
+        ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&read_state_cmd[ctx->device_id]), err);
         return;
     }
 
-    ctx->vcp_ctlr.state.volume = volume;
-    ctx->vcp_ctlr.state.mute = mute;
+    vcp_controller_apply_state(ctx->device_id, volume, mute);
 
     float volume_percent = (float)ctx->vcp_ctlr.state.volume * 100.0f / 255.0f;
 
-    /* Update display with current volume state */
-    display_manager_update_volume(ctx->device_id, volume, mute);
-
-    // Mark as complete only if this was a READ_STATE command
-    if (ctx->current_ble_cmd && ctx->current_ble_cmd->type == BLE_CMD_VCP_READ_STATE) {
+    // Mark as complete only if a READ_STATE command is waiting for it
+    ble_cmd_handle_t cmd_id = ble_cmd_take_id(&read_state_cmd[ctx->device_id]);
+    if (cmd_id) {
         LOG_INF("VCP state read: Volume: %u%%, Mute: %u [DEVICE ID %d]", (uint8_t)(volume_percent), ctx->vcp_ctlr.state.mute, ctx->device_id);
         app_controller_notify_vcp_state_read(ctx->device_id, 0);
-        ble_cmd_complete(ctx->device_id, 0);
+        ble_cmd_complete(ctx->device_id, cmd_id, 0);
     } else {
         LOG_DBG("VCP state notification: Volume: %u%%, Mute: %u [DEVICE ID %d]", (uint8_t)(volume_percent), ctx->vcp_ctlr.state.mute, ctx->device_id);
     }
@@ -113,16 +196,17 @@ static void vcp_flags_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err, uint8_t flag
     struct device_context *ctx = get_device_context_by_vol_ctlr(vol_ctlr);
     if (err) {
         LOG_ERR("VCP flags error (err %d) [DEVICE ID %d]", err, ctx->device_id);
-        ble_cmd_complete(ctx->device_id, err);
+        ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&read_flags_cmd[ctx->device_id]), err);
         return;
     }
 
     LOG_DBG("VCP flags: 0x%02X [DEVICE ID %d]", flags, ctx->device_id);
     
-    // Mark as complete only if this was a READ_FLAGS command as it could also be a notification
-    // in which case we don't want to accidentally complete a different command
-    if (ctx->current_ble_cmd && ctx->current_ble_cmd->type == BLE_CMD_VCP_READ_FLAGS) {
-        ble_cmd_complete(ctx->device_id, 0);
+    // Mark as complete only if a READ_FLAGS command is waiting for it, as it could also be
+    // a notification in which case we don't want to accidentally complete a different command
+    ble_cmd_handle_t cmd_id = ble_cmd_take_id(&read_flags_cmd[ctx->device_id]);
+    if (cmd_id) {
+        ble_cmd_complete(ctx->device_id, cmd_id, 0);
     }
 }
 
@@ -134,7 +218,7 @@ static void vcp_discover_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err,
     if (err) {
         LOG_ERR("VCP discovery failed (err %d) [DEVICE ID %d]", err, ctx->device_id);
         app_controller_notify_vcp_discovered(ctx->device_id, err);
-        ble_cmd_complete(ctx->device_id, err);
+        ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&discover_cmd[ctx->device_id]), err);
         return;
     }
 
@@ -142,6 +226,7 @@ static void vcp_discover_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err,
 
     ctx->vcp_ctlr.vol_ctlr = vol_ctlr;
     ctx->info.vcp_discovered = true;
+    wake_trace_record(WAKE_TRACE_VCP_DISCOVERED, ctx->device_id);
 
     /* Only extract and cache handles if they weren't loaded from cache.
      * This avoids unnecessary stack usage from settings operations when
@@ -151,45 +236,8 @@ static void vcp_discover_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err,
         struct bt_vcp_vol_ctlr_handles handles;
         int get_err = bt_vcp_vol_ctlr_get_handles(vol_ctlr, &handles);
         if (get_err == 0) {
-            /* Store handles for the current device */
-            vcp_settings_store_handles(&ctx->info.addr, &handles);
-
-            /* If this is a new device (initial pairing) and part of a CSIP set, also store handles
-             * for all other set members. Since all hearing aids in the set have identical firmware
-             * and GATT layout, we can reuse the same handles for all set members.
-             * Skip this on reconnection to avoid unnecessary work and potential stack issues. */
-            // if (ctx->info.is_new_device) {
-                struct bond_collection collection;
-                if (devices_manager_get_bonded_devices_collection(&collection) == 0) {
-                    struct bonded_device_entry current_entry;
-                    if (devices_manager_find_bonded_entry_by_addr(&ctx->info.addr, &current_entry) &&
-                        current_entry.is_set_member) {
-
-                    LOG_DBG("Current device is CSIP set member, caching VCP handles for all set members");
-
-                    for (uint8_t i = 0; i < collection.count; i++) {
-                        /* Skip the current device (already stored) */
-                        if (bt_addr_le_cmp(&collection.devices[i].addr, &ctx->info.addr) == 0) {
-                            continue;
-                        }
-
-                        /* Only store for devices in the same CSIP set */
-                        if (collection.devices[i].is_set_member &&
-                            memcmp(collection.devices[i].sirk, current_entry.sirk, CSIP_SIRK_SIZE) == 0) {
-
-                            int err = vcp_settings_store_handles(&collection.devices[i].addr, &handles);
-                            if (err == 0) {
-                                char addr_str[BT_ADDR_LE_STR_LEN];
-                                bt_addr_le_to_str(&collection.devices[i].addr, addr_str, sizeof(addr_str));
-                                LOG_INF("VCP handles also cached for set member: %s", addr_str);
-                            } else {
-                                LOG_WRN("Failed to cache VCP handles for set member (err %d)", err);
-                            }
-                        }
-                    }
-                }
-                }
-            // }
+            /* Queued for this device and its set members, written outside the RX context */
+            handle_cache_store(HANDLE_CACHE_VCP, &ctx->info.addr, &handles);
         } else {
             LOG_WRN("Failed to get VCP handles for caching (err %d)", get_err);
         }
@@ -199,7 +247,7 @@ static void vcp_discover_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err,
 
     // Mark discovery command as complete
     app_controller_notify_vcp_discovered(ctx->device_id, err);
-    ble_cmd_complete(ctx->device_id, 0);
+    ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&discover_cmd[ctx->device_id]), 0);
 }
 
 static void vcp_vol_down_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err)
@@ -208,11 +256,12 @@ static void vcp_vol_down_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err)
 
     if (err) {
         LOG_ERR("VCP volume down error (err %d) [DEVICE ID %d]", err, ctx->device_id);
+        step_probe[ctx->device_id] = false;
     } else {
         LOG_INF("Volume down success [DEVICE ID %d]", ctx->device_id);
     }
     
-    ble_cmd_complete(ctx->device_id, err);
+    ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&write_cmd[ctx->device_id]), err);
 }
 
 static void vcp_vol_up_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err)
@@ -221,11 +270,20 @@ static void vcp_vol_up_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err)
 
     if (err) {
         LOG_ERR("VCP volume up error (err %d) [DEVICE ID %d]", err, ctx->device_id);
+        step_probe[ctx->device_id] = false;
     } else {
         LOG_INF("Volume up success [DEVICE ID %d]", ctx->device_id);
+
+        static bool first_vol_up_dumped;
+        if (!first_vol_up_dumped) {
+            /* End of the wake-to-action path, dump it once per boot */
+            first_vol_up_dumped = true;
+            wake_trace_record(WAKE_TRACE_FIRST_VOL_UP, ctx->device_id);
+            wake_trace_dump();
+        }
     }
 
-    ble_cmd_complete(ctx->device_id, err);
+    ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&write_cmd[ctx->device_id]), err);
 }
 
 static void vcp_mute_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err)
@@ -238,7 +296,7 @@ static void vcp_mute_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err)
         LOG_INF("Mute success [DEVICE ID %d]", ctx->device_id);
     }
 
-    ble_cmd_complete(ctx->device_id, err);
+    ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&write_cmd[ctx->device_id]), err);
 }
 
 static void vcp_unmute_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err)
@@ -251,7 +309,7 @@ static void vcp_unmute_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err)
         LOG_INF("Unmute success [DEVICE ID %d]", ctx->device_id);
     }
 
-    ble_cmd_complete(ctx->device_id, err);
+    ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&write_cmd[ctx->device_id]), err);
 }
 
 static void vcp_vol_up_unmute_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err)
@@ -264,7 +322,7 @@ static void vcp_vol_up_unmute_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err)
         LOG_INF("Volume up and unmute success [DEVICE ID %d]", ctx->device_id);
     }
 
-    ble_cmd_complete(ctx->device_id, err);
+    ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&write_cmd[ctx->device_id]), err);
 }
 
 static void vcp_vol_down_unmute_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err)
@@ -277,7 +335,20 @@ static void vcp_vol_down_unmute_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err)
         LOG_INF("Volume down and unmute success [DEVICE ID %d]", ctx->device_id);
     }
 
-    ble_cmd_complete(ctx->device_id, err);
+    ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&write_cmd[ctx->device_id]), err);
+}
+
+static void vcp_vol_set_cb(struct bt_vcp_vol_ctlr *vol_ctlr, int err)
+{
+    struct device_context *ctx = get_device_context_by_vol_ctlr(vol_ctlr);
+
+    if (err) {
+        LOG_ERR("VCP set volume error (err %d) [DEVICE ID %d]", err, ctx->device_id);
+    } else {
+        LOG_INF("Set volume success [DEVICE ID %d]", ctx->device_id);
+    }
+
+    ble_cmd_complete(ctx->device_id, ble_cmd_take_id(&write_cmd[ctx->device_id]), err);
 }
 
 static struct bt_vcp_vol_ctlr_cb vcp_callbacks = {
@@ -290,7 +361,25 @@ static struct bt_vcp_vol_ctlr_cb vcp_callbacks = {
     .unmute = vcp_unmute_cb,
     .vol_up_unmute = vcp_vol_up_unmute_cb,
     .vol_down_unmute = vcp_vol_down_unmute_cb,
-    .vol_set = NULL,
+    .vol_set = vcp_vol_set_cb,
+};
+
+static int vcp_cache_load(const bt_addr_le_t *addr, void *data)
+{
+    return vcp_settings_load_handles(addr, data);
+}
+
+static int vcp_cache_store(const bt_addr_le_t *addr, const void *data)
+{
+    return vcp_settings_store_handles(addr, data);
+}
+
+static const struct handle_cache_ops vcp_cache_ops = {
+    .name = "VCP",
+    .size = sizeof(struct bt_vcp_vol_ctlr_handles),
+    .load = vcp_cache_load,
+    .store = vcp_cache_store,
+    .clear = vcp_settings_clear_handles,
 };
 
 /* Initialize VCP controller */
@@ -298,6 +387,12 @@ int vcp_controller_init(void)
 {
     int err;
 
+    err = handle_cache_register(HANDLE_CACHE_VCP, &vcp_cache_ops);
+    if (err) {
+        LOG_ERR("Failed to register VCP handle cache (err %d)", err);
+        return err;
+    }
+
     err = bt_vcp_vol_ctlr_cb_register(&vcp_callbacks);
     if (err) {
         LOG_ERR("Failed to register VCP callbacks (err %d)", err);
@@ -317,6 +412,9 @@ void vcp_controller_reset(uint8_t device_id)
     ctx->info.vcp_discovered = false;
     ctx->vcp_ctlr.vol_ctlr = NULL;
     handles_from_cache[device_id] = false;
+    volume_step[device_id] = 0;
+    step_probe[device_id] = false;
+    state_valid[device_id] = false;
 
     LOG_DBG("VCP controller state reset [DEVICE ID %d]", ctx->device_id);
 }
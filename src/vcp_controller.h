@@ -1,6 +1,7 @@
 #ifndef VCP_CONTROLLER_H
 #define VCP_CONTROLLER_H
 
+#include "ble_manager.h"
 #include <zephyr/kernel.h>
 #include <zephyr/bluetooth/bluetooth.h>
 #include <zephyr/bluetooth/conn.h>
@@ -13,16 +14,22 @@ struct vcp_load_context {
 };
 
 int vcp_controller_init(void);
-int vcp_cmd_discover(uint8_t device_id);
-int vcp_cmd_volume_up(uint8_t device_id);
-int vcp_cmd_volume_down(uint8_t device_id);
-int vcp_cmd_set_volume(uint8_t device_id, uint8_t volume);
-int vcp_cmd_mute(uint8_t device_id);
-int vcp_cmd_unmute(uint8_t device_id);
-int vcp_cmd_read_state(uint8_t device_id);
-int vcp_cmd_read_flags(uint8_t device_id);
+int vcp_cmd_discover(uint8_t device_id, ble_cmd_handle_t cmd_id);
+int vcp_cmd_volume_up(uint8_t device_id, ble_cmd_handle_t cmd_id);
+int vcp_cmd_volume_down(uint8_t device_id, ble_cmd_handle_t cmd_id);
+int vcp_cmd_set_volume(uint8_t device_id, ble_cmd_handle_t cmd_id, uint8_t volume);
+int vcp_cmd_mute(uint8_t device_id, ble_cmd_handle_t cmd_id);
+int vcp_cmd_unmute(uint8_t device_id, ble_cmd_handle_t cmd_id);
+int vcp_cmd_read_state(uint8_t device_id, ble_cmd_handle_t cmd_id);
+int vcp_cmd_read_flags(uint8_t device_id, ble_cmd_handle_t cmd_id);
 void vcp_controller_reset(uint8_t device_id);
 
+/* Volume change of one relative step on the device, 0 until it has been seen */
+uint8_t vcp_controller_get_volume_step(uint8_t device_id);
+
+/* Store a Volume State read from the device and update the display */
+void vcp_controller_apply_state(uint8_t device_id, uint8_t volume, uint8_t mute);
+
 /* Global state */
 extern bool volume_direction;
 
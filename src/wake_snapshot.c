@@ -0,0 +1,264 @@
+/**
+ * @file wake_snapshot.c
+ * @brief One-shot read of the state shown after a wake-up
+ */
+
+#include "wake_snapshot.h"
+#include "ble_manager.h"
+#include "devices_manager.h"
+#include "battery_reader.h"
+#include "vcp_controller.h"
+#include "has_controller.h"
+
+#include <zephyr/bluetooth/att.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+LOG_MODULE_REGISTER(wake_snapshot, LOG_LEVEL_INF);
+
+enum snapshot_field {
+	SNAPSHOT_BATTERY,
+	SNAPSHOT_VOLUME,
+	SNAPSHOT_PRESET,
+	SNAPSHOT_FIELD_COUNT,
+};
+
+static const char *const field_names[SNAPSHOT_FIELD_COUNT] = {
+	[SNAPSHOT_BATTERY] = "Battery Level",
+	[SNAPSHOT_VOLUME] = "Volume State",
+	[SNAPSHOT_PRESET] = "Active Preset Index",
+};
+
+struct snapshot_read {
+	struct bt_gatt_read_params params;
+	ble_cmd_handle_t cmd_id;
+	uint16_t handles[SNAPSHOT_FIELD_COUNT];
+	uint8_t fields[SNAPSHOT_FIELD_COUNT]; /* enum snapshot_field of each handle */
+	uint8_t count;
+	uint8_t next;    /* Index of the value expected next */
+	uint8_t applied; /* Values handed to the profile handlers */
+};
+
+static struct snapshot_read reads[CONFIG_BT_MAX_CONN];
+
+/* Peer of each device slot that rejected Read Multiple Variable Length */
+static bt_addr_le_t no_read_mult_var[CONFIG_BT_MAX_CONN];
+
+static void add_field(struct snapshot_read *read, enum snapshot_field field, uint16_t handle)
+{
+	if (handle == 0) {
+		return;
+	}
+
+	read->fields[read->count] = field;
+	read->handles[read->count] = handle;
+	read->count++;
+}
+
+static void collect_handles(struct device_context *ctx, struct snapshot_read *read)
+{
+	if (ctx->info.bas_discovered) {
+		add_field(read, SNAPSHOT_BATTERY, ctx->bas_ctlr.battery_level_handle);
+	}
+
+	if (ctx->info.vcp_discovered) {
+		struct bt_vcp_vol_ctlr_handles vcp;
+
+		if (bt_vcp_vol_ctlr_get_handles(ctx->vcp_ctlr.vol_ctlr, &vcp) == 0) {
+			add_field(read, SNAPSHOT_VOLUME, vcp.state_handle);
+		}
+	}
+
+	if (ctx->info.has_discovered) {
+		struct bt_has_handles has;
+
+		if (bt_has_client_get_handles(ctx->has_ctlr.has, &has) == 0) {
+			add_field(read, SNAPSHOT_PRESET, has.active_index_handle);
+		}
+	}
+}
+
+static void apply_value(struct device_context *ctx, struct snapshot_read *read,
+			const uint8_t *data, uint16_t length)
+{
+	enum snapshot_field field = read->fields[read->next];
+
+	switch (field) {
+	case SNAPSHOT_BATTERY:
+		if (length != 1) {
+			break;
+		}
+		battery_reader_apply_level(ctx->device_id, data[0]);
+		read->applied++;
+		return;
+
+	case SNAPSHOT_VOLUME:
+		/* Volume Setting, Mute, Change Counter */
+		if (length != 3) {
+			break;
+		}
+		vcp_controller_apply_state(ctx->device_id, data[0], data[1]);
+		read->applied++;
+		return;
+
+	case SNAPSHOT_PRESET:
+		if (length != 1) {
+			break;
+		}
+		has_controller_apply_active_preset(ctx->device_id, data[0]);
+		read->applied++;
+		return;
+
+	default:
+		break;
+	}
+
+	LOG_WRN("Unexpected %s length %u [DEVICE ID %d]", field_names[field], length,
+		ctx->device_id);
+}
+
+static void finish(struct device_context *ctx)
+{
+	struct snapshot_read *read = &reads[ctx->device_id];
+
+	LOG_INF("Wake snapshot: %u of %u value(s) read [DEVICE ID %d]", read->applied, read->count,
+		ctx->device_id);
+	ble_cmd_complete(ctx->device_id, read->cmd_id, 0);
+}
+
+static uint8_t single_read_cb(struct bt_conn *conn, uint8_t err,
+			      struct bt_gatt_read_params *params, const void *data,
+			      uint16_t length);
+
+/* Read the values from read->next on one at a time, completes the command after the last */
+static void read_next_single(struct device_context *ctx)
+{
+	struct snapshot_read *read = &reads[ctx->device_id];
+
+	while (read->next < read->count) {
+		read->params.func = single_read_cb;
+		read->params.handle_count = 1;
+		read->params.single.handle = read->handles[read->next];
+		read->params.single.offset = 0;
+
+		int err = bt_gatt_read(ctx->conn, &read->params);
+		if (err == 0) {
+			return;
+		}
+
+		LOG_WRN("Failed to read %s (err %d) [DEVICE ID %d]",
+			field_names[read->fields[read->next]], err, ctx->device_id);
+		read->next++;
+	}
+
+	finish(ctx);
+}
+
+static uint8_t single_read_cb(struct bt_conn *conn, uint8_t err,
+			      struct bt_gatt_read_params *params, const void *data,
+			      uint16_t length)
+{
+	struct device_context *ctx = devices_manager_get_device_context_by_conn(conn);
+	if (!ctx) {
+		return BT_GATT_ITER_STOP;
+	}
+
+	struct snapshot_read *read = &reads[ctx->device_id];
+
+	if (err) {
+		LOG_WRN("%s read failed (err %u) [DEVICE ID %d]",
+			field_names[read->fields[read->next]], err, ctx->device_id);
+	} else {
+		apply_value(ctx, read, data, data ? length : 0);
+	}
+
+	read->next++;
+	read_next_single(ctx);
+	return BT_GATT_ITER_STOP;
+}
+
+/* Called once per value of the response, then once with data == NULL */
+static uint8_t multi_read_cb(struct bt_conn *conn, uint8_t err,
+			     struct bt_gatt_read_params *params, const void *data,
+			     uint16_t length)
+{
+	struct device_context *ctx = devices_manager_get_device_context_by_conn(conn);
+	if (!ctx) {
+		return BT_GATT_ITER_STOP;
+	}
+
+	struct snapshot_read *read = &reads[ctx->device_id];
+
+	if (err) {
+		if (err == BT_ATT_ERR_NOT_SUPPORTED) {
+			LOG_INF("Read Multiple Variable Length not supported - reading values one "
+				"by one [DEVICE ID %d]",
+				ctx->device_id);
+			bt_addr_le_copy(&no_read_mult_var[ctx->device_id], &ctx->info.addr);
+		} else {
+			LOG_WRN("Read Multiple Variable Length failed (err %u) - reading values one "
+				"by one [DEVICE ID %d]",
+				err, ctx->device_id);
+		}
+
+		read->next = 0;
+		read_next_single(ctx);
+		return BT_GATT_ITER_STOP;
+	}
+
+	if (!data) {
+		if (read->next < read->count) {
+			LOG_WRN("Response ended after %u of %u value(s) [DEVICE ID %d]", read->next,
+				read->count, ctx->device_id);
+		}
+
+		/* Picks up whatever the response did not contain */
+		read_next_single(ctx);
+		return BT_GATT_ITER_STOP;
+	}
+
+	if (read->next < read->count) {
+		apply_value(ctx, read, data, length);
+		read->next++;
+	}
+
+	return BT_GATT_ITER_CONTINUE;
+}
+
+int wake_snapshot_cmd_read(uint8_t device_id, ble_cmd_handle_t cmd_id)
+{
+	struct device_context *ctx = devices_manager_get_device_context_by_id(device_id);
+	if (!ctx || !ctx->conn) {
+		return -ENOTCONN;
+	}
+
+	struct snapshot_read *read = &reads[device_id];
+	memset(read, 0, sizeof(*read));
+	read->cmd_id = cmd_id;
+	collect_handles(ctx, read);
+
+	if (read->count == 0) {
+		LOG_DBG("No service discovered, nothing to read [DEVICE ID %d]", device_id);
+		ble_cmd_complete(device_id, cmd_id, 0);
+		return 0;
+	}
+
+	if (read->count == 1 || bt_addr_le_cmp(&no_read_mult_var[device_id], &ctx->info.addr) == 0) {
+		read_next_single(ctx);
+		return 0;
+	}
+
+	read->params.func = multi_read_cb;
+	read->params.handle_count = read->count;
+	read->params.multiple.handles = read->handles;
+	read->params.multiple.variable = true;
+
+	int err = bt_gatt_read(ctx->conn, &read->params);
+	if (err == -ENOTSUP) {
+		read_next_single(ctx);
+		return 0;
+	}
+
+	return err;
+}
@@ -0,0 +1,34 @@
+/**
+ * @file wake_snapshot.h
+ * @brief One-shot read of the state shown after a wake-up
+ *
+ * Battery Level, Volume State and the HAS Active Preset Index are fetched
+ * with a single ATT Read Multiple Variable Length request once the services
+ * of a device are known. Peers that reject the request get the values read
+ * one by one instead. Either way the values go through the same handlers as
+ * the individual reads, so the device context, the session snapshot and the
+ * display are updated exactly as before.
+ */
+
+#ifndef WAKE_SNAPSHOT_H_
+#define WAKE_SNAPSHOT_H_
+
+#include "ble_manager.h"
+
+#include <stdint.h>
+
+/**
+ * @brief Read the wake-up state of a device (BLE_CMD_WAKE_SNAPSHOT)
+ *
+ * Only characteristics whose service has been discovered are read. Always
+ * completes the command with 0; a value that could not be read keeps what
+ * the session snapshot restored.
+ *
+ * @param device_id Device ID
+ * @param cmd_id Command completed once all values are in
+ * @return 0 if the read was started or nothing had to be read,
+ *         negative errno otherwise
+ */
+int wake_snapshot_cmd_read(uint8_t device_id, ble_cmd_handle_t cmd_id);
+
+#endif /* WAKE_SNAPSHOT_H_ */
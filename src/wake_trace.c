@@ -0,0 +1,212 @@
+/**
+ * @file wake_trace.c
+ * @brief Timestamped wake-to-action latency trace kept in .noinit RAM
+ */
+
+#include "wake_trace.h"
+
+#include <stdarg.h>
+#include <string.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/linker/section_tags.h>
+#include <zephyr/sys/util.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+LOG_MODULE_REGISTER(wake_trace, LOG_LEVEL_INF);
+
+#define WAKE_TRACE_MAGIC 0x57414B45 /* "WAKE" */
+
+struct wake_trace_entry {
+	uint32_t cycles;   /* k_cycle_get_32() when the milestone was reached */
+	uint8_t point;     /* enum wake_trace_point */
+	uint8_t device_id; /* Device ID or WAKE_TRACE_NO_DEVICE */
+};
+
+struct wake_trace_ring {
+	uint32_t magic;
+	uint32_t reset_cause;
+	uint8_t wake_button;
+	bool first_vol_up_seen;
+	uint16_t head;  /* Next slot to write */
+	uint16_t count; /* Valid entries, saturates at WAKE_TRACE_SIZE */
+	struct wake_trace_entry entries[WAKE_TRACE_SIZE];
+};
+
+/* Not cleared on reset. Starting a new trace moves an intact one to previous,
+ * so the trace of the last wake can still be inspected after a soft reset. */
+static __noinit struct wake_trace_ring trace;
+static __noinit struct wake_trace_ring previous;
+static struct k_spinlock trace_lock;
+
+static const char *const point_names[WAKE_TRACE_POINT_COUNT] = {
+	[WAKE_TRACE_WAKEUP_SOURCE] = "wakeup_source",
+	[WAKE_TRACE_SETTINGS_LOADED] = "settings_loaded",
+	[WAKE_TRACE_BT_ENABLE] = "bt_enable",
+	[WAKE_TRACE_BT_READY] = "bt_ready",
+	[WAKE_TRACE_CONN_CREATE] = "conn_create",
+	[WAKE_TRACE_CONNECTED] = "connected",
+	[WAKE_TRACE_SECURITY_CHANGED] = "security_changed",
+	[WAKE_TRACE_BAS_DISCOVERED] = "bas_discovered",
+	[WAKE_TRACE_VCP_DISCOVERED] = "vcp_discovered",
+	[WAKE_TRACE_HAS_DISCOVERED] = "has_discovered",
+	[WAKE_TRACE_FIRST_VOL_UP] = "first_vol_up",
+};
+
+/* Whether a ring survived the reset intact, rather than holding power-on garbage */
+static bool wake_trace_valid(const struct wake_trace_ring *ring)
+{
+	return ring->magic == WAKE_TRACE_MAGIC && ring->head < WAKE_TRACE_SIZE &&
+	       ring->count <= WAKE_TRACE_SIZE;
+}
+
+void wake_trace_start(uint32_t reset_cause, uint8_t wake_button)
+{
+	if (wake_trace_valid(&trace)) {
+		previous = trace;
+	} else {
+		previous.magic = 0;
+	}
+
+	memset(&trace, 0, sizeof(trace));
+	trace.magic = WAKE_TRACE_MAGIC;
+	trace.reset_cause = reset_cause;
+	trace.wake_button = wake_button;
+
+	wake_trace_record(WAKE_TRACE_WAKEUP_SOURCE, WAKE_TRACE_NO_DEVICE);
+}
+
+void wake_trace_record(enum wake_trace_point point, uint8_t device_id)
+{
+	uint32_t now = k_cycle_get_32();
+	k_spinlock_key_t key = k_spin_lock(&trace_lock);
+
+	if (trace.magic != WAKE_TRACE_MAGIC) {
+		k_spin_unlock(&trace_lock, key);
+		return;
+	}
+
+	/* Only the first volume up after wake is of interest */
+	if (point == WAKE_TRACE_FIRST_VOL_UP) {
+		if (trace.first_vol_up_seen) {
+			k_spin_unlock(&trace_lock, key);
+			return;
+		}
+		trace.first_vol_up_seen = true;
+	}
+
+	struct wake_trace_entry *entry = &trace.entries[trace.head];
+	entry->cycles = now;
+	entry->point = point;
+	entry->device_id = device_id;
+
+	trace.head = (trace.head + 1) % WAKE_TRACE_SIZE;
+	if (trace.count < WAKE_TRACE_SIZE) {
+		trace.count++;
+	}
+
+	k_spin_unlock(&trace_lock, key);
+}
+
+/* Copy the ring out in chronological order so it can be printed without holding the lock */
+static uint16_t wake_trace_snapshot(const struct wake_trace_ring *ring,
+				    struct wake_trace_ring *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&trace_lock);
+
+	if (!wake_trace_valid(ring)) {
+		k_spin_unlock(&trace_lock, key);
+		return 0;
+	}
+
+	*out = *ring;
+	k_spin_unlock(&trace_lock, key);
+
+	return out->count;
+}
+
+static void wake_trace_print(const struct wake_trace_ring *ring,
+			     void (*print)(void *arg, const char *fmt, ...), void *arg)
+{
+	struct wake_trace_ring copy;
+	uint16_t count = wake_trace_snapshot(ring, &copy);
+
+	if (count == 0) {
+		print(arg, "No wake trace recorded");
+		return;
+	}
+
+	uint16_t start = (copy.head + WAKE_TRACE_SIZE - count) % WAKE_TRACE_SIZE;
+	uint32_t origin = copy.entries[start].cycles;
+	uint32_t prev = origin;
+
+	print(arg, "Wake trace: reset cause 0x%08X, wake button %u, %u milestone(s)",
+	      copy.reset_cause, copy.wake_button, count);
+
+	for (uint16_t i = 0; i < count; i++) {
+		const struct wake_trace_entry *entry = &copy.entries[(start + i) % WAKE_TRACE_SIZE];
+		const char *name = entry->point < WAKE_TRACE_POINT_COUNT ?
+					   point_names[entry->point] : "unknown";
+		uint32_t total_us = k_cyc_to_us_floor32(entry->cycles - origin);
+		uint32_t delta_us = k_cyc_to_us_floor32(entry->cycles - prev);
+
+		if (entry->device_id == WAKE_TRACE_NO_DEVICE) {
+			print(arg, "  %8u us (+%7u us) %s", total_us, delta_us, name);
+		} else {
+			print(arg, "  %8u us (+%7u us) %s [DEVICE ID %d]", total_us, delta_us, name,
+			      entry->device_id);
+		}
+
+		prev = entry->cycles;
+	}
+}
+
+static void wake_trace_log_print(void *arg, const char *fmt, ...)
+{
+	ARG_UNUSED(arg);
+
+	char line[96];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintk(line, sizeof(line), fmt, args);
+	va_end(args);
+
+	LOG_INF("%s", line);
+}
+
+void wake_trace_dump(void)
+{
+	wake_trace_print(&trace, wake_trace_log_print, NULL);
+}
+
+void wake_trace_dump_previous(void)
+{
+	wake_trace_print(&previous, wake_trace_log_print, NULL);
+}
+
+#if defined(CONFIG_SHELL)
+static void wake_trace_shell_print(void *arg, const char *fmt, ...)
+{
+	const struct shell *sh = arg;
+	va_list args;
+
+	va_start(args, fmt);
+	shell_vfprintf(sh, SHELL_NORMAL, fmt, args);
+	va_end(args);
+	shell_fprintf(sh, SHELL_NORMAL, "\n");
+}
+
+static int cmd_wake_trace(const struct shell *sh, size_t argc, char **argv)
+{
+	bool prev = argc > 1 && strcmp(argv[1], "previous") == 0;
+
+	wake_trace_print(prev ? &previous : &trace, wake_trace_shell_print, (void *)sh);
+	return 0;
+}
+
+SHELL_CMD_REGISTER(wake_trace, NULL,
+		   "Print the wake-to-action latency trace, 'previous' for the one before",
+		   cmd_wake_trace);
+#endif /* CONFIG_SHELL */
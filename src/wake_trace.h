@@ -0,0 +1,70 @@
+/**
+ * @file wake_trace.h
+ * @brief Timestamped wake-to-action latency trace kept in .noinit RAM
+ */
+
+#ifndef WAKE_TRACE_H_
+#define WAKE_TRACE_H_
+
+#include <zephyr/kernel.h>
+#include <stdint.h>
+
+/* Number of milestones kept per wake cycle (oldest are overwritten) */
+#define WAKE_TRACE_SIZE 32
+
+/* Device ID used for milestones that are not tied to a hearing aid */
+#define WAKE_TRACE_NO_DEVICE 0xFF
+
+/**
+ * @brief Milestones recorded between the GPIO latch and the first VCP write
+ */
+enum wake_trace_point {
+	WAKE_TRACE_WAKEUP_SOURCE,     /* get_wakeup_source() in PRE_KERNEL_1 */
+	WAKE_TRACE_SETTINGS_LOADED,   /* settings_load() in main() returned */
+	WAKE_TRACE_BT_ENABLE,         /* bt_enable() called */
+	WAKE_TRACE_BT_READY,          /* bt_ready_cb() entered */
+	WAKE_TRACE_CONN_CREATE,       /* bt_conn_le_create() issued */
+	WAKE_TRACE_CONNECTED,         /* connected_cb() */
+	WAKE_TRACE_SECURITY_CHANGED,  /* security_changed_cb() */
+	WAKE_TRACE_BAS_DISCOVERED,    /* Battery Service discovery complete */
+	WAKE_TRACE_VCP_DISCOVERED,    /* VCP discovery complete */
+	WAKE_TRACE_HAS_DISCOVERED,    /* HAS discovery complete */
+	WAKE_TRACE_FIRST_VOL_UP,      /* First vcp_vol_up_cb() since wake */
+	WAKE_TRACE_POINT_COUNT,
+};
+
+/**
+ * @brief Start a new trace
+ *
+ * A trace that survived the reset in .noinit RAM is kept as the previous
+ * one, replacing the one kept before it.
+ *
+ * Called from get_wakeup_source() before the kernel is running, so it must
+ * not use any kernel service other than reading the cycle counter.
+ *
+ * @param reset_cause Reset cause reported by hwinfo
+ * @param wake_button Button that woke the system, 0 if none
+ */
+void wake_trace_start(uint32_t reset_cause, uint8_t wake_button);
+
+/**
+ * @brief Record a milestone
+ *
+ * Safe to call from any context, including Bluetooth callbacks and ISRs.
+ *
+ * @param point Milestone that was reached
+ * @param device_id Device ID, or WAKE_TRACE_NO_DEVICE
+ */
+void wake_trace_record(enum wake_trace_point point, uint8_t device_id);
+
+/**
+ * @brief Print the current trace to the log
+ */
+void wake_trace_dump(void);
+
+/**
+ * @brief Print the trace of the wake before the current one to the log
+ */
+void wake_trace_dump_previous(void);
+
+#endif /* WAKE_TRACE_H_ */